@@ -0,0 +1,563 @@
+// Benchmarks of the hot paths of main.c, run against real volumes. Build with
+//   cc -O2 bench.c -o bench -pthread
+// and run as
+//   bench [-s scale] [-c cluster size] [-b stdio|mmap|uring] [image path]
+// Every run uses the same seeds and volume layouts, so the numbers of two
+// builds can be compared directly. Latencies are per operation, in
+// microseconds; throughput rows also report MB/s.
+#define main saod_main
+#include "main.c"
+#undef main
+
+enum {
+	BENCH_VOLUME = 64*1024*1024,
+	BENCH_ALLOCATIONS = 16*1024,
+	BENCH_LOOKUPS = 100*1000,
+	BENCH_SEEK_CLUSTERS = 16*1024,
+	BENCH_COLD_SEEKS = 10*1000,
+	BENCH_WARM_SEEKS = 100*1000,
+	BENCH_FILE = 64*1024*1024,
+	BENCH_CHUNK = 64*1024,
+	BENCH_QUEUE_FILE = 16*1024*1024,
+	BENCH_QUEUE_CHUNK = 1024*1024,
+	BENCH_RANDOM_BLOCK = 4*1024,
+	BENCH_RANDOM_OPS = 20*1000,
+	BENCH_LISTINGS = 20,
+	BENCH_NAME = 32
+};
+
+const char* BACKENDS[] = { "stdio", "mmap", "uring" };
+
+typedef struct {
+	uint64_t* samples;
+	size_t count;
+	size_t capacity;
+	uint64_t bytes;
+} Bench;
+
+typedef struct {
+	char* path;
+	uint64_t scale;
+	uint64_t cluster_size;
+	uint8_t backend;
+	uint64_t random;
+} BenchConfig;
+
+uint64_t now_ns() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// xorshift64*, seeded the same way on every run
+uint64_t next_random(BenchConfig* config) {
+	config->random ^= config->random >> 12;
+	config->random ^= config->random << 25;
+	config->random ^= config->random >> 27;
+	return config->random * 2685821657736338717ull;
+}
+
+void bench_start(Bench* bench, size_t expected) {
+	bench->samples = malloc(max(expected, 1) * sizeof(uint64_t));
+	bench->count = 0;
+	bench->capacity = bench->samples == NULL ? 0 : max(expected, 1);
+	bench->bytes = 0;
+}
+
+void bench_sample(Bench* bench, uint64_t started) {
+	uint64_t elapsed = now_ns() - started;
+	if(bench->count == bench->capacity) {
+		size_t capacity = bench->capacity ? bench->capacity * 2 : 1024;
+		uint64_t* samples = realloc(bench->samples, capacity * sizeof(uint64_t));
+		if(samples == NULL) {
+			return;
+		}
+		bench->samples = samples;
+		bench->capacity = capacity;
+	}
+	bench->samples[bench->count++] = elapsed;
+}
+
+int compare_samples(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+double percentile(Bench* bench, uint32_t percent) {
+	size_t index = (bench->count - 1) * percent / 100;
+	return bench->samples[index] / 1000.0;
+}
+
+void bench_print(Bench* bench, const char* name) {
+	if(bench->count == 0) {
+		printf("%-26s no samples\n", name);
+		free(bench->samples);
+		return;
+	}
+	uint64_t total = 0;
+	for(size_t i = 0; i != bench->count; i++) {
+		total += bench->samples[i];
+	}
+	qsort(bench->samples, bench->count, sizeof(uint64_t), compare_samples);
+	double seconds = total / 1e9;
+	printf("%-26s %9zu %12.0f", name, bench->count, bench->count / seconds);
+	if(bench->bytes != 0) {
+		printf(" %9.1f", bench->bytes / seconds / (1024 * 1024));
+	} else {
+		printf(" %9s", "-");
+	}
+	printf(" %9.2f %9.2f %9.2f %9.2f\n", percentile(bench, 50), percentile(bench, 90), percentile(bench, 99), percentile(bench, 100));
+	free(bench->samples);
+}
+
+Result fresh_volume(BenchConfig* config, FileSystem* fs, uint64_t size) {
+	if(init_fs_file(fs, config->path, size, config->cluster_size, config->backend)) {
+		fprintf(stderr, "Can't init %s.\n", config->path);
+		return 1;
+	}
+	return 0;
+}
+
+// Every file takes at least a cluster, plus the directory and index clusters
+uint64_t entries_volume(BenchConfig* config, uint64_t entries) {
+	return (entries * 2 + 4096) * config->cluster_size;
+}
+
+void bench_name(uint8_t* name, uint32_t number) {
+	memset(name, 0, FILE_NAME_BUFFER);
+	sprintf(name, "file%u", number);
+}
+
+Result bench_allocate(BenchConfig* config) {
+	FileSystem fs;
+	uint64_t count = BENCH_ALLOCATIONS * config->scale;
+	if(fresh_volume(config, &fs, count * config->cluster_size + BENCH_VOLUME / 16)) {
+		return 1;
+	}
+	Bench bench;
+	bench_start(&bench, count);
+	while(bench.count != count) {
+		uint64_t started = now_ns();
+		if(allocate(&fs) == TV_CANT_ALLOC) {
+			break;
+		}
+		bench_sample(&bench, started);
+	}
+	bench_print(&bench, "allocate (filling)");
+	close_fs_file(&fs);
+
+	// One chain grown cluster by cluster, the way directories grow
+	if(fresh_volume(config, &fs, count * config->cluster_size + BENCH_VOLUME / 16)) {
+		return 1;
+	}
+	ClusterLocation tail = allocate(&fs);
+	bench_start(&bench, count);
+	while(bench.count != count) {
+		uint64_t started = now_ns();
+		if(extend(&fs, &tail)) {
+			break;
+		}
+		bench_sample(&bench, started);
+	}
+	bench_print(&bench, "extend (filling)");
+	return close_fs_file(&fs);
+}
+
+Result bench_resolve(BenchConfig* config) {
+	static const uint32_t sizes[] = { 10, 100, 1000, 10000 };
+	FileSystem fs;
+	if(fresh_volume(config, &fs, entries_volume(config, 11110))) {
+		return 1;
+	}
+	DirCursor root;
+	get_root(&fs, &root);
+	uint8_t name[FILE_NAME_BUFFER];
+	for(uint32_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]); s++) {
+		DirEntry directory;
+		DirCursor cursor;
+		memset(name, 0, FILE_NAME_BUFFER);
+		sprintf(name, "dir%u", sizes[s]);
+		init_meta(&directory, 1, name);
+		if(create_file(&fs, &root, &directory) != OPTIONAL_OK) {
+			fprintf(stderr, "Can't create %s.\n", name);
+			return 1;
+		}
+		open_dir(&fs, &directory, &cursor);
+		for(uint32_t i = 0; i != sizes[s]; i++) {
+			DirEntry entry;
+			bench_name(name, i);
+			init_meta(&entry, 0, name);
+			if(create_file(&fs, &cursor, &entry) != OPTIONAL_OK) {
+				fprintf(stderr, "Can't create %s.\n", name);
+				return 1;
+			}
+		}
+		// "resolve" rows scan the directory on every lookup. "dcache" rows
+		// repeat the same lookups with the dentry cache of the default size.
+		uint64_t count = BENCH_LOOKUPS * config->scale;
+		uint64_t seed = config->random;
+		uint64_t after = seed;
+		uint8_t label[BENCH_NAME];
+		for(uint8_t cached = 0; cached != 2; cached++) {
+			if(resize_dentry_cache(&fs, cached ? DENTRY_CACHE_BYTES : 0)) {
+				fprintf(stderr, "Can't resize the dentry cache.\n");
+				return 1;
+			}
+			config->random = seed;
+			for(uint8_t miss = 0; miss != 2; miss++) {
+				Bench bench;
+				bench_start(&bench, count);
+				for(uint64_t i = 0; i != count; i++) {
+					DirEntry entry;
+					bench_name(name, next_random(config) % sizes[s] + (miss ? sizes[s] : 0));
+					uint64_t started = now_ns();
+					OptionalResult found = resolve(&fs, &cursor, &entry, name);
+					bench_sample(&bench, started);
+					if(found != (miss ? OPTIONAL_STRUCTURE_ERROR : OPTIONAL_OK)) {
+						fprintf(stderr, "Unexpected lookup result for %s.\n", name);
+						return 1;
+					}
+				}
+				sprintf(label, "%s %s in %u", cached ? "dcache" : "resolve", miss ? "miss" : "hit", sizes[s]);
+				bench_print(&bench, label);
+			}
+			if(!cached) {
+				after = config->random;
+			}
+		}
+		config->random = after;
+	}
+	return close_fs_file(&fs);
+}
+
+// Creates "data" with `length` bytes of zeros and opens it
+Result create_data(FileSystem* fs, FileCursor length, DirEntry* entry, FileIO* io) {
+	DirCursor root;
+	get_root(fs, &root);
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, "data");
+	init_meta(entry, 0, name);
+	if(create_file(fs, &root, entry) != OPTIONAL_OK) {
+		return 1;
+	}
+	open_file(fs, entry, io);
+	if(set_length(fs, io, length) != OPTIONAL_OK || close_file(fs, io)) {
+		return 1;
+	}
+	if(resolve(fs, &root, entry, name) != OPTIONAL_OK) {
+		return 1;
+	}
+	open_file(fs, entry, io);
+	return 0;
+}
+
+Result bench_seek(BenchConfig* config) {
+	FileSystem fs;
+	uint64_t clusters = BENCH_SEEK_CLUSTERS * config->scale;
+	if(fresh_volume(config, &fs, clusters * config->cluster_size * 2 + BENCH_VOLUME / 16)) {
+		return 1;
+	}
+	DirEntry entry;
+	FileIO io;
+	FileCursor length = clusters * config->cluster_size;
+	if(create_data(&fs, length, &entry, &io)) {
+		fprintf(stderr, "Can't create the data file.\n");
+		return 1;
+	}
+	close_file(&fs, &io);
+	// A fresh FileIO has to walk the FAT, a used one has the chain cached
+	Bench bench;
+	uint64_t count = BENCH_COLD_SEEKS * config->scale;
+	bench_start(&bench, count);
+	for(uint64_t i = 0; i != count; i++) {
+		FileCursor target = next_random(config) % length;
+		uint64_t started = now_ns();
+		open_file(&fs, &entry, &io);
+		OptionalResult moved = seek(&fs, &io, target);
+		close_file(&fs, &io);
+		bench_sample(&bench, started);
+		if(moved != OPTIONAL_OK) {
+			fprintf(stderr, "Seek failed.\n");
+			return 1;
+		}
+	}
+	bench_print(&bench, "seek (cold chain)");
+
+	count = BENCH_WARM_SEEKS * config->scale;
+	open_file(&fs, &entry, &io);
+	seek(&fs, &io, length - 1);
+	bench_start(&bench, count);
+	for(uint64_t i = 0; i != count; i++) {
+		FileCursor target = next_random(config) % length;
+		uint64_t started = now_ns();
+		seek(&fs, &io, target);
+		bench_sample(&bench, started);
+	}
+	close_file(&fs, &io);
+	bench_print(&bench, "seek (cached chain)");
+	return close_fs_file(&fs);
+}
+
+Result bench_io(BenchConfig* config) {
+	FileSystem fs;
+	FileCursor length = (FileCursor) BENCH_FILE * config->scale;
+	if(fresh_volume(config, &fs, length * 2 + BENCH_VOLUME / 16)) {
+		return 1;
+	}
+	uint8_t* buffer = malloc(BENCH_CHUNK);
+	if(buffer == NULL) {
+		return 1;
+	}
+	for(size_t i = 0; i != BENCH_CHUNK; i++) {
+		buffer[i] = next_random(config);
+	}
+	DirEntry entry;
+	FileIO io;
+	Bench bench;
+	if(create_data(&fs, 0, &entry, &io)) {
+		fprintf(stderr, "Can't create the data file.\n");
+		return 1;
+	}
+	bench_start(&bench, length / BENCH_CHUNK);
+	for(FileCursor done = 0; done < length; done += BENCH_CHUNK) {
+		uint64_t started = now_ns();
+		OptionalResult written = write_to_file(&fs, &io, buffer, BENCH_CHUNK);
+		bench_sample(&bench, started);
+		if(written != OPTIONAL_OK) {
+			fprintf(stderr, "Write failed.\n");
+			return 1;
+		}
+	}
+	bench.bytes = length;
+	bench_print(&bench, "write sequential 64K");
+	bench_start(&bench, 1);
+	uint64_t started = now_ns();
+	close_file(&fs, &io);
+	sync_fs_file(&fs);
+	bench_sample(&bench, started);
+	bench_print(&bench, "close and sync after it");
+
+	DirCursor root;
+	get_root(&fs, &root);
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, "data");
+	if(resolve(&fs, &root, &entry, name) != OPTIONAL_OK) {
+		fprintf(stderr, "Can't find the data file.\n");
+		return 1;
+	}
+	open_file(&fs, &entry, &io);
+	bench_start(&bench, length / BENCH_CHUNK);
+	for(FileCursor done = 0; done < length; done += BENCH_CHUNK) {
+		uint64_t started = now_ns();
+		Result failed = read_from_file(&fs, &io, buffer, BENCH_CHUNK);
+		bench_sample(&bench, started);
+		if(failed) {
+			fprintf(stderr, "Read failed.\n");
+			return 1;
+		}
+	}
+	bench.bytes = length;
+	bench_print(&bench, "read sequential 64K");
+
+	uint64_t count = BENCH_RANDOM_OPS * config->scale;
+	uint64_t blocks = length / BENCH_RANDOM_BLOCK;
+	for(uint8_t writing = 0; writing != 2; writing++) {
+		bench_start(&bench, count);
+		for(uint64_t i = 0; i != count; i++) {
+			FileCursor target = next_random(config) % blocks * BENCH_RANDOM_BLOCK;
+			uint64_t started = now_ns();
+			uint8_t failed = seek(&fs, &io, target) != OPTIONAL_OK;
+			if(writing) {
+				failed |= write_to_file(&fs, &io, buffer, BENCH_RANDOM_BLOCK) != OPTIONAL_OK;
+			} else {
+				failed |= read_from_file(&fs, &io, buffer, BENCH_RANDOM_BLOCK);
+			}
+			bench_sample(&bench, started);
+			if(failed) {
+				fprintf(stderr, "Random %s failed.\n", writing ? "write" : "read");
+				return 1;
+			}
+		}
+		bench.bytes = count * BENCH_RANDOM_BLOCK;
+		bench_print(&bench, writing ? "write random 4K" : "read random 4K");
+	}
+	close_file(&fs, &io);
+	free(buffer);
+	return close_fs_file(&fs);
+}
+
+// Two files written a cluster at a time in turns, so that every cluster of
+// either is a run of its own. A 1M read or write of it then takes one request per
+// cluster, which BACKEND_URING keeps in flight up to the queue depth. Reads
+// start with the image dropped from the page cache.
+Result bench_queue(BenchConfig* config) {
+	static const uint32_t depths[] = { 1, 4, 16, 64, 256 };
+	FileSystem fs;
+	FileCursor length = (FileCursor) BENCH_QUEUE_FILE * config->scale;
+	if(fresh_volume(config, &fs, length * 2 + BENCH_VOLUME / 16)) {
+		return 1;
+	}
+	uint8_t* buffer = malloc(BENCH_QUEUE_CHUNK);
+	if(buffer == NULL) {
+		return 1;
+	}
+	for(size_t i = 0; i != BENCH_QUEUE_CHUNK; i++) {
+		buffer[i] = next_random(config);
+	}
+	DirCursor root;
+	get_root(&fs, &root);
+	DirEntry entries[2];
+	FileIO files[2];
+	uint8_t name[FILE_NAME_BUFFER];
+	for(uint8_t f = 0; f != 2; f++) {
+		bench_name(name, f);
+		init_meta(&entries[f], 0, name);
+		if(create_file(&fs, &root, &entries[f]) != OPTIONAL_OK) {
+			fprintf(stderr, "Can't create %s.\n", name);
+			return 1;
+		}
+	}
+	// Closing the file gives back the clusters reserved after its tail
+	for(FileCursor done = 0; done < length; done += config->cluster_size) {
+		for(uint8_t f = 0; f != 2; f++) {
+			bench_name(name, f);
+			resolve(&fs, &root, &entries[f], name);
+			open_file(&fs, &entries[f], &files[f]);
+			if(seek(&fs, &files[f], done) != OPTIONAL_OK || write_to_file(&fs, &files[f], buffer, config->cluster_size) != OPTIONAL_OK || close_file(&fs, &files[f])) {
+				fprintf(stderr, "Write failed.\n");
+				return 1;
+			}
+		}
+	}
+	sync_fs_file(&fs);
+	bench_name(name, 0);
+	resolve(&fs, &root, &entries[0], name);
+	open_file(&fs, &entries[0], &files[0]);
+	// The other backends have no queue, they are measured once
+	uint32_t count = fs.backend == BACKEND_URING ? sizeof(depths) / sizeof(depths[0]) : 1;
+	for(uint32_t d = 0; d != count; d++) {
+		set_queue_depth(&fs, depths[d]);
+		for(uint8_t writing = 0; writing != 2; writing++) {
+			Bench bench;
+			seek(&fs, &files[0], 0);
+#ifdef POSIX_FADV_DONTNEED
+			sync_fs_file(&fs);
+			posix_fadvise(fileno(fs.file), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+			bench_start(&bench, length / BENCH_QUEUE_CHUNK);
+			for(FileCursor done = 0; done < length; done += BENCH_QUEUE_CHUNK) {
+				uint64_t started = now_ns();
+				uint8_t failed = writing ? write_to_file(&fs, &files[0], buffer, BENCH_QUEUE_CHUNK) != OPTIONAL_OK : read_from_file(&fs, &files[0], buffer, BENCH_QUEUE_CHUNK);
+				bench_sample(&bench, started);
+				if(failed) {
+					fprintf(stderr, "Fragmented %s failed.\n", writing ? "write" : "read");
+					return 1;
+				}
+			}
+			bench.bytes = length;
+			uint8_t label[BENCH_NAME];
+			if(fs.backend == BACKEND_URING) {
+				sprintf(label, "%s fragmented 1M qd %u", writing ? "write" : "read", depths[d]);
+			} else {
+				sprintf(label, "%s fragmented 1M", writing ? "write" : "read");
+			}
+			bench_print(&bench, label);
+		}
+	}
+	close_file(&fs, &files[0]);
+	free(buffer);
+	return close_fs_file(&fs);
+}
+
+// action_dir() prints every entry, so stdout goes to /dev/null meanwhile
+Result bench_dir(BenchConfig* config) {
+	static const uint32_t sizes[] = { 100, 10000 };
+	FileSystem fs;
+	if(fresh_volume(config, &fs, entries_volume(config, 10100))) {
+		return 1;
+	}
+	DirCursor root;
+	get_root(&fs, &root);
+	uint8_t name[FILE_NAME_BUFFER];
+	int null = open("/dev/null", O_WRONLY);
+	int saved = dup(STDOUT_FILENO);
+	if(null < 0 || saved < 0) {
+		return 1;
+	}
+	for(uint32_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]); s++) {
+		DirEntry directory;
+		DirCursor cursor;
+		sprintf(name, "dir%u", sizes[s]);
+		init_meta(&directory, 1, name);
+		if(create_file(&fs, &root, &directory) != OPTIONAL_OK) {
+			return 1;
+		}
+		open_dir(&fs, &directory, &cursor);
+		for(uint32_t i = 0; i != sizes[s]; i++) {
+			DirEntry entry;
+			bench_name(name, i);
+			init_meta(&entry, 0, name);
+			if(create_file(&fs, &cursor, &entry) != OPTIONAL_OK) {
+				return 1;
+			}
+		}
+		Bench bench;
+		uint64_t count = BENCH_LISTINGS * config->scale;
+		bench_start(&bench, count);
+		fflush(stdout);
+		dup2(null, STDOUT_FILENO);
+		for(uint64_t i = 0; i != count; i++) {
+			uint64_t started = now_ns();
+			action_dir(&fs, &cursor, "");
+			fflush(stdout);
+			bench_sample(&bench, started);
+		}
+		dup2(saved, STDOUT_FILENO);
+		uint8_t label[BENCH_NAME];
+		sprintf(label, "dir listing of %u", sizes[s]);
+		bench_print(&bench, label);
+	}
+	close(null);
+	close(saved);
+	return close_fs_file(&fs);
+}
+
+int main(int argc, char** argv) {
+	init_table();
+	BenchConfig config = { "bench.img", 1, DEFAULT_CLUSTER_SIZE, BACKEND_STDIO, 0x9E3779B97F4A7C15ull };
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			if(parse_size(argv[++i], &config.scale) || config.scale == 0) {
+				fprintf(stderr, "Bad scale.\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			if(parse_size(argv[++i], &config.cluster_size) || !valid_cluster_size(config.cluster_size)) {
+				fprintf(stderr, "Bad cluster size.\n");
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			i++;
+			if(strcmp(argv[i], "stdio") == 0) {
+				config.backend = BACKEND_STDIO;
+			} else if(strcmp(argv[i], "mmap") == 0) {
+				config.backend = BACKEND_MMAP;
+			} else if(strcmp(argv[i], "uring") == 0) {
+				config.backend = BACKEND_URING;
+			} else {
+				fprintf(stderr, "Unknown backend.\n");
+				return 1;
+			}
+		} else {
+			config.path = argv[i];
+		}
+	}
+	printf("scale %llu, cluster %llu, backend %s\n", (unsigned long long) config.scale, (unsigned long long) config.cluster_size, BACKENDS[config.backend]);
+	printf("%-26s %9s %12s %9s %9s %9s %9s %9s\n", "benchmark", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us");
+	Result failed = bench_allocate(&config) || bench_resolve(&config) || bench_seek(&config) || bench_io(&config) || bench_queue(&config) || bench_dir(&config);
+	remove(config.path);
+	return failed;
+}
@@ -1,88 +1,656 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define FS_COPY_RANGE
+#endif
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FS_MMAP
+#define FS_THREADS
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// io_uring is driven through raw system calls, so only the kernel headers are needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define FS_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+#ifndef _STATIC_ASSERT
+#define _STATIC_ASSERT(expr) _Static_assert(expr, #expr)
+#endif
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 
-typedef uint16_t ClusterLocation;
-typedef uint16_t ClusterOffset;
-typedef uint32_t FileCursor;
+#if defined(_WIN32)
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+typedef uint32_t ClusterLocation;
+typedef uint32_t ClusterOffset;
+typedef uint64_t FileCursor;
 
 typedef uint8_t Result;
 typedef uint8_t OptionalResult;
 
+#define TV_EMPTY ((ClusterLocation) 0x00000000)
+#define TV_FINAL ((ClusterLocation) 0xFFFFFFFF)
+#define TV_CANT_ALLOC ((ClusterLocation) 0x00000000)
+#define COMPRESS_RAW ((uint32_t) 0x80000000)
+
 enum {
-	CLUSTER_SIZE = 4*1024,
-	MAX_CLUSTERS = 8*1024,
-	ROOT_OFFSET = MAX_CLUSTERS*sizeof(ClusterLocation),
+	DEFAULT_CLUSTER_SIZE = 4*1024,
+	MIN_CLUSTER_SIZE = 4*1024,
+	MAX_CLUSTER_SIZE = 1024*1024,
+	MAX_VOLUME_CLUSTERS = 0x7FFFFFFF,
+
+	// Images without a superblock: 16-bit FAT of LEGACY_CLUSTERS entries at offset 0
+	LEGACY_CLUSTERS = 8*1024,
+	LEGACY_DATA_OFFSET = LEGACY_CLUSTERS*sizeof(uint16_t),
+	LEGACY_FINAL = 0xFFFF,
+
+	SUPERBLOCK_SIZE = 4*1024,
+	SUPERBLOCK_VERSION = 1,
+	SB_MAGIC = 0,
+	SB_VERSION = 8,
+	SB_CLUSTER_SIZE = SB_VERSION + sizeof(uint32_t),
+	SB_CLUSTERS = SB_CLUSTER_SIZE + sizeof(uint32_t),
+	SB_ADDRESS_WIDTH = SB_CLUSTERS + sizeof(uint32_t),
+	SB_FAT_OFFSET = SB_ADDRESS_WIDTH + sizeof(uint32_t),
+	SB_DATA_OFFSET = SB_FAT_OFFSET + sizeof(uint64_t),
+	SB_JOURNAL_OFFSET = SB_DATA_OFFSET + sizeof(uint64_t),
+	SB_JOURNAL_SIZE = SB_JOURNAL_OFFSET + sizeof(uint64_t),
+	SB_REFS_OFFSET = SB_JOURNAL_SIZE + sizeof(uint32_t),
+	SB_HEADER = SB_REFS_OFFSET + sizeof(uint64_t),
+
+	JOURNAL_MAGIC = 0,
+	JOURNAL_EPOCH = 8,
+	JOURNAL_HEADER = 64,
+	JOURNAL_ALIGN = 4*1024,
+	JOURNAL_MIN = 128*1024,
+	JOURNAL_MAX = 64*1024*1024,
+	JOURNAL_META_RESERVE = 64*1024,
+	JOURNAL_GROUP = 16,
+	JOURNAL_INTERVAL = 5, // Seconds
+
+	RECORD_TYPE = 0,
+	RECORD_LENGTH = 4,
+	RECORD_EPOCH = 8,
+	RECORD_HEADER = 16,
+	RECORD_FAT = 1, // First entry, then the entries of one FAT page
+	RECORD_META = 2, // Cluster, offset, then the bytes
+	RECORD_ZERO = 3, // Cluster
+	RECORD_COMMIT = 4, // Checksum of the transaction's records
+	RECORD_REFS = 5, // First entry, then the link counts of one FAT page
+	FAT_PAGE = 128, // Entries per logged FAT range
+	FAT_RECORD = RECORD_HEADER + sizeof(uint32_t) + FAT_PAGE*sizeof(ClusterLocation),
 	
 	FILE_META = 64,
 	OFFSET_SIZE = 0,
-	OFFSET_CLUSTER = sizeof(ClusterOffset),
-	OFFSET_NAME = sizeof(ClusterOffset) + sizeof(ClusterLocation),
+	OFFSET_CLUSTER = sizeof(uint16_t),
+	OFFSET_NAME = sizeof(uint16_t) + sizeof(uint16_t),
 	FILE_NAME_BUFFER = FILE_META - OFFSET_NAME,
+	ENTRY_V2 = 0x8000,
+	FLAG_FOLDER = 0x0001,
+	FLAG_INLINE = 0x0002,
+	FLAG_COMPRESSED = 0x0004,
+	FLAG_SPARSE = 0x0008,
+	V2_NAME_BUFFER = 40,
+	OFFSET_V2_SIZE = OFFSET_NAME + V2_NAME_BUFFER,
+	OFFSET_V2_CLUSTERS = OFFSET_V2_SIZE + sizeof(uint64_t),
+	OFFSET_V2_LAST = OFFSET_V2_CLUSTERS + sizeof(uint32_t),
+	OFFSET_V2_FIRST = OFFSET_V2_LAST + sizeof(uint32_t),
 	MAX_FILE_NAME = FILE_NAME_BUFFER - 1,
-	FILES_PER_CLUSTER = CLUSTER_SIZE / FILE_META,
-
-	TV_EMPTY = 0x0000,
-	TV_FINAL = 0xFFFF,
-	TV_CANT_ALLOC = 0x0000,
+	MAX_V2_NAME = V2_NAME_BUFFER - 1,
 
 	FS_FOLDER = 0xFFFF,
+	FS_INDEX = 0xFFFE,
+
+	INDEX_MARKER = 0x01,
+	OFFSET_INDEX_COUNT = OFFSET_NAME + 1,
+	OFFSET_INDEX_CLUSTERS = OFFSET_INDEX_COUNT + sizeof(uint16_t),
+	OFFSET_INDEX_FIRST = OFFSET_INDEX_CLUSTERS + sizeof(uint16_t),
+	INDEX_SLOT = sizeof(uint32_t),
+	INDEX_MAX_CLUSTERS = 128,
 
 	OPTIONAL_OK = 0,
 	OPTIONAL_IO_ERROR = 1,
 	OPTIONAL_STRUCTURE_ERROR = 2,
+	OPTIONAL_UNSUPPORTED = 3,
+
+	BACKEND_STDIO = 0,
+	BACKEND_MMAP = 1,
+	BACKEND_URING = 2,
+
+	STATUS_OK = 0,
+	STATUS_FAILED = 1,
+	STATUS_IO_ERROR = 2,
+	STATUS_UNKNOWN_COMMAND = 3,
 
 	INPUT_BUFFER = 4096,
+	BATCH_OUTPUT_BUFFER = 1024*1024,
+	MAX_COMMANDS = 32,
+	COMMAND_NAME = 16,
+	LATENCY_BUCKETS = 24,
 	MAX_DEPTH = 256,
 	FS_SIZE = 16*1024*1024,
 	IO_BUFFER = 4096,
-	DIR_STRING_BUFFER = 16*1024
+	STREAM_BUFFER = 1024*1024,
+	READAHEAD_MIN = 64*1024,
+	READAHEAD_MAX = 4*1024*1024,
+	IO_QUEUE_DEPTH = 32,
+	IO_QUEUE_MAX = 256, // Entries of the ring; the depth can be changed up to this
+	IO_REQUEST_MAX = 1 << 30,
+	DIR_STRING_BUFFER = 16*1024,
+
+	CACHE_BYTES = 256*1024,
+	DENTRY_CACHE_BYTES = 256*1024,
+	CACHE_MIN_SLOTS = 8,
+	CACHE_EMPTY = 0,
+
+	CHAIN_INITIAL = 64,
+
+	COMPRESS_GROUP = 16, // Clusters of file data compressed together
+	COMPRESS_MAP_SLOT = sizeof(uint32_t),
+	LZ_HASH_BITS = 12,
+	LZ_MIN_MATCH = 4,
+	LZ_MAX_OFFSET = UINT16_MAX,
+	LZ_RUN = 15, // A nibble of this value continues in the following bytes
+
+	SPARSE_HOLE = 2 * sizeof(uint32_t), // Start and length in the map
+
+	DEDUP_MAX_SLOTS = 1 << 22,
+	DEDUP_PROBES = 8,
+
+	RESERVE_WINDOW_MIN = 8,
+	RESERVE_WINDOW_MAX = 256,
+
+	DIR_LOCK_STRIPES = 64,
+	STRESS_THREADS = 4,
+	STRESS_FILES = 64,
+	IMPORT_THREADS = 8,
+	STRESS_CHUNK = 1000,
+
+	FSCK_THREADS = 4,
+	DEFRAG_PASS = 1000, // Milliseconds
+	CHAIN_OK = 0,
+	CHAIN_OUT_OF_RANGE = 1,
+	CHAIN_FREE = 2,
+	CHAIN_CROSS_LINKED = 3,
+	CHAIN_CYCLE = 4,
+	FIX_ENTRY = 0, // Rewrite the entry with `meta`
+	FIX_RESET = 1, // Give the entry a new empty chain, or make the file inline
+	FIX_CUT = 2, // End the chain at `cluster`, releasing the rest if `flag` is set
+	FIX_INDEX = 3, // Rebuild the index of the directory at `cluster`
+
+	MAP_WORD_BITS = 64
 };
 
 _STATIC_ASSERT(sizeof(uint8_t) == 1);
 _STATIC_ASSERT(sizeof(ClusterLocation) % sizeof(uint8_t) == 0);
-_STATIC_ASSERT(MAX_CLUSTERS*sizeof(ClusterLocation) % CLUSTER_SIZE == 0);
-_STATIC_ASSERT(CLUSTER_SIZE % FILE_META == 0);
-_STATIC_ASSERT(FILES_PER_CLUSTER < UINT8_MAX);
-_STATIC_ASSERT(FS_FOLDER >= CLUSTER_SIZE);
-_STATIC_ASSERT(MAX_CLUSTERS < UINT16_MAX);
+_STATIC_ASSERT(LEGACY_DATA_OFFSET % DEFAULT_CLUSTER_SIZE == 0);
+_STATIC_ASSERT(LEGACY_CLUSTERS < LEGACY_FINAL);
+_STATIC_ASSERT(MIN_CLUSTER_SIZE % FILE_META == 0);
+_STATIC_ASSERT(MAX_CLUSTER_SIZE / FILE_META <= UINT16_MAX);
+_STATIC_ASSERT(SUPERBLOCK_SIZE >= SB_HEADER);
+_STATIC_ASSERT(SUPERBLOCK_SIZE % MIN_CLUSTER_SIZE == 0);
+// Version 1 entries keep the size within the last cluster and only exist on legacy images
+_STATIC_ASSERT(FS_FOLDER >= DEFAULT_CLUSTER_SIZE);
+_STATIC_ASSERT(ENTRY_V2 >= DEFAULT_CLUSTER_SIZE);
+_STATIC_ASSERT(FS_INDEX >= DEFAULT_CLUSTER_SIZE);
+_STATIC_ASSERT(OFFSET_V2_FIRST + sizeof(uint32_t) == FILE_META);
+_STATIC_ASSERT(OFFSET_INDEX_FIRST + sizeof(uint32_t) <= OFFSET_V2_SIZE);
+_STATIC_ASSERT(INDEX_MAX_CLUSTERS * (MIN_CLUSTER_SIZE / INDEX_SLOT) > UINT16_MAX);
+_STATIC_ASSERT(JOURNAL_MIN > JOURNAL_HEADER + JOURNAL_META_RESERVE + FAT_RECORD);
+
+const uint8_t SUPERBLOCK_MAGIC[8] = "SAOD-FS\n";
+const uint8_t JOURNAL_MAGIC_BYTES[8] = "SAOD-JL\n";
 
+// Free-space bitmap over table_cache. A set bit in `used` means the cluster
+// is taken (or lies past the end of the volume), a set bit in `full` means the
+// corresponding word of `used` has no free clusters left.
 typedef struct {
-	FILE* file;
-	uint16_t clusters_count;
-	ClusterLocation table_cache[MAX_CLUSTERS];
-} FileSystem;
+	uint64_t* used;
+	uint64_t* full;
+	size_t words;
+	size_t summary_words;
+	ClusterLocation hint;
+	ClusterLocation free_count;
+} FreeMap;
 
 typedef struct {
-	ClusterLocation current_cluster;
-} DirCursor;
+	ClusterLocation cluster;
+	uint32_t next; // Next slot in the same hash bucket
+	uint8_t valid;
+	uint8_t dirty;
+	uint8_t referenced;
+	// Changes not yet in the journal: the cluster was zeroed and/or a byte range
+	uint8_t log_zero;
+	uint32_t log_from;
+	uint32_t log_to;
+	uint8_t* data;
+} CacheSlot;
+
+// Write-back cache of whole clusters with CLOCK replacement. Slots are found
+// through hash buckets that hold a slot index + 1, or CACHE_EMPTY.
+typedef struct {
+	CacheSlot* slots;
+	uint8_t* data;
+	CacheSlot direct; // Cluster of a memory-mapped volume
+	uint32_t* buckets;
+	uint32_t mask;
+	uint32_t slot_count;
+	uint32_t hand;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t writebacks;
+} ClusterCache;
 
 typedef struct {
 	uint8_t meta[FILE_META];
+	ClusterLocation directory; // First cluster of the containing directory
 	ClusterLocation current_cluster;
 	ClusterLocation current_offset;
 } DirEntry;
 
 typedef struct {
+	uint32_t next; // Next slot in the same hash bucket
+	uint8_t valid;
+	uint8_t negative; // The name is known to be missing, only the name is kept
+	uint8_t referenced;
+	DirEntry entry;
+} Dentry;
+
+// Results of lookup() keyed by directory and name, with buckets and CLOCK
+// replacement like ClusterCache. Whatever changes an entry or moves it within
+// its directory forgets it here, so a hit is what lookup() would return.
+typedef struct {
+	Dentry* slots;
+	uint32_t* buckets;
+	uint32_t mask;
+	uint32_t slot_count; // 0 if the cache is disabled
+	uint32_t used;
+	uint32_t hand;
+	uint32_t hits;
+	uint32_t misses;
+} DentryCache;
+
+// Counters since mount or `stats reset`. Host reads and writes are the
+// requests that reach the image; a seek is a request that does not continue
+// where the previous one ended.
+typedef struct {
+	uint64_t host_reads;
+	uint64_t host_writes;
+	uint64_t host_seeks;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t next_offset;
+	uint64_t file_reads;
+	uint64_t file_writes;
+	uint64_t clusters_read;
+	uint64_t clusters_written;
+	uint64_t allocations;
+	uint64_t fat_hops;
+	uint64_t lookups;
+	uint64_t entries_compared;
+	uint64_t packed_in;
+	uint64_t packed_out;
+	uint64_t pack_time;
+	uint64_t unpacked;
+	uint64_t unpack_time;
+	uint64_t dedup_linked; // Clusters of imported data found on the volume
+	uint64_t dedup_written;
+} Stats;
+
+// Write-ahead log of metadata. Changes since the last commit are tracked as
+// FAT pages and byte ranges of cached clusters; journal_commit() appends them
+// as one transaction, and a checkpoint later replays the committed records
+// to their home locations.
+typedef struct {
+	uint64_t offset;
+	uint32_t size; // 0 if the volume has no journal
+	uint32_t tail;
+	uint64_t epoch;
+	uint8_t* fat_log; // One flag per FAT_PAGE entries
+	uint8_t* refs_log; // The same for the link counts
+	uint32_t fat_pending;
+	uint32_t fat_budget;
+	uint64_t* logged; // Clusters with records since the last checkpoint
+	CacheSlot* held; // Evicted clusters whose changes wait for the commit
+	uint32_t held_count;
+	uint32_t held_capacity;
+	ClusterLocation* freed; // Reused only after the commit that frees them
+	uint32_t freed_count;
+	uint32_t freed_capacity;
+	uint32_t operations;
+	time_t last_commit;
+} Journal;
+
+// Hashes of the bytes of file clusters together with the cluster each one
+// links to, so that a new file can link to an existing copy of its tail
+// instead of writing it. Slots are hints: a cluster is used only while its
+// `indexed` bit is set (release() clears it) and its bytes still match.
+typedef struct {
+	uint64_t* keys; // 0 marks a free slot
+	ClusterLocation* clusters;
+	uint64_t* indexed;
+	uint32_t mask;
+	uint8_t enabled;
+} DedupIndex;
+
+// Transfers started by one call that may complete in any order.
+// io_batch_wait() returns once all of them have.
+typedef struct {
+	uint32_t pending;
+} IoBatch;
+
+#ifdef FS_URING
+typedef struct {
+	IoBatch* owner;
+	uint8_t* buffer;
+	uint64_t offset;
+	uint32_t size;
+	uint8_t write;
+} IoRequest;
+
+// Submission and completion rings shared with the kernel. Batches of all
+// threads go through them under `mutex`, and whoever waits retires the
+// completions of everyone. At most `depth` requests are queued or in flight;
+// when that many are, the next one waits for a completion. `free` is a stack
+// of unused request slots.
+typedef struct {
+	int fd;
+	uint32_t depth;
+	uint32_t queued; // Prepared but not yet handed to the kernel
+	uint32_t in_flight;
+	// Set once io_uring_enter() fails. New requests are then done
+	// synchronously, and the ones in flight are polled for.
+	uint8_t failed;
+	uint8_t* sq_ring;
+	size_t sq_size;
+	uint8_t* cq_ring;
+	size_t cq_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	uint32_t* sq_tail;
+	uint32_t* sq_mask;
+	uint32_t* sq_array;
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t* cq_mask;
+	struct io_uring_cqe* cqes;
+	IoRequest requests[IO_QUEUE_MAX];
+	uint32_t free[IO_QUEUE_MAX];
+	uint32_t free_count;
+	pthread_mutex_t mutex;
+} Uring;
+#endif
+
+// Geometry comes from the superblock, or is fixed for legacy images. With
+// BACKEND_MMAP the whole image is mapped at `map` and clusters are accessed in
+// place; BACKEND_URING batches the transfers of file data through io_uring.
+// table_cache points into the map when the on-disk FAT has 32-bit
+// entries and there is no journal. Otherwise table_cache is a private copy,
+// written back by sync_fs_file() or checkpointed through the journal.
+//
+// `lock` is held shared by lookups, reads and writes inside allocated
+// clusters, and exclusively by anything that changes the FAT, the free map or
+// directory contents. Shared holders reach the cluster and dentry caches only
+// under `cache_mutex` and copy data out of them. A directory lock keeps a name
+// free between the lookup and the insert of create_file().
+//
+// Files can share clusters, but only as a common tail: each cluster has one
+// successor, so everything after a shared cluster is shared as well. The
+// first cluster of a file is always its own. `refs` counts the FAT entries
+// that link to each cluster; it is rebuilt from the FAT on mount and kept up
+// to date by set_next(), which journals it to the table at `refs_offset` as
+// well. The table is what fsck tells sharing from cross-links by, so volumes
+// without one never share. `sharing` changes whenever a cluster gains a
+// second link, which tells open files to look for shared clusters again.
+typedef struct {
+	FILE* file;
+	uint8_t backend;
+	uint8_t io_error;
+	uint8_t* map;
+	size_t map_size;
+#ifdef FS_URING
+	Uring uring;
+#endif
+	uint32_t cluster_size;
+	ClusterLocation clusters_count;
+	uint8_t address_width; // Bytes per FAT entry on disk
+	uint64_t fat_offset;
+	uint64_t refs_offset; // 0 if the volume keeps no link counts on disk
+	uint64_t data_offset;
+	uint32_t files_per_cluster;
+	uint32_t slots_per_cluster;
+	ClusterLocation* table_cache;
+	uint32_t* refs;
+	uint32_t join_points; // Clusters linked from more than one chain, where sharing starts
+	uint32_t sharing;
+	DedupIndex dedup;
+	FreeMap free_map;
+	ClusterCache cache;
+	DentryCache dentries;
+	Journal journal;
+	Stats stats;
+#ifdef FS_THREADS
+	pthread_rwlock_t lock;
+	pthread_mutex_t cache_mutex;
+	pthread_mutex_t dir_locks[DIR_LOCK_STRIPES];
+#endif
+} FileSystem;
+
+typedef struct {
+	ClusterLocation current_cluster;
+} DirCursor;
+
+typedef struct {
+	ClusterLocation directory;
 	ClusterLocation current_cluster;
 	ClusterLocation current_offset;
-	uint8_t buffer[CLUSTER_SIZE];
 } DirIter;
 
+typedef struct {
+	ClusterLocation directory;
+	ClusterLocation first;
+	uint16_t count; // Entries including the header
+	uint16_t clusters;
+} DirIndex;
+
+// State of an open compressed file. Its chain holds groups of COMPRESS_GROUP
+// clusters of data, each compressed on its own and stored back to back, and
+// ends with the map: the stored byte length of every group, with
+// COMPRESS_RAW for groups that did not shrink. Only the last group may be
+// shorter. The map is read on first use; writes can only append. Appended
+// groups and the new map go to fresh clusters, which packed_finish() links
+// in place of the old partial group and map, so the old ones stay intact
+// until the entry is switched.
+typedef struct {
+	FileCursor size;
+	FileCursor cursor;
+	uint32_t* stored;
+	uint32_t* start; // Ordinal of the first cluster of each group
+	uint32_t count; // Groups in the map, or stored so far while appending
+	uint32_t capacity;
+	uint8_t loaded;
+	uint8_t appending; // `tail` holds the bytes after the last stored group
+	uint32_t data_clusters; // Clusters taken by the stored groups while appending
+	uint32_t kept; // Clusters of the chain that the appended file keeps
+	ClusterLocation fresh_first; // Chain of the clusters written since, or TV_EMPTY
+	ClusterLocation fresh_last;
+	uint32_t fresh_clusters;
+	uint8_t* tail;
+	uint8_t* group; // Bytes of group `decoded`
+	uint32_t decoded;
+	uint8_t* scratch;
+} Packed;
+
+// State of an open sparse file. Its chain holds the clusters that have data,
+// in file order, and ends with the map: the number of holes and the start and
+// length of each, in clusters. Holes read as zeros and take no space. The
+// first cluster is never in a hole, the entry points at it. If the map is
+// full, a write that would split a hole fills part of it in instead.
+typedef struct {
+	FileCursor size;
+	FileCursor cursor;
+	uint32_t* start;
+	uint32_t* length;
+	uint32_t count;
+	uint32_t capacity;
+	uint8_t loaded;
+} Holes;
+
 typedef struct {
 	ClusterOffset metaFileSize;
 	ClusterOffset offset;
 	ClusterLocation first;
 	ClusterLocation current;
-	FileCursor metaFileSizeLocation;
+	ClusterLocation last;
+	uint32_t clusters;
+	uint32_t position; // Index of `current` within the chain
+	// chain[i] is the i-th cluster of the file, filled in as the chain is walked
+	ClusterLocation* chain;
+	uint32_t chain_length;
+	uint32_t chain_capacity;
+	// Readahead state: set once a read continues where the previous one stopped
+	uint8_t sequential;
+	uint32_t readahead;
+	uint32_t readahead_mark;
+	// Where the entry was when the file was opened. Deleting another file of
+	// the directory can move it; it is found again by its first cluster.
+	ClusterLocation entry_directory;
+	ClusterLocation entry_cluster;
+	ClusterOffset entry_offset;
+	ClusterLocation entry_first;
+	uint8_t modified;
+	// An inline file has no clusters until it outgrows `inline_capacity`.
+	// Its entry is then found again by name instead of the first cluster.
+	uint8_t is_inline;
+	ClusterOffset inline_capacity;
+	uint8_t inline_data[FILE_META];
+	uint8_t entry_name[V2_NAME_BUFFER];
+	// Set for FLAG_COMPRESSED files; `packed` is NULL if it could not be allocated
+	uint8_t compressed;
+	Packed* packed;
+	// Set for FLAG_SPARSE files; `holes` is NULL if it could not be allocated
+	uint8_t sparse;
+	Holes* holes;
+	// Set when a plain file was seeked past its last cluster. It only becomes
+	// sparse if it is written there, with the hole ending at `seek_target`.
+	uint8_t seek_pending;
+	FileCursor seek_target;
+	// Clusters from `shared` on are linked from other chains as well. Valid
+	// while `shared_epoch` matches the volume's `sharing`.
+	uint32_t shared;
+	uint32_t shared_epoch;
+	// Run of clusters taken from the free map but not yet linked into the chain
+	ClusterLocation reserved;
+	uint32_t reserved_count;
+	uint32_t reserve_window;
+	uint32_t reserve_expected; // Clusters still to come of the size given to reserve_for_size()
 } FileIO;
 
+typedef struct {
+	uint8_t kind;
+	uint8_t flag; // Folder for FIX_RESET
+	ClusterLocation cluster;
+	ClusterOffset offset;
+	uint16_t count;
+	uint16_t clusters;
+	uint8_t meta[FILE_META];
+} FsckFix;
+
+typedef struct {
+	ClusterLocation cluster;
+	uint32_t length; // Clusters of the chain that are known to be good
+	uint8_t* path;
+} FsckWork;
+
+// State shared by the workers of a volume check. Every cluster reached from
+// the root is claimed in `visited`, so a chain that runs into a claimed
+// cluster is cross-linked or has a cycle, unless the link counts on disk
+// have it shared. Repairs are collected in `fixes` and applied after the walk.
+typedef struct {
+	FileSystem* fs;
+	uint8_t repair;
+	uint8_t out_of_memory;
+	uint64_t* visited;
+	uint32_t* links; // Link counts as stored, NULL if the volume has none
+	FsckWork* queue;
+	uint32_t queued;
+	uint32_t queue_capacity;
+	uint32_t pending; // Directories queued or being checked
+	FsckFix* fixes;
+	uint32_t fix_count;
+	uint32_t fix_capacity;
+	uint64_t directories;
+	uint64_t files;
+	uint64_t problems;
+	uint64_t unrepaired;
+#ifdef FS_THREADS
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+#endif
+} Fsck;
+
+typedef struct {
+	ClusterLocation entry_cluster;
+	ClusterOffset entry_offset;
+	ClusterLocation first;
+	uint32_t clusters;
+	uint32_t extents;
+} DefragFile;
+
+// Fragmentation is the share of links between consecutive clusters of a
+// chain that are not to the physically next cluster
+typedef struct {
+	uint64_t links;
+	uint64_t jumps_before;
+	uint64_t jumps_after;
+	uint32_t fragmented;
+	uint32_t moved;
+	uint64_t moved_clusters;
+	uint32_t no_room; // No free run was long enough
+	uint32_t left; // Not reached before the time ran out
+	uint8_t out_of_memory;
+} DefragReport;
+
+// Latency histogram of one shell command. Bucket 0 counts the runs that took
+// less than 1 us, bucket i the ones that took less than 2^i us.
+typedef struct {
+	uint8_t name[COMMAND_NAME];
+	uint64_t runs;
+	uint64_t total;
+	uint64_t longest;
+	uint64_t buckets[LATENCY_BUCKETS];
+} CommandStats;
+
 const uint8_t* MESSAGE_IO_ERROR = "I/O Error has occured.\n";
 const uint8_t* MESSAGE_OUT_OF_SPACE = "Not enough space.\n";
 const uint8_t* MESSAGE_NOT_FOUND = "File not found.\n";
@@ -90,815 +658,7031 @@ const uint8_t* MESSAGE_IS_DIR = "File is a directory.\n";
 const uint8_t* MESSAGE_IS_NOT_DIR = "File is not a directory.\n";
 const uint8_t* MESSAGE_FILE_ALREADY_EXISTS = "File already exists.\n";
 const uint8_t* MESSAGE_FILENAME_IS_LONG = "Filename is too long.\n";
+const uint8_t* MESSAGE_FILENAME_NEEDS_V2 = "Names over 39 characters need a volume of at most 65535 clusters of at most 32 KiB.\n";
+const uint8_t* MESSAGE_LONG_NAME_FEATURE = "Compressed and sparse files need names of at most 39 characters.\n";
 const uint8_t* MESSAGE_FILENAME_ILLEGAL_SYMBOLS = "Filename contains illegal symbols.\n";
 const uint8_t* MESSAGE_FS_CANT_INIT = "Can't init the file system.\n";
 const uint8_t* MESSAGE_FS_CANT_MOUNT = "Can't mount the file system.\n";
 const uint8_t* MESSAGE_UNKNOWN_COMMAND = "Unknown command.\n";
+const uint8_t* MESSAGE_OUT_OF_MEMORY = "Not enough memory.\n";
+const uint8_t* MESSAGE_UNKNOWN_BACKEND = "Unknown storage backend.\n";
+const uint8_t* MESSAGE_BAD_GEOMETRY = "Invalid volume or cluster size.\n";
+const uint8_t* MESSAGE_NO_THREADS = "Threads are not supported on this platform.\n";
+const uint8_t* MESSAGE_BAD_STRESS = "Usage: stress [threads] [files per thread].\n";
+const uint8_t* MESSAGE_BAD_IMPORT = "Usage: import <name> <host file>, or import -r <host directory> <directory>.\n";
+const uint8_t* MESSAGE_IMPORT_INCOMPLETE = "Some files could not be imported.\n";
+const uint8_t* MESSAGE_BAD_FSCK = "Usage: fsck [repair] [threads].\n";
+const uint8_t* MESSAGE_BAD_DEFRAG = "Usage: defrag [milliseconds].\n";
+const uint8_t* MESSAGE_BAD_DCACHE = "Usage: dcache [bytes].\n";
+const uint8_t* MESSAGE_BAD_QUEUE = "Usage: queue [depth], at most 256.\n";
+const uint8_t* MESSAGE_NO_URING = "The volume is not mounted with the uring backend.\n";
+const uint8_t* MESSAGE_BAD_DEDUP = "Usage: dedup [on|off].\n";
+const uint8_t* MESSAGE_NO_SHARING = "The volume keeps no link counts, so its files can't share clusters.\n";
+const uint8_t* MESSAGE_BAD_CLONE = "Usage: clone <source> <name>.\n";
+const uint8_t* MESSAGE_BAD_TRUNCATE = "Usage: truncate <name> <size>.\n";
+const uint8_t* MESSAGE_COMPRESSED_LENGTH = "Compressed files can only be emptied.\n";
+const uint8_t* MESSAGE_IS_INLINE = "File is stored inline.\n";
+const uint8_t* MESSAGE_VOLUME_DAMAGED = "The volume has errors.\n";
+
+const char* CHAIN_PROBLEMS[] = { "is fine", "links outside the volume", "runs into a free cluster", "is cross-linked", "has a cycle" };
 
 uint8_t LUT[256];
+uint8_t command_status;
 
-void read(FileSystem* fs, ClusterLocation cluster, uint8_t* buffer) {
-	fseek(fs->file, ROOT_OFFSET + cluster * CLUSTER_SIZE, SEEK_SET);
-	fread(buffer, 1, CLUSTER_SIZE, fs->file);
+Result fs_error(FileSystem* fs) {
+	return fs->io_error || ferror(fs->file);
 }
 
-void write(FileSystem* fs, ClusterLocation cluster, uint8_t* buffer) {
-	fseek(fs->file, ROOT_OFFSET + cluster * CLUSTER_SIZE, SEEK_SET);
-	fwrite(buffer, 1, CLUSTER_SIZE, fs->file);
+// Counters are shared by all threads
+void stat_add(uint64_t* counter, uint64_t value) {
+#if defined(__GNUC__)
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#else
+	*counter += value;
+#endif
 }
 
-uint16_t read_u16(uint8_t* ptr) {
-	return ptr[0] | ptr[1] << 8;
+uint64_t now_us() {
+#ifdef FS_MMAP
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#else
+	return (uint64_t) clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
 }
 
-void write_u16(uint8_t* ptr, uint16_t value) {
-	ptr[0] = value;
-	ptr[1] = value >> 8;
+void stat_io(FileSystem* fs, uint64_t offset, size_t size, uint8_t write) {
+	Stats* stats = &fs->stats;
+#if defined(__GNUC__)
+	uint64_t previous = __atomic_exchange_n(&stats->next_offset, offset + size, __ATOMIC_RELAXED);
+#else
+	uint64_t previous = stats->next_offset;
+	stats->next_offset = offset + size;
+#endif
+	if(previous != offset) {
+		stat_add(&stats->host_seeks, 1);
+	}
+	stat_add(write ? &stats->host_writes : &stats->host_reads, 1);
+	stat_add(write ? &stats->bytes_written : &stats->bytes_read, size);
 }
 
-ClusterLocation get_cluster(DirEntry* entry) {
-	return read_u16(entry->meta + OFFSET_CLUSTER);
+uint8_t* io_slice(FileSystem* fs, uint64_t offset, size_t size) {
+	if(fs->backend != BACKEND_MMAP || offset + size > fs->map_size) {
+		return NULL;
+	}
+	return fs->map + offset;
 }
 
-ClusterOffset get_meta_size(DirEntry* entry) {
-	return read_u16(entry->meta + OFFSET_SIZE);
+// Transfers through the image file itself, whatever the backend
+void io_read_at(FileSystem* fs, uint64_t offset, uint8_t* buffer, size_t size) {
+#ifdef FS_MMAP
+	// Positional I/O shares no file position, so threads need no lock around it
+	while(size != 0) {
+		ssize_t done = pread(fileno(fs->file), buffer, size, offset);
+		if(done < 0 && errno == EINTR) {
+			continue;
+		}
+		if(done < 0) {
+			fs->io_error = 1;
+			return;
+		}
+		if(done == 0) { // Past the end of the image, like fread()
+			memset(buffer, 0, size);
+			return;
+		}
+		buffer += done;
+		offset += done;
+		size -= done;
+	}
+#else
+	fseek64(fs->file, offset, SEEK_SET);
+	fread(buffer, 1, size, fs->file);
+#endif
 }
 
-uint8_t is_folder(DirEntry* entry) {
-	return get_meta_size(entry) == FS_FOLDER;
+void io_write_at(FileSystem* fs, uint64_t offset, uint8_t* buffer, size_t size) {
+#ifdef FS_MMAP
+	while(size != 0) {
+		ssize_t done = pwrite(fileno(fs->file), buffer, size, offset);
+		if(done < 0 && errno == EINTR) {
+			continue;
+		}
+		if(done <= 0) {
+			fs->io_error = 1;
+			return;
+		}
+		buffer += done;
+		offset += done;
+		size -= done;
+	}
+#else
+	fseek64(fs->file, offset, SEEK_SET);
+	fwrite(buffer, 1, size, fs->file);
+#endif
 }
 
-FileCursor get_file_size(FileSystem* fs, DirEntry* entry) {
-	FileCursor ret = (FileCursor) get_meta_size(entry);
-	ClusterLocation cluster = get_cluster(entry);
-	while(fs->table_cache[cluster] != TV_FINAL) {
-		cluster = fs->table_cache[cluster];
-		ret += CLUSTER_SIZE;
+void io_read(FileSystem* fs, uint64_t offset, uint8_t* buffer, size_t size) {
+	stat_io(fs, offset, size, 0);
+	if(fs->backend == BACKEND_MMAP) {
+		uint8_t* slice = io_slice(fs, offset, size);
+		if(slice == NULL) {
+			fs->io_error = 1;
+			return;
+		}
+		memcpy(buffer, slice, size);
+		return;
 	}
-	return ret;
+	io_read_at(fs, offset, buffer, size);
 }
 
-uint8_t* get_file_name(DirEntry* entry) {
-	return entry->meta+OFFSET_NAME;
+void io_write(FileSystem* fs, uint64_t offset, uint8_t* buffer, size_t size) {
+	stat_io(fs, offset, size, 1);
+	if(fs->backend == BACKEND_MMAP) {
+		uint8_t* slice = io_slice(fs, offset, size);
+		if(slice == NULL) {
+			fs->io_error = 1;
+			return;
+		}
+		memcpy(slice, buffer, size);
+		return;
+	}
+	io_write_at(fs, offset, buffer, size);
 }
 
-void init_meta(DirEntry* entry, uint8_t is_folder, uint8_t* name) {
-	write_u16(entry->meta + OFFSET_SIZE, is_folder ? FS_FOLDER : 0);
-	memset(entry->meta + OFFSET_NAME, 0, FILE_NAME_BUFFER);
-	strcpy(entry->meta + OFFSET_NAME, name);
+#ifdef FS_URING
+int uring_enter(Uring* ring, uint32_t submit, uint32_t complete) {
+	return syscall(__NR_io_uring_enter, ring->fd, submit, complete, complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 }
 
-ClusterLocation allocate(FileSystem* fs) {
-	for(size_t i = 1; i != MAX_CLUSTERS; i++) {
-		if (fs->table_cache[i] == 0) {
-			fs->table_cache[i] = TV_FINAL;
-			return i;
-		}
+void uring_close(Uring* ring) {
+	if(ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
 	}
-	return TV_CANT_ALLOC;
+	if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_size);
+	}
+	if(ring->sq_ring != NULL) {
+		munmap(ring->sq_ring, ring->sq_size);
+	}
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->mutex);
 }
 
-Result extend(FileSystem* fs, ClusterLocation* cursor) {
-	assert(fs->table_cache[*cursor] == TV_FINAL);
-
-	ClusterLocation nc = allocate(fs);
-	if(nc == TV_CANT_ALLOC) {
-		return 1;
-	}
-	fs->table_cache[*cursor] = nc;
-	*cursor = nc;
-	return 0;
+void* uring_map(Uring* ring, size_t size, off_t offset) {
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+	return map == MAP_FAILED ? NULL : map;
 }
 
-Result init_fs_file(FileSystem* fs, char* path, uint16_t clusters_count) {
-	if(clusters_count == 0) {
+// Fails if the kernel has no io_uring or does not let us use it
+Result uring_open(Uring* ring) {
+	memset(ring, 0, sizeof(Uring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, IO_QUEUE_MAX, &params);
+	if(ring->fd < 0) {
 		return 1;
 	}
-	fs->clusters_count = clusters_count;
-
-	memset(fs->table_cache, 0, sizeof(fs->table_cache));
-	fs->table_cache[0] = TV_FINAL;
-
-	uint8_t root[CLUSTER_SIZE];
-	memset(root, 0, CLUSTER_SIZE);
-
-	fs->file = fopen(path, "wb+");
-
-	if(fs->file == NULL) {
+	if(pthread_mutex_init(&ring->mutex, NULL) != 0) {
+		close(ring->fd);
 		return 1;
 	}
-
-	fwrite(fs->table_cache, 1, sizeof(fs->table_cache), fs->file);
-	fwrite(root, 1, CLUSTER_SIZE, fs->file);
-
-	fseek(fs->file, ROOT_OFFSET + CLUSTER_SIZE * clusters_count - 1, SEEK_SET);
-	fputc(0, fs->file);
-
-	return ferror(fs->file);
-}
-
-Result open_fs_file(FileSystem* fs, char* path) {
-	fs->file = fopen(path, "ab+");
-
-	if(fs->file == NULL) {
-		return 1;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_size = ring->cq_size = max(ring->sq_size, ring->cq_size);
 	}
-
-	fseek(fs->file, 0, SEEK_END);
-	long file_length = ftell(fs->file);
-	if (file_length < ROOT_OFFSET + CLUSTER_SIZE) {
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = uring_map(ring, ring->sq_size, IORING_OFF_SQ_RING);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = uring_map(ring, ring->cq_size, IORING_OFF_CQ_RING);
+	}
+	ring->sqes = uring_map(ring, ring->sqes_size, IORING_OFF_SQES);
+	if(ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+		uring_close(ring);
 		return 1;
 	}
-	fs->clusters_count = max(UINT16_MAX, (file_length - ROOT_OFFSET) / CLUSTER_SIZE);
-
-	fseek(fs->file, 0, SEEK_SET);
-	fread(fs->table_cache, sizeof(ClusterLocation), MAX_CLUSTERS, fs->file);
-
-	return ferror(fs->file);
-}
-
-void get_root(FileSystem* fs, DirCursor* out) {
-	out->current_cluster = 0;
+	ring->sq_tail = (uint32_t*) (ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (uint32_t*) (ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (uint32_t*) (ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (uint32_t*) (ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (uint32_t*) (ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (uint32_t*) (ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (ring->cq_ring + params.cq_off.cqes);
+	ring->depth = IO_QUEUE_DEPTH;
+	for(uint32_t i = 0; i != IO_QUEUE_MAX; i++) {
+		ring->free[i] = IO_QUEUE_MAX - 1 - i;
+	}
+	ring->free_count = IO_QUEUE_MAX;
+	return 0;
 }
 
-// TODO: restrict: а если target из dir?
-OptionalResult resolve(FileSystem* fs, DirCursor* current, DirEntry* result, uint8_t* target) {
-	uint8_t buffer[CLUSTER_SIZE];
-	result->current_cluster = current->current_cluster;
-	while(1) {
-		read(fs, result->current_cluster, buffer);
-		if(ferror(fs->file)) {
-			return OPTIONAL_IO_ERROR;
-		}
-		result->current_offset = 0;
-		while(result->current_offset != CLUSTER_SIZE) {
-			if (buffer[result->current_offset+OFFSET_NAME] == 0) { // Empty file name
-				return OPTIONAL_STRUCTURE_ERROR;
-			}
-			if(memcmp(target, buffer+result->current_offset+OFFSET_NAME, FILE_NAME_BUFFER) == 0) {
-				memcpy(result->meta, buffer+result->current_offset, FILE_META);
-				return OPTIONAL_OK;
-			}
-			result->current_offset += FILE_META;
-		}
-		if(fs->table_cache[result->current_cluster] == TV_FINAL) {
-			return OPTIONAL_STRUCTURE_ERROR;
+// Finishes a request that the kernel completed with `done` bytes, or failed
+// when `done` is negative. Whatever is left is transferred synchronously,
+// which also covers kernels that lack the read and write operations.
+void uring_retire(FileSystem* fs, uint32_t slot, int32_t done) {
+	Uring* ring = &fs->uring;
+	IoRequest* request = &ring->requests[slot];
+	uint32_t moved = done < 0 ? 0 : min((uint32_t) done, request->size);
+	if(moved != request->size) {
+		if(request->write) {
+			io_write_at(fs, request->offset + moved, request->buffer + moved, request->size - moved);
+		} else {
+			io_read_at(fs, request->offset + moved, request->buffer + moved, request->size - moved);
 		}
-		result->current_cluster = fs->table_cache[result->current_cluster];
 	}
+	request->owner->pending--;
+	ring->free[ring->free_count++] = slot;
 }
 
-OptionalResult create_file(FileSystem* fs, DirCursor* current, DirEntry* target) {
-	uint8_t buffer[CLUSTER_SIZE];
-	target->current_cluster = current->current_cluster;
-	while(1) {
-		read(fs, target->current_cluster, buffer);
-		if(ferror(fs->file)) {
-			return OPTIONAL_IO_ERROR;
+// Hands the prepared requests to the kernel. If it takes none of them, they
+// are taken back from the ring and done here instead.
+void uring_submit(FileSystem* fs) {
+	Uring* ring = &fs->uring;
+	while(ring->queued != 0) {
+		int taken = ring->failed ? -1 : uring_enter(ring, ring->queued, 0);
+		if(taken > 0) {
+			ring->queued -= taken;
+			ring->in_flight += taken;
+			continue;
 		}
-		target->current_offset = 0;
-		while(1) {
-			if (buffer[target->current_offset+OFFSET_NAME] == 0) { // Empty file name
-				ClusterLocation first_cluster = allocate(fs);
-				if(first_cluster == TV_CANT_ALLOC) {
-					return OPTIONAL_STRUCTURE_ERROR;
-				}
-
-				write_u16(target->meta+OFFSET_CLUSTER, first_cluster);
-				memcpy(buffer+target->current_offset, target->meta, FILE_META);
-				write(fs, target->current_cluster, buffer);
-
-				memset(buffer, 0, CLUSTER_SIZE);
-				write(fs, first_cluster, buffer);
-				return OPTIONAL_OK;
-			}
-			if(memcmp(target->meta+OFFSET_NAME, buffer+target->current_offset+OFFSET_NAME, FILE_NAME_BUFFER) == 0) {
-				return OPTIONAL_STRUCTURE_ERROR;
-			}
-			target->current_offset += FILE_META;
-			if (target->current_offset == CLUSTER_SIZE) {
-				if(target->current_cluster == TV_FINAL) {
-					if(extend(fs, &target->current_cluster)) {
-						return OPTIONAL_STRUCTURE_ERROR;
-					}
-					memset(buffer, 0, CLUSTER_SIZE);
-					target->current_offset = 0;
-					continue;
-				} else {
-					target->current_cluster = fs->table_cache[target->current_cluster];
-					break;
-				}
-			}
+		if(taken < 0 && errno == EINTR && !ring->failed) {
+			continue;
 		}
+		if(taken < 0 && errno != EAGAIN && errno != EBUSY) {
+			ring->failed = 1;
+			fs->io_error = 1;
+		}
+		uint32_t tail = *ring->sq_tail;
+		for(uint32_t i = ring->queued; i != 0; i--) {
+			uring_retire(fs, ring->sqes[(tail - i) & *ring->sq_mask].user_data, -1);
+		}
+		__atomic_store_n(ring->sq_tail, tail - ring->queued, __ATOMIC_RELEASE);
+		ring->queued = 0;
 	}
 }
 
-OptionalResult delete_file(FileSystem* fs, DirCursor* parent, DirEntry* target) {
-	// TODO: проверить на баги
-	ClusterLocation current = get_cluster(target);
-	while(1) {
-		ClusterLocation next = fs->table_cache[current];
-		fs->table_cache[current] = TV_EMPTY;
-		if(next == TV_FINAL) {
-			break;
+// Retires the completions that have arrived, waiting for at least one. The
+// kernel finishes requests in flight even if the ring can't be waited on.
+void uring_reap(FileSystem* fs) {
+	Uring* ring = &fs->uring;
+	uint32_t head = *ring->cq_head;
+	uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while(head == tail) {
+		if(ring->failed) {
+			sched_yield();
+		} else if(uring_enter(ring, 0, 1) < 0 && errno != EINTR && errno != EAGAIN) {
+			ring->failed = 1;
+			fs->io_error = 1;
 		}
-		current = next;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
 	}
-
-	uint8_t buffer[CLUSTER_SIZE];
-	size_t offset = 0;
-	ClusterLocation prev = TV_EMPTY;
-	current = parent->current_cluster;
-	read(fs, current, buffer);
-	if(ferror(fs->file)) {
-		return OPTIONAL_IO_ERROR;
+	for(; head != tail; head++) {
+		struct io_uring_cqe* completion = &ring->cqes[head & *ring->cq_mask];
+		uring_retire(fs, completion->user_data, completion->res);
+		ring->in_flight--;
 	}
-	while(1) {
-		if (buffer[offset+OFFSET_NAME] == 0) { // Empty file name
-			offset -= FILE_META;
-			fseek(fs->file, ROOT_OFFSET + target->current_cluster * CLUSTER_SIZE + target->current_offset, SEEK_SET);
-			fwrite(buffer+offset, 1, FILE_META, fs->file);
-			if(ferror(fs->file)) {
-				return OPTIONAL_IO_ERROR;
-			}
-			if(offset == 0) {
-				if (prev == TV_EMPTY) {
-					buffer[offset+OFFSET_NAME] = 0;
-					write(fs, current, buffer);
-				} else {
-					fs->table_cache[prev] = TV_FINAL;
-					fs->table_cache[current] = TV_EMPTY;
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// Starts a transfer of the batch. Without io_uring it is done right away.
+// The buffer must stay untouched until io_batch_wait().
+void io_batch_add(FileSystem* fs, IoBatch* batch, uint64_t offset, uint8_t* buffer, size_t size, uint8_t write) {
+#ifdef FS_URING
+	if(fs->backend == BACKEND_URING) {
+		stat_io(fs, offset, size, write);
+		Uring* ring = &fs->uring;
+		pthread_mutex_lock(&ring->mutex);
+		while(size != 0 && !ring->failed) {
+			if(ring->queued + ring->in_flight >= ring->depth) {
+				uring_submit(fs);
+				if(ring->in_flight != 0) {
+					uring_reap(fs);
 				}
-			} else {
-				buffer[offset+OFFSET_NAME] = 0;
-				write(fs, current, buffer);
+				continue;
 			}
-			return OPTIONAL_OK;
+			uint32_t slot = ring->free[--ring->free_count];
+			IoRequest* request = &ring->requests[slot];
+			request->owner = batch;
+			request->buffer = buffer;
+			request->offset = offset;
+			request->size = min(size, IO_REQUEST_MAX);
+			request->write = write;
+			uint32_t tail = *ring->sq_tail;
+			uint32_t index = tail & *ring->sq_mask;
+			struct io_uring_sqe* entry = &ring->sqes[index];
+			memset(entry, 0, sizeof(struct io_uring_sqe));
+			entry->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+			entry->fd = fileno(fs->file);
+			entry->off = offset;
+			entry->addr = (uintptr_t) buffer;
+			entry->len = request->size;
+			entry->user_data = slot;
+			ring->sq_array[index] = index;
+			__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+			ring->queued++;
+			batch->pending++;
+			buffer += request->size;
+			offset += request->size;
+			size -= request->size;
 		}
-		offset += FILE_META;
-		if (offset == CLUSTER_SIZE) {
-			if(fs->table_cache[current] == TV_FINAL) {
-				offset -= FILE_META;
-				fseek(fs->file, ROOT_OFFSET + target->current_cluster * CLUSTER_SIZE + target->current_offset, SEEK_SET);
-				fwrite(buffer+offset, 1, FILE_META, fs->file);
-				if(ferror(fs->file)) {
-					return OPTIONAL_IO_ERROR;
-				}
-				buffer[offset+OFFSET_NAME] = 0;
-				write(fs, current, buffer);
-				memset(buffer, 0, CLUSTER_SIZE);
-				return OPTIONAL_OK;
+		pthread_mutex_unlock(&ring->mutex);
+		if(size != 0) { // The ring failed
+			if(write) {
+				io_write_at(fs, offset, buffer, size);
 			} else {
-				prev = current;
-				current = fs->table_cache[current];
-				read(fs, current, buffer);
-				if(ferror(fs->file)) {
-					return OPTIONAL_IO_ERROR;
-				}
+				io_read_at(fs, offset, buffer, size);
 			}
 		}
+		return;
+	}
+#endif
+	if(write) {
+		io_write(fs, offset, buffer, size);
+	} else {
+		io_read(fs, offset, buffer, size);
 	}
 }
 
-void open_dir(FileSystem* fs, DirEntry* entry, DirCursor* result) {
-	assert(is_folder(entry));
-	result->current_cluster = get_cluster(entry);
+// Waits for every transfer of the batch
+Result io_batch_wait(FileSystem* fs, IoBatch* batch) {
+#ifdef FS_URING
+	if(fs->backend == BACKEND_URING) {
+		Uring* ring = &fs->uring;
+		pthread_mutex_lock(&ring->mutex);
+		uring_submit(fs);
+		// Everything must be done before the caller's buffer and `batch` go away
+		while(batch->pending != 0) {
+			uring_reap(fs);
+		}
+		pthread_mutex_unlock(&ring->mutex);
+	}
+#endif
+	return fs_error(fs);
 }
 
-void open_file(FileSystem* fs, DirEntry* entry, FileIO* result) {
-	assert(!is_folder(entry));
-	result->offset = 0;
-	result->current = result->first = get_cluster(entry);
-	result->metaFileSize = get_meta_size(entry);
-	result->metaFileSizeLocation = ROOT_OFFSET + entry->current_cluster*CLUSTER_SIZE + entry->current_offset + OFFSET_SIZE;
+// Limits the requests that are queued or in flight at once
+Result set_queue_depth(FileSystem* fs, uint32_t depth) {
+#ifdef FS_URING
+	if(fs->backend == BACKEND_URING && depth != 0 && depth <= IO_QUEUE_MAX) {
+		pthread_mutex_lock(&fs->uring.mutex);
+		fs->uring.depth = depth;
+		pthread_mutex_unlock(&fs->uring.mutex);
+		return 0;
+	}
+#endif
+	return 1;
 }
 
-// TODO: buffer?
-OptionalResult set_length(FileSystem* fs, FileIO* file, FileCursor length) {
-	ClusterLocation current = file->first;
-	ClusterLocation remaining = length / CLUSTER_SIZE;
-	file->metaFileSize = length % CLUSTER_SIZE;
-	file->current = file->first;
-	file->offset = 0;
-	while(1) {
-		if(fs->table_cache[current] == TV_FINAL) {
-			if(extend(fs, &current)) {
-				return OPTIONAL_STRUCTURE_ERROR;
-			}
-		} else {
-			current = fs->table_cache[current];
+// Tells the OS that the range will be read soon
+void io_advise(FileSystem* fs, uint64_t offset, size_t size) {
+#ifdef FS_MMAP
+	if(fs->backend == BACKEND_MMAP) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset / page * page;
+		if(io_slice(fs, start, offset + size - start) != NULL) {
+			madvise(fs->map + start, offset + size - start, MADV_WILLNEED);
 		}
-		if (remaining == 0) {
-			break;
+		return;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fileno(fs->file), offset, size, POSIX_FADV_WILLNEED);
+#endif
+#endif
+}
+
+// Makes the range durable
+void io_sync(FileSystem* fs, uint64_t offset, uint64_t size) {
+#ifdef FS_MMAP
+	if(fs->backend == BACKEND_MMAP) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset / page * page;
+		if(msync(fs->map + start, min(offset + size, fs->map_size) - start, MS_SYNC)) {
+			fs->io_error = 1;
 		}
-		remaining--;
+		return;
 	}
-	ClusterLocation next = fs->table_cache[current];
-	fs->table_cache[current] = TV_FINAL;
-	current = next;
-	while(current != TV_FINAL) {
-		next = fs->table_cache[current];
-		fs->table_cache[current] = TV_EMPTY;
-		current = next;
+	fflush(fs->file);
+	if(fsync(fileno(fs->file))) {
+		fs->io_error = 1;
 	}
-	return OPTIONAL_OK;
+#else
+	fflush(fs->file);
+#endif
 }
 
-// TODO: buffer?
-OptionalResult seek(FileSystem* fs, FileIO* file, FileCursor location) {
-	file->current = file->first;
-	for(ClusterLocation i = location / CLUSTER_SIZE; i != 0; i--) {
-		file->current = fs->table_cache[file->current];
-		if(file->current == TV_FINAL) {
-			return OPTIONAL_STRUCTURE_ERROR;
-		}
+Result locks_init(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_rwlockattr_t attributes;
+	pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+	// A stream of readers must not starve create_file() and close_file()
+	pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	Result ret = pthread_rwlock_init(&fs->lock, &attributes) != 0 || pthread_mutex_init(&fs->cache_mutex, NULL) != 0;
+	pthread_rwlockattr_destroy(&attributes);
+	for(uint32_t i = 0; i != DIR_LOCK_STRIPES; i++) {
+		ret |= pthread_mutex_init(&fs->dir_locks[i], NULL) != 0;
 	}
-	file->offset = location % CLUSTER_SIZE;
-	return OPTIONAL_OK;
+	return ret;
+#else
+	return 0;
+#endif
 }
 
-// TODO: buffer?
-OptionalResult write_to_file(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
-	while(size != 0) {
-		ClusterOffset left = CLUSTER_SIZE - file->offset;
-		ClusterOffset to_write = min(size, left);
-		fseek(fs->file, ROOT_OFFSET + file->current * CLUSTER_SIZE + file->offset, SEEK_SET);
-		fwrite(buffer, 1, to_write, fs->file);
-		if(ferror(fs->file)) {
+void locks_destroy(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_rwlock_destroy(&fs->lock);
+	pthread_mutex_destroy(&fs->cache_mutex);
+	for(uint32_t i = 0; i != DIR_LOCK_STRIPES; i++) {
+		pthread_mutex_destroy(&fs->dir_locks[i]);
+	}
+#endif
+}
+
+// The public functions below take these themselves and never nest them
+void fs_lock_shared(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_rwlock_rdlock(&fs->lock);
+#endif
+}
+
+void fs_lock_exclusive(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_rwlock_wrlock(&fs->lock);
+#endif
+}
+
+void fs_unlock(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_rwlock_unlock(&fs->lock);
+#endif
+}
+
+void cache_lock(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_mutex_lock(&fs->cache_mutex);
+#endif
+}
+
+void cache_unlock(FileSystem* fs) {
+#ifdef FS_THREADS
+	pthread_mutex_unlock(&fs->cache_mutex);
+#endif
+}
+
+// Directories are striped over DIR_LOCK_STRIPES mutexes by their first cluster
+void dir_lock(FileSystem* fs, ClusterLocation directory) {
+#ifdef FS_THREADS
+	pthread_mutex_lock(&fs->dir_locks[directory % DIR_LOCK_STRIPES]);
+#endif
+}
+
+void dir_unlock(FileSystem* fs, ClusterLocation directory) {
+#ifdef FS_THREADS
+	pthread_mutex_unlock(&fs->dir_locks[directory % DIR_LOCK_STRIPES]);
+#endif
+}
+
+uint64_t cluster_offset(FileSystem* fs, ClusterLocation cluster) {
+	return fs->data_offset + (uint64_t) cluster * fs->cluster_size;
+}
+
+void read_uncached(FileSystem* fs, ClusterLocation cluster, uint8_t* buffer) {
+	io_read(fs, cluster_offset(fs, cluster), buffer, fs->cluster_size);
+}
+
+void write_uncached(FileSystem* fs, ClusterLocation cluster, uint8_t* buffer) {
+	io_write(fs, cluster_offset(fs, cluster), buffer, fs->cluster_size);
+}
+
+// The cache holds CACHE_BYTES worth of clusters, but never fewer than CACHE_MIN_SLOTS
+Result cache_init(FileSystem* fs) {
+	ClusterCache* cache = &fs->cache;
+	memset(cache, 0, sizeof(ClusterCache));
+	cache->slot_count = max(CACHE_BYTES / fs->cluster_size, CACHE_MIN_SLOTS);
+	uint32_t buckets = 1;
+	while(buckets < cache->slot_count * 2) {
+		buckets *= 2;
+	}
+	cache->mask = buckets - 1;
+	cache->slots = calloc(cache->slot_count, sizeof(CacheSlot));
+	cache->buckets = calloc(buckets, sizeof(uint32_t));
+	cache->data = malloc((size_t) cache->slot_count * fs->cluster_size);
+	if(cache->slots == NULL || cache->buckets == NULL || cache->data == NULL) {
+		return 1;
+	}
+	for(uint32_t i = 0; i != cache->slot_count; i++) {
+		cache->slots[i].data = cache->data + (size_t) i * fs->cluster_size;
+	}
+	return 0;
+}
+
+// Link that holds the slot of `cluster`, or the CACHE_EMPTY ending its bucket
+uint32_t* cache_link(ClusterCache* cache, ClusterLocation cluster) {
+	uint32_t* link = &cache->buckets[(cluster * 2654435761u) & cache->mask];
+	while(*link != CACHE_EMPTY && cache->slots[*link-1].cluster != cluster) {
+		link = &cache->slots[*link-1].next;
+	}
+	return link;
+}
+
+Result journal_commit(FileSystem* fs);
+
+uint8_t slot_logged(CacheSlot* slot) {
+	return slot->log_zero || slot->log_from != slot->log_to;
+}
+
+// A cluster goes home only after its changes are in the journal. Eviction
+// holds logged clusters instead, so this commits only when that fails.
+void cache_write_slot(FileSystem* fs, CacheSlot* slot) {
+	if(slot_logged(slot)) {
+		journal_commit(fs);
+	}
+	if(slot->dirty) {
+		write_uncached(fs, slot->cluster, slot->data);
+		slot->dirty = 0;
+		fs->cache.writebacks++;
+	}
+}
+
+void cache_writeback(FileSystem* fs, ClusterLocation cluster) {
+	cache_lock(fs);
+	uint32_t index = *cache_link(&fs->cache, cluster);
+	if(index != CACHE_EMPTY) {
+		cache_write_slot(fs, &fs->cache.slots[index-1]);
+	}
+	cache_unlock(fs);
+}
+
+// Forgets the cluster without writing it back (it was freed)
+void cache_discard(FileSystem* fs, ClusterLocation cluster) {
+	uint32_t* link = cache_link(&fs->cache, cluster);
+	if(*link != CACHE_EMPTY) {
+		CacheSlot* slot = &fs->cache.slots[*link-1];
+		*link = slot->next;
+		slot->valid = 0;
+		slot->dirty = 0;
+		slot->referenced = 0;
+		slot->log_zero = 0;
+		slot->log_from = slot->log_to = 0;
+	}
+}
+
+// Flushes the cluster and forgets it, so that it can be accessed directly on disk
+void cache_drop(FileSystem* fs, ClusterLocation cluster) {
+	cache_lock(fs);
+	uint32_t index = *cache_link(&fs->cache, cluster);
+	if(index != CACHE_EMPTY) {
+		cache_write_slot(fs, &fs->cache.slots[index-1]);
+		cache_discard(fs, cluster);
+	}
+	cache_unlock(fs);
+}
+
+// Sets aside an evicted cluster whose changes are not in the journal yet. It
+// goes home after the commit, as the operation may not be complete.
+Result cache_hold(FileSystem* fs, CacheSlot* slot) {
+	Journal* journal = &fs->journal;
+	if(journal->held_count == journal->held_capacity) {
+		uint32_t capacity = journal->held_capacity ? journal->held_capacity * 2 : CHAIN_INITIAL;
+		CacheSlot* held = realloc(journal->held, capacity * sizeof(CacheSlot));
+		if(held == NULL) {
+			return 1;
+		}
+		journal->held = held;
+		journal->held_capacity = capacity;
+	}
+	uint8_t* data = malloc(fs->cluster_size);
+	if(data == NULL) {
+		return 1;
+	}
+	memcpy(data, slot->data, fs->cluster_size);
+	CacheSlot* copy = &journal->held[journal->held_count++];
+	*copy = *slot;
+	copy->data = data;
+	return 0;
+}
+
+// Moves a held cluster back into `slot`. Returns 0 if it was not held.
+uint8_t cache_unhold(FileSystem* fs, ClusterLocation cluster, CacheSlot* slot) {
+	Journal* journal = &fs->journal;
+	for(uint32_t i = 0; i != journal->held_count; i++) {
+		CacheSlot* copy = &journal->held[i];
+		if(copy->cluster == cluster) {
+			memcpy(slot->data, copy->data, fs->cluster_size);
+			slot->dirty = copy->dirty;
+			slot->log_zero = copy->log_zero;
+			slot->log_from = copy->log_from;
+			slot->log_to = copy->log_to;
+			free(copy->data);
+			*copy = journal->held[--journal->held_count];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void cache_flush(FileSystem* fs) {
+	for(uint32_t i = 0; i != fs->cache.slot_count; i++) {
+		if(fs->cache.slots[i].valid) {
+			cache_write_slot(fs, &fs->cache.slots[i]);
+		}
+	}
+}
+
+CacheSlot* cache_get(FileSystem* fs, ClusterLocation cluster, uint8_t load) {
+	ClusterCache* cache = &fs->cache;
+	if(fs->backend == BACKEND_MMAP && fs->journal.size == 0) {
+		cache->direct.data = io_slice(fs, cluster_offset(fs, cluster), fs->cluster_size);
+		if(cache->direct.data == NULL) {
+			fs->io_error = 1;
+			cache->direct.data = cache->data;
+		}
+		return &cache->direct;
+	}
+	uint32_t* link = cache_link(cache, cluster);
+	if(*link != CACHE_EMPTY) {
+		cache->hits++;
+		cache->slots[*link-1].referenced = 1;
+		return &cache->slots[*link-1];
+	}
+	cache->misses++;
+	CacheSlot* slot;
+	uint32_t pinned = 0;
+	while(1) {
+		slot = &cache->slots[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->slot_count;
+		if(!slot->valid) {
+			break;
+		}
+		if(slot->referenced) {
+			slot->referenced = 0;
+			continue;
+		}
+		// Clusters with unlogged changes are evicted last, and then held
+		// until the commit. Only running out of memory commits early.
+		if(slot_logged(slot) && pinned++ < cache->slot_count) {
+			continue;
+		}
+		if(!slot_logged(slot) || cache_hold(fs, slot)) {
+			cache_write_slot(fs, slot);
+		}
+		cache_discard(fs, slot->cluster);
+		break;
+	}
+	link = cache_link(cache, cluster);
+	slot->cluster = cluster;
+	slot->next = *link;
+	slot->valid = 1;
+	slot->dirty = 0;
+	slot->referenced = 1;
+	*link = slot - cache->slots + 1;
+	if(!cache_unhold(fs, cluster, slot) && load) {
+		read_uncached(fs, cluster, slot->data);
+	}
+	return slot;
+}
+
+// Copies bytes out of a cluster. Unlike the slot returned by cache_get(), the
+// copy stays valid when another holder of the shared lock evicts the cluster.
+void cache_read(FileSystem* fs, ClusterLocation cluster, size_t offset, uint8_t* buffer, size_t size) {
+	cache_lock(fs);
+	memcpy(buffer, cache_get(fs, cluster, 1)->data + offset, size);
+	cache_unlock(fs);
+}
+
+// Records a change to a metadata cluster for the next commit
+void cache_mark(FileSystem* fs, CacheSlot* slot, size_t offset, size_t size) {
+	slot->dirty = 1;
+	if(fs->journal.size == 0) {
+		return;
+	}
+	if(slot->log_from == slot->log_to) {
+		slot->log_from = offset;
+		slot->log_to = offset + size;
+	} else {
+		slot->log_from = min(slot->log_from, offset);
+		slot->log_to = max(slot->log_to, offset + size);
+	}
+}
+
+void zero_cluster(FileSystem* fs, ClusterLocation cluster) {
+	CacheSlot* slot = cache_get(fs, cluster, 0);
+	memset(slot->data, 0, fs->cluster_size);
+	slot->dirty = 1;
+	if(fs->journal.size != 0) {
+		slot->log_zero = 1;
+		slot->log_from = slot->log_to = 0;
+	}
+}
+
+uint16_t read_u16(uint8_t* ptr) {
+	return ptr[0] | ptr[1] << 8;
+}
+
+void write_u16(uint8_t* ptr, uint16_t value) {
+	ptr[0] = value;
+	ptr[1] = value >> 8;
+}
+
+uint32_t read_u32(uint8_t* ptr) {
+	return ptr[0] | ptr[1] << 8 | ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+void write_u32(uint8_t* ptr, uint32_t value) {
+	ptr[0] = value;
+	ptr[1] = value >> 8;
+	ptr[2] = value >> 16;
+	ptr[3] = value >> 24;
+}
+
+uint64_t read_u64(uint8_t* ptr) {
+	return read_u32(ptr) | (uint64_t) read_u32(ptr + 4) << 32;
+}
+
+void write_u64(uint8_t* ptr, uint64_t value) {
+	write_u32(ptr, value);
+	write_u32(ptr + 4, value >> 32);
+}
+
+// Entries come in two layouts. Version 1 keeps only the size within the last
+// cluster (or FS_FOLDER) and a 60 byte name. Version 2 has ENTRY_V2 and flags
+// in place of that size, a shorter name, and the full size, cluster count,
+// last cluster and a 32-bit first cluster in the tail of the entry.
+uint8_t meta_is_v2(uint8_t* meta) {
+	uint16_t tag = read_u16(meta + OFFSET_SIZE);
+	return tag >= ENTRY_V2 && tag < FS_INDEX;
+}
+
+uint8_t is_v2(DirEntry* entry) {
+	return meta_is_v2(entry->meta);
+}
+
+// Small files created as version 2 entries carry FLAG_INLINE and own no
+// clusters. The size takes the place of the 16-bit cluster and the bytes
+// follow the name up to the end of the entry.
+uint8_t meta_is_inline(uint8_t* meta) {
+	return meta_is_v2(meta) && (read_u16(meta + OFFSET_SIZE) & FLAG_INLINE) != 0;
+}
+
+uint8_t is_inline(DirEntry* entry) {
+	return meta_is_inline(entry->meta);
+}
+
+uint8_t is_compressed(DirEntry* entry) {
+	return is_v2(entry) && (read_u16(entry->meta + OFFSET_SIZE) & FLAG_COMPRESSED) != 0;
+}
+
+uint8_t is_sparse(DirEntry* entry) {
+	return is_v2(entry) && (read_u16(entry->meta + OFFSET_SIZE) & FLAG_SPARSE) != 0;
+}
+
+ClusterOffset inline_offset(uint8_t* meta) {
+	return OFFSET_NAME + strnlen(meta + OFFSET_NAME, V2_NAME_BUFFER - 1) + 1;
+}
+
+ClusterOffset inline_capacity(uint8_t* meta) {
+	return FILE_META - inline_offset(meta);
+}
+
+uint8_t name_equals(uint8_t* meta, uint8_t* name) {
+	size_t buffer = meta_is_v2(meta) ? V2_NAME_BUFFER : FILE_NAME_BUFFER;
+	size_t length = strnlen(name, FILE_NAME_BUFFER);
+	return length < buffer && memcmp(meta + OFFSET_NAME, name, length + 1) == 0;
+}
+
+ClusterLocation get_cluster(DirEntry* entry) {
+	if(is_inline(entry)) {
+		return TV_FINAL;
+	}
+	if(is_v2(entry)) {
+		return read_u32(entry->meta + OFFSET_V2_FIRST);
+	}
+	return read_u16(entry->meta + OFFSET_CLUSTER);
+}
+
+void set_cluster(DirEntry* entry, ClusterLocation cluster) {
+	write_u16(entry->meta + OFFSET_CLUSTER, cluster);
+	if(is_v2(entry)) {
+		write_u32(entry->meta + OFFSET_V2_FIRST, cluster);
+		write_u32(entry->meta + OFFSET_V2_LAST, cluster);
+		write_u32(entry->meta + OFFSET_V2_CLUSTERS, 1);
+		write_u64(entry->meta + OFFSET_V2_SIZE, 0);
+	}
+}
+
+ClusterOffset get_meta_size(DirEntry* entry) {
+	return read_u16(entry->meta + OFFSET_SIZE);
+}
+
+uint8_t is_folder(DirEntry* entry) {
+	if(is_v2(entry)) {
+		return (get_meta_size(entry) & FLAG_FOLDER) != 0;
+	}
+	return get_meta_size(entry) == FS_FOLDER;
+}
+
+// get_file_size() for callers that hold the lock
+FileCursor entry_size(FileSystem* fs, DirEntry* entry) {
+	if(is_inline(entry)) {
+		return read_u16(entry->meta + OFFSET_CLUSTER);
+	}
+	if(is_v2(entry)) {
+		return read_u64(entry->meta + OFFSET_V2_SIZE);
+	}
+	FileCursor ret = (FileCursor) get_meta_size(entry);
+	ClusterLocation cluster = get_cluster(entry);
+	while(fs->table_cache[cluster] != TV_FINAL) {
+		cluster = fs->table_cache[cluster];
+		ret += fs->cluster_size;
+		stat_add(&fs->stats.fat_hops, 1);
+	}
+	return ret;
+}
+
+FileCursor get_file_size(FileSystem* fs, DirEntry* entry) {
+	if(is_inline(entry) || is_v2(entry)) {
+		return entry_size(fs, entry);
+	}
+	fs_lock_shared(fs);
+	FileCursor ret = entry_size(fs, entry);
+	fs_unlock(fs);
+	return ret;
+}
+
+// Bytes of the clusters the file takes, which is less than its size for
+// sparse files with holes. The map of a sparse file counts as well.
+FileCursor get_allocated_size(FileSystem* fs, DirEntry* entry) {
+	if(is_inline(entry)) {
+		return 0;
+	}
+	if(is_v2(entry)) {
+		return (FileCursor) read_u32(entry->meta + OFFSET_V2_CLUSTERS) * fs->cluster_size;
+	}
+	return (get_file_size(fs, entry) / fs->cluster_size + 1) * fs->cluster_size;
+}
+
+uint8_t* get_file_name(DirEntry* entry) {
+	return entry->meta+OFFSET_NAME;
+}
+
+uint8_t name_fits_v2(uint8_t* name) {
+	return strnlen(name, FILE_NAME_BUFFER) < V2_NAME_BUFFER;
+}
+
+// Names too long for version 2 are kept in version 1 entries. Those address
+// the first cluster with 16 bits and keep the size within the last cluster
+// below ENTRY_V2, so only volumes of such geometry can have them.
+uint8_t long_names_allowed(FileSystem* fs) {
+	return fs->clusters_count <= LEGACY_FINAL && fs->cluster_size <= ENTRY_V2;
+}
+
+// New entries are version 2 if the name fits, and files start out inline.
+// Longer names get a version 1 entry, see long_names_allowed().
+void init_meta(DirEntry* entry, uint8_t is_folder, uint8_t* name) {
+	memset(entry->meta, 0, FILE_META);
+	if(name_fits_v2(name)) {
+		write_u16(entry->meta + OFFSET_SIZE, ENTRY_V2 | (is_folder ? FLAG_FOLDER : FLAG_INLINE));
+	} else {
+		write_u16(entry->meta + OFFSET_SIZE, is_folder ? FS_FOLDER : 0);
+	}
+	memcpy(entry->meta + OFFSET_NAME, name, strnlen(name, MAX_FILE_NAME));
+}
+
+uint8_t lowest_bit(uint64_t word) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	uint8_t ret = 0;
+	while(!(word & 1)) {
+		word >>= 1;
+		ret++;
+	}
+	return ret;
+#endif
+}
+
+void mark_used(FileSystem* fs, ClusterLocation cluster) {
+	FreeMap* map = &fs->free_map;
+	size_t word = cluster / MAP_WORD_BITS;
+	uint64_t bit = (uint64_t) 1 << (cluster % MAP_WORD_BITS);
+	if(map->used[word] & bit) {
+		return;
+	}
+	map->used[word] |= bit;
+	map->free_count--;
+	if(map->used[word] == UINT64_MAX) {
+		map->full[word / MAP_WORD_BITS] |= (uint64_t) 1 << (word % MAP_WORD_BITS);
+	}
+}
+
+void mark_free(FileSystem* fs, ClusterLocation cluster) {
+	FreeMap* map = &fs->free_map;
+	size_t word = cluster / MAP_WORD_BITS;
+	uint64_t bit = (uint64_t) 1 << (cluster % MAP_WORD_BITS);
+	if(!(map->used[word] & bit)) {
+		return;
+	}
+	map->used[word] &= ~bit;
+	map->free_count++;
+	map->full[word / MAP_WORD_BITS] &= ~((uint64_t) 1 << (word % MAP_WORD_BITS));
+}
+
+Result free_map_build(FileSystem* fs) {
+	FreeMap* map = &fs->free_map;
+	map->words = ((size_t) fs->clusters_count + MAP_WORD_BITS - 1) / MAP_WORD_BITS;
+	map->summary_words = (map->words + MAP_WORD_BITS - 1) / MAP_WORD_BITS;
+	map->used = calloc(map->words, sizeof(uint64_t));
+	map->full = calloc(map->summary_words, sizeof(uint64_t));
+	if(map->used == NULL || map->full == NULL) {
+		return 1;
+	}
+	map->free_count = map->words * MAP_WORD_BITS;
+	map->hint = 1;
+	for(size_t i = 0; i != map->words * MAP_WORD_BITS; i++) {
+		if(i >= fs->clusters_count || fs->table_cache[i] != TV_EMPTY) {
+			mark_used(fs, i);
+		}
+	}
+	return 0;
+}
+
+ClusterLocation free_clusters(FileSystem* fs) {
+	return fs->free_map.free_count;
+}
+
+// free_clusters() and the clusters that the next journal commit frees
+ClusterLocation available_clusters(FileSystem* fs) {
+	return fs->free_map.free_count + fs->journal.freed_count;
+}
+
+// Next-fit search: first free cluster at or after `from`, wrapping around once.
+// Words of `used` without free bits are skipped through the `full` summary.
+ClusterLocation find_free(FileSystem* fs, ClusterLocation from) {
+	FreeMap* map = &fs->free_map;
+	if(map->free_count == 0) {
+		return TV_CANT_ALLOC;
+	}
+	size_t start = from / MAP_WORD_BITS;
+	uint64_t candidates = ~map->used[start] & ~(((uint64_t) 1 << (from % MAP_WORD_BITS)) - 1);
+	if(candidates) {
+		return start * MAP_WORD_BITS + lowest_bit(candidates);
+	}
+	for(size_t i = 0; i <= map->summary_words; i++) {
+		size_t summary = (start / MAP_WORD_BITS + i) % map->summary_words;
+		uint64_t words = ~map->full[summary];
+		if(i == 0) {
+			words &= ~(((uint64_t) 2 << (start % MAP_WORD_BITS)) - 1);
+		}
+		if(summary == map->summary_words - 1 && map->words % MAP_WORD_BITS != 0) {
+			words &= ((uint64_t) 1 << (map->words % MAP_WORD_BITS)) - 1;
+		}
+		if(words) {
+			size_t word = summary * MAP_WORD_BITS + lowest_bit(words);
+			return word * MAP_WORD_BITS + lowest_bit(~map->used[word]);
+		}
+	}
+	return TV_CANT_ALLOC;
+}
+
+// All FAT updates go through here so that the journal sees them
+void ref_add(FileSystem* fs, ClusterLocation cluster) {
+	if(cluster != TV_EMPTY && cluster < fs->clusters_count && ++fs->refs[cluster] == 2) {
+		fs->join_points++;
+		fs->sharing++;
+	}
+}
+
+void ref_drop(FileSystem* fs, ClusterLocation cluster) {
+	if(cluster != TV_EMPTY && cluster < fs->clusters_count && fs->refs[cluster] != 0 && --fs->refs[cluster] == 1) {
+		fs->join_points--;
+	}
+}
+
+Result refs_build(FileSystem* fs) {
+	fs->refs = calloc(fs->clusters_count, sizeof(uint32_t));
+	if(fs->refs == NULL) {
+		return 1;
+	}
+	fs->join_points = 0;
+	fs->sharing = 1;
+	for(ClusterLocation c = 0; c != fs->clusters_count; c++) {
+		ref_add(fs, fs->table_cache[c]);
+	}
+	return 0;
+}
+
+// Queues the page of `flags` that holds `cluster` for the next commit
+void journal_page(FileSystem* fs, uint8_t* flags, ClusterLocation cluster) {
+	if(!flags[cluster / FAT_PAGE]) {
+		flags[cluster / FAT_PAGE] = 1;
+		fs->journal.fat_pending++;
+	}
+}
+
+void set_next(FileSystem* fs, ClusterLocation cluster, ClusterLocation next) {
+	Journal* journal = &fs->journal;
+	ClusterLocation previous = fs->table_cache[cluster];
+	if(fs->refs != NULL) {
+		ref_drop(fs, previous);
+		ref_add(fs, next);
+		if(fs->refs_offset != 0) {
+			if(previous != TV_EMPTY && previous < fs->clusters_count) {
+				journal_page(fs, journal->refs_log, previous);
+			}
+			if(next != TV_EMPTY && next < fs->clusters_count) {
+				journal_page(fs, journal->refs_log, next);
+			}
+		}
+	}
+	fs->table_cache[cluster] = next;
+	if(journal->size != 0) {
+		journal_page(fs, journal->fat_log, cluster);
+	}
+}
+
+ClusterLocation allocate(FileSystem* fs) {
+	ClusterLocation ret = find_free(fs, fs->free_map.hint);
+	if(ret == TV_CANT_ALLOC) {
+		return TV_CANT_ALLOC;
+	}
+	set_next(fs, ret, TV_FINAL);
+	mark_used(fs, ret);
+	fs->free_map.hint = ret + 1 == fs->clusters_count ? 1 : ret + 1;
+	stat_add(&fs->stats.allocations, 1);
+	return ret;
+}
+
+void release(FileSystem* fs, ClusterLocation cluster) {
+	set_next(fs, cluster, TV_EMPTY);
+	cache_discard(fs, cluster);
+	if(fs->dedup.indexed != NULL) {
+		fs->dedup.indexed[cluster / MAP_WORD_BITS] &= ~((uint64_t) 1 << (cluster % MAP_WORD_BITS));
+	}
+	Journal* journal = &fs->journal;
+	if(journal->size != 0) { // Stays taken until the commit
+		if(journal->freed_count == journal->freed_capacity) {
+			uint32_t capacity = journal->freed_capacity ? journal->freed_capacity * 2 : CHAIN_INITIAL;
+			ClusterLocation* freed = realloc(journal->freed, capacity * sizeof(ClusterLocation));
+			if(freed != NULL) {
+				journal->freed = freed;
+				journal->freed_capacity = capacity;
+			}
+		}
+		if(journal->freed_count != journal->freed_capacity) {
+			journal->freed[journal->freed_count++] = cluster;
+			return;
+		}
+	}
+	mark_free(fs, cluster);
+}
+
+uint32_t checksum(uint8_t* data, size_t size) {
+	uint32_t ret = 2166136261u;
+	for(size_t i = 0; i != size; i++) {
+		ret = (ret ^ data[i]) * 16777619u;
+	}
+	return ret;
+}
+
+uint8_t* journal_record(uint8_t* at, uint32_t type, uint32_t length, uint64_t epoch) {
+	write_u32(at + RECORD_TYPE, type);
+	write_u32(at + RECORD_LENGTH, length);
+	write_u64(at + RECORD_EPOCH, epoch);
+	return at + RECORD_HEADER;
+}
+
+// Writes the records of one transaction to their home locations
+void journal_apply(FileSystem* fs, uint8_t* records, size_t size) {
+	uint8_t zeros[IO_BUFFER];
+	memset(zeros, 0, IO_BUFFER);
+	for(size_t position = 0; position < size; ) {
+		uint32_t type = read_u32(records + position + RECORD_TYPE);
+		uint32_t length = read_u32(records + position + RECORD_LENGTH);
+		uint8_t* payload = records + position + RECORD_HEADER;
+		position += RECORD_HEADER + length;
+		if(length < sizeof(uint32_t) || read_u32(payload) >= fs->clusters_count) {
+			continue;
+		}
+		ClusterLocation first = read_u32(payload);
+		if(type == RECORD_FAT || (type == RECORD_REFS && fs->refs_offset != 0)) {
+			uint64_t table = type == RECORD_FAT ? fs->fat_offset : fs->refs_offset;
+			uint32_t count = min((length - sizeof(uint32_t)) / sizeof(ClusterLocation), fs->clusters_count - first);
+			io_write(fs, table + (uint64_t) first * sizeof(ClusterLocation), payload + sizeof(uint32_t), count * sizeof(ClusterLocation));
+		} else if(type == RECORD_META && length >= 2 * sizeof(uint32_t)) {
+			uint32_t offset = read_u32(payload + sizeof(uint32_t));
+			uint32_t bytes = length - 2 * sizeof(uint32_t);
+			if(offset <= fs->cluster_size && bytes <= fs->cluster_size - offset) {
+				io_write(fs, cluster_offset(fs, first) + offset, payload + 2 * sizeof(uint32_t), bytes);
+			}
+		} else if(type == RECORD_ZERO) {
+			for(uint32_t done = 0; done < fs->cluster_size; done += IO_BUFFER) {
+				io_write(fs, cluster_offset(fs, first) + done, zeros, min(IO_BUFFER, fs->cluster_size - done));
+			}
+		}
+	}
+}
+
+// Applies every complete transaction of the journal image, stopping at the
+// first record of another epoch or with a bad checksum
+void journal_replay(FileSystem* fs, uint8_t* region, uint32_t size, uint64_t epoch) {
+	uint32_t start = JOURNAL_HEADER;
+	uint32_t position = start;
+	while(size - position >= RECORD_HEADER) {
+		uint8_t* record = region + position;
+		uint32_t length = read_u32(record + RECORD_LENGTH);
+		if(read_u64(record + RECORD_EPOCH) != epoch || length > size - position - RECORD_HEADER) {
+			break;
+		}
+		position += RECORD_HEADER + length;
+		if(read_u32(record + RECORD_TYPE) != RECORD_COMMIT) {
+			continue;
+		}
+		if(length != sizeof(uint32_t) || read_u32(record + RECORD_HEADER) != checksum(region + start, record - region - start)) {
+			break;
+		}
+		journal_apply(fs, region + start, record - region - start);
+		start = position;
+	}
+}
+
+// Starts an empty journal in a new epoch, which invalidates the old records
+void journal_reset(FileSystem* fs, uint64_t epoch) {
+	Journal* journal = &fs->journal;
+	uint8_t header[JOURNAL_HEADER];
+	memset(header, 0, JOURNAL_HEADER);
+	memcpy(header + JOURNAL_MAGIC, JOURNAL_MAGIC_BYTES, sizeof(JOURNAL_MAGIC_BYTES));
+	write_u64(header + JOURNAL_EPOCH, epoch);
+	io_write(fs, journal->offset, header, JOURNAL_HEADER);
+	io_sync(fs, journal->offset, JOURNAL_HEADER);
+	journal->epoch = epoch;
+	journal->tail = JOURNAL_HEADER;
+	memset(journal->logged, 0, (fs->clusters_count + MAP_WORD_BITS - 1) / MAP_WORD_BITS * sizeof(uint64_t));
+}
+
+// Copies the committed transactions home and empties the journal
+void journal_checkpoint(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	if(journal->tail == JOURNAL_HEADER) {
+		return;
+	}
+	uint8_t* region = malloc(journal->tail);
+	if(region == NULL) {
+		fs->io_error = 1;
+		return;
+	}
+	io_read(fs, journal->offset, region, journal->tail);
+	journal_replay(fs, region, journal->tail, journal->epoch);
+	free(region);
+	io_sync(fs, 0, UINT64_MAX);
+	journal_reset(fs, journal->epoch + 1);
+}
+
+// Bytes of the records for the queued pages of `flags`
+size_t journal_pages_size(FileSystem* fs, uint8_t* flags) {
+	size_t ret = 0;
+	for(uint32_t page = 0; flags != NULL && page * FAT_PAGE < fs->clusters_count; page++) {
+		if(flags[page]) {
+			ret += RECORD_HEADER + sizeof(uint32_t) + min(FAT_PAGE, fs->clusters_count - page * FAT_PAGE) * sizeof(ClusterLocation);
+		}
+	}
+	return ret;
+}
+
+// Appends a record of `type` for every queued page of `table` at `at`
+uint8_t* journal_pages(FileSystem* fs, uint8_t* at, uint32_t type, uint8_t* flags, uint32_t* table) {
+	for(uint32_t page = 0; flags != NULL && page * FAT_PAGE < fs->clusters_count; page++) {
+		if(flags[page]) {
+			uint32_t count = min(FAT_PAGE, fs->clusters_count - page * FAT_PAGE);
+			uint8_t* payload = journal_record(at, type, sizeof(uint32_t) + count * sizeof(ClusterLocation), fs->journal.epoch);
+			write_u32(payload, page * FAT_PAGE);
+			for(uint32_t i = 0; i != count; i++) {
+				write_u32(payload + sizeof(uint32_t) + i * sizeof(ClusterLocation), table[page * FAT_PAGE + i]);
+			}
+			at = payload + sizeof(uint32_t) + count * sizeof(ClusterLocation);
+		}
+	}
+	return at;
+}
+
+// Writes the queued pages of `table` to its home at `offset`
+void journal_pages_home(FileSystem* fs, uint64_t offset, uint8_t* flags, uint32_t* table) {
+	for(uint32_t page = 0; flags != NULL && page * FAT_PAGE < fs->clusters_count; page++) {
+		if(flags[page]) {
+			uint32_t count = min(FAT_PAGE, fs->clusters_count - page * FAT_PAGE);
+			io_write(fs, offset + (uint64_t) page * FAT_PAGE * sizeof(ClusterLocation), (uint8_t*) (table + page * FAT_PAGE), count * sizeof(ClusterLocation));
+		}
+	}
+}
+
+// Bytes of the records for the changes of a cached cluster
+size_t journal_slot_size(CacheSlot* slot) {
+	size_t ret = slot->log_zero ? RECORD_HEADER + sizeof(uint32_t) : 0;
+	if(slot->log_from != slot->log_to) {
+		ret += RECORD_HEADER + 2 * sizeof(uint32_t) + slot->log_to - slot->log_from;
+	}
+	return ret;
+}
+
+uint8_t* journal_slot(FileSystem* fs, uint8_t* at, CacheSlot* slot) {
+	Journal* journal = &fs->journal;
+	if(slot->log_zero) {
+		uint8_t* payload = journal_record(at, RECORD_ZERO, sizeof(uint32_t), journal->epoch);
+		write_u32(payload, slot->cluster);
+		at = payload + sizeof(uint32_t);
+	}
+	if(slot->log_from != slot->log_to) {
+		uint32_t bytes = slot->log_to - slot->log_from;
+		uint8_t* payload = journal_record(at, RECORD_META, 2 * sizeof(uint32_t) + bytes, journal->epoch);
+		write_u32(payload, slot->cluster);
+		write_u32(payload + sizeof(uint32_t), slot->log_from);
+		memcpy(payload + 2 * sizeof(uint32_t), slot->data + slot->log_from, bytes);
+		at = payload + 2 * sizeof(uint32_t) + bytes;
+	}
+	journal->logged[slot->cluster / MAP_WORD_BITS] |= (uint64_t) 1 << (slot->cluster % MAP_WORD_BITS);
+	return at;
+}
+
+// Writes the clusters held since their eviction home and lets go of them
+void journal_held_home(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	for(uint32_t i = 0; i != journal->held_count; i++) {
+		write_uncached(fs, journal->held[i].cluster, journal->held[i].data);
+		free(journal->held[i].data);
+	}
+	journal->held_count = 0;
+}
+
+// Without room in the journal the changes are written in place, like an
+// unjournaled sync. Only a transaction larger than the whole journal gets here.
+void journal_write_through(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	// Older records must not be replayed over what is written here later
+	journal_checkpoint(fs);
+	if(journal->tail != JOURNAL_HEADER) {
+		return; // The checkpoint failed, which is an I/O error already
+	}
+	journal_pages_home(fs, fs->fat_offset, journal->fat_log, fs->table_cache);
+	journal_pages_home(fs, fs->refs_offset, journal->refs_log, fs->refs);
+	for(uint32_t i = 0; i != fs->cache.slot_count; i++) {
+		CacheSlot* slot = &fs->cache.slots[i];
+		if(slot->valid && slot_logged(slot)) {
+			write_uncached(fs, slot->cluster, slot->data);
+			slot->dirty = 0;
+		}
+	}
+	journal_held_home(fs);
+	io_sync(fs, 0, UINT64_MAX);
+}
+
+// Appends everything changed since the last commit as one transaction and
+// makes it durable with a single sync. Clusters freed by the transaction
+// become reusable afterwards.
+Result journal_commit(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	if(journal->size == 0) {
+		return 0;
+	}
+	size_t needed = journal_pages_size(fs, journal->fat_log) + journal_pages_size(fs, journal->refs_log);
+	for(uint32_t i = 0; i != fs->cache.slot_count; i++) {
+		if(fs->cache.slots[i].valid) {
+			needed += journal_slot_size(&fs->cache.slots[i]);
+		}
+	}
+	for(uint32_t i = 0; i != journal->held_count; i++) {
+		needed += journal_slot_size(&journal->held[i]);
+	}
+	if(needed != 0) {
+		// File data goes first, so that committed metadata never points at
+		// clusters that did not make it to the disk
+		io_sync(fs, fs->data_offset, (uint64_t) fs->clusters_count * fs->cluster_size);
+		needed += RECORD_HEADER + sizeof(uint32_t);
+		if(journal->tail + needed > journal->size) {
+			journal_checkpoint(fs);
+		}
+		uint8_t* records = journal->tail + needed <= journal->size ? malloc(needed) : NULL;
+		if(records == NULL) {
+			journal_write_through(fs);
+		} else {
+			uint8_t* at = journal_pages(fs, records, RECORD_FAT, journal->fat_log, fs->table_cache);
+			at = journal_pages(fs, at, RECORD_REFS, journal->refs_log, fs->refs);
+			for(uint32_t i = 0; i != fs->cache.slot_count; i++) {
+				CacheSlot* slot = &fs->cache.slots[i];
+				if(slot->valid && slot_logged(slot)) {
+					at = journal_slot(fs, at, slot);
+				}
+			}
+			for(uint32_t i = 0; i != journal->held_count; i++) {
+				at = journal_slot(fs, at, &journal->held[i]);
+			}
+			uint8_t* payload = journal_record(at, RECORD_COMMIT, sizeof(uint32_t), journal->epoch);
+			write_u32(payload, checksum(records, at - records));
+			io_write(fs, journal->offset + journal->tail, records, needed);
+			io_sync(fs, journal->offset + journal->tail, needed);
+			journal->tail += needed;
+			free(records);
+			journal_held_home(fs);
+		}
+	}
+	memset(journal->fat_log, 0, (fs->clusters_count + FAT_PAGE - 1) / FAT_PAGE);
+	if(journal->refs_log != NULL) {
+		memset(journal->refs_log, 0, (fs->clusters_count + FAT_PAGE - 1) / FAT_PAGE);
+	}
+	journal->fat_pending = 0;
+	for(uint32_t i = 0; i != fs->cache.slot_count; i++) {
+		fs->cache.slots[i].log_zero = 0;
+		fs->cache.slots[i].log_from = fs->cache.slots[i].log_to = 0;
+	}
+	// Old records must not be replayed over a freed cluster once it holds new data
+	for(uint32_t i = 0; i != journal->freed_count; i++) {
+		ClusterLocation cluster = journal->freed[i];
+		if(journal->logged[cluster / MAP_WORD_BITS] >> (cluster % MAP_WORD_BITS) & 1) {
+			journal_checkpoint(fs);
+			break;
+		}
+	}
+	for(uint32_t i = 0; i != journal->freed_count; i++) {
+		mark_free(fs, journal->freed[i]);
+	}
+	journal->freed_count = 0;
+	journal->operations = 0;
+	journal->last_commit = time(NULL);
+	return fs_error(fs);
+}
+
+// Ends a metadata operation. Operations are committed in groups of
+// JOURNAL_GROUP, or once JOURNAL_INTERVAL has passed since the last commit.
+// Nothing is committed in the middle of an operation, so each one is atomic.
+// A group that has used up the FAT budget or holds evicted clusters ends early,
+// and so does one that has freed at least as many clusters as are free.
+void journal_operation(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	if(journal->size == 0) {
+		return;
+	}
+	if(++journal->operations >= JOURNAL_GROUP || time(NULL) - journal->last_commit >= JOURNAL_INTERVAL
+			|| journal->fat_pending >= journal->fat_budget || journal->held_count != 0
+			|| (journal->freed_count != 0 && journal->freed_count >= free_clusters(fs))) {
+		journal_commit(fs);
+	}
+}
+
+// Commits before an operation that needs more clusters than are free, if the
+// commit frees enough of them. Only between operations, under the exclusive lock.
+void journal_reclaim(FileSystem* fs, ClusterLocation needed) {
+	if(fs->journal.freed_count != 0 && free_clusters(fs) < needed) {
+		journal_commit(fs);
+	}
+}
+
+// Recovers the committed transactions left by an unclean shutdown
+Result journal_open(FileSystem* fs) {
+	Journal* journal = &fs->journal;
+	if(journal->size == 0) {
+		return 0;
+	}
+	journal->fat_log = calloc((fs->clusters_count + FAT_PAGE - 1) / FAT_PAGE, 1);
+	journal->logged = calloc((fs->clusters_count + MAP_WORD_BITS - 1) / MAP_WORD_BITS, sizeof(uint64_t));
+	if(fs->refs_offset != 0) {
+		journal->refs_log = calloc((fs->clusters_count + FAT_PAGE - 1) / FAT_PAGE, 1);
+	}
+	uint8_t* region = malloc(journal->size);
+	if(journal->fat_log == NULL || journal->logged == NULL || (fs->refs_offset != 0 && journal->refs_log == NULL) || region == NULL) {
+		free(region);
+		return 1;
+	}
+	io_read(fs, journal->offset, region, journal->size);
+	uint64_t epoch = 1;
+	if(memcmp(region + JOURNAL_MAGIC, JOURNAL_MAGIC_BYTES, sizeof(JOURNAL_MAGIC_BYTES)) == 0) {
+		epoch = read_u64(region + JOURNAL_EPOCH);
+		journal_replay(fs, region, journal->size, epoch);
+		io_sync(fs, 0, UINT64_MAX);
+		epoch++;
+	}
+	free(region);
+	journal_reset(fs, epoch);
+	journal->last_commit = time(NULL);
+	return fs_error(fs);
+}
+
+uint8_t is_free(FileSystem* fs, ClusterLocation cluster) {
+	return !(fs->free_map.used[cluster / MAP_WORD_BITS] >> (cluster % MAP_WORD_BITS) & 1);
+}
+
+// Number of consecutive free clusters starting at `cluster`, at most `limit`
+uint32_t run_length(FileSystem* fs, ClusterLocation cluster, uint32_t limit) {
+	uint32_t ret = 0;
+	while(ret < limit && cluster < fs->clusters_count) {
+		uint64_t used = fs->free_map.used[cluster / MAP_WORD_BITS] >> (cluster % MAP_WORD_BITS);
+		uint32_t in_word = MAP_WORD_BITS - cluster % MAP_WORD_BITS;
+		uint32_t free_bits = used ? min(lowest_bit(used), in_word) : in_word;
+		ret += free_bits;
+		if(free_bits != in_word) {
+			break;
+		}
+		cluster += free_bits;
+	}
+	return min(ret, limit);
+}
+
+// Finds `wanted` consecutive free clusters, or the longest run there is
+ClusterLocation find_free_run(FileSystem* fs, ClusterLocation from, uint32_t wanted, uint32_t* length) {
+	ClusterLocation best = TV_CANT_ALLOC;
+	uint32_t best_length = 0;
+	ClusterLocation cluster = find_free(fs, from);
+	size_t travelled = 0;
+	while(cluster != TV_CANT_ALLOC) {
+		size_t distance = ((uint64_t) cluster + fs->clusters_count - from) % fs->clusters_count;
+		// Back at a cluster that was already looked at, after wrapping around
+		if(distance < travelled || (distance == travelled && best != TV_CANT_ALLOC)) {
+			break;
+		}
+		travelled = distance;
+		uint32_t found = run_length(fs, cluster, wanted);
+		if(found > best_length) {
+			best = cluster;
+			best_length = found;
+			if(found == wanted) {
+				break;
+			}
+		}
+		// Runs end at the end of the volume, the search goes on from the start
+		cluster = find_free(fs, (uint64_t) cluster + found < fs->clusters_count ? cluster + found : 1);
+	}
+	*length = best_length;
+	return best;
+}
+
+void reserve_run(FileSystem* fs, FileIO* file, ClusterLocation start, uint32_t count) {
+	file->reserved = start;
+	file->reserved_count = count;
+	for(uint32_t i = 0; i != count; i++) {
+		mark_used(fs, start + i);
+	}
+}
+
+void release_reservation(FileSystem* fs, FileIO* file) {
+	for(uint32_t i = 0; i != file->reserved_count; i++) {
+		mark_free(fs, file->reserved + i);
+	}
+	file->reserved_count = 0;
+}
+
+// Reserves up to `count` clusters for the chain ending at `tail`, preferring
+// the ones right after it so that the chain stays physically sequential.
+void reserve_after(FileSystem* fs, FileIO* file, ClusterLocation tail, uint32_t count) {
+	release_reservation(fs, file);
+	if(count == 0) {
+		return;
+	}
+	uint32_t length = tail + 1 < fs->clusters_count ? run_length(fs, tail + 1, count) : 0;
+	if(length != 0) {
+		reserve_run(fs, file, tail + 1, length);
+		return;
+	}
+	ClusterLocation start = find_free_run(fs, fs->free_map.hint, count, &length);
+	if(start != TV_CANT_ALLOC) {
+		reserve_run(fs, file, start, length);
+	}
+}
+
+ClusterLocation allocate_for(FileSystem* fs, FileIO* file, ClusterLocation tail) {
+	if(file->reserved_count == 0 || file->reserved != tail + 1) {
+		reserve_after(fs, file, tail, max(file->reserve_window, file->reserve_expected));
+		file->reserve_window = min(file->reserve_window * 2, RESERVE_WINDOW_MAX);
+	}
+	if(file->reserved_count == 0) {
+		return TV_CANT_ALLOC;
+	}
+	ClusterLocation ret = file->reserved++;
+	file->reserved_count--;
+	if(file->reserve_expected != 0) {
+		file->reserve_expected--;
+	}
+	set_next(fs, ret, TV_FINAL);
+	stat_add(&fs->stats.allocations, 1);
+	return ret;
+}
+
+Result extend(FileSystem* fs, ClusterLocation* cursor) {
+	assert(fs->table_cache[*cursor] == TV_FINAL);
+
+	ClusterLocation nc = allocate(fs);
+	if(nc == TV_CANT_ALLOC) {
+		return 1;
+	}
+	set_next(fs, *cursor, nc);
+	*cursor = nc;
+	return 0;
+}
+
+// Remembers `cluster` as the chain's `ordinal`-th one if it continues the known prefix
+void chain_note(FileIO* file, uint32_t ordinal, ClusterLocation cluster) {
+	if(ordinal != file->chain_length) {
+		return;
+	}
+	if(file->chain_length == file->chain_capacity) {
+		uint32_t capacity = file->chain_capacity ? file->chain_capacity * 2 : CHAIN_INITIAL;
+		ClusterLocation* chain = realloc(file->chain, capacity * sizeof(ClusterLocation));
+		if(chain == NULL) {
+			return;
+		}
+		file->chain = chain;
+		file->chain_capacity = capacity;
+	}
+	file->chain[file->chain_length++] = cluster;
+}
+
+ClusterLocation chain_lookup(FileSystem* fs, FileIO* file, uint32_t ordinal) {
+	if(ordinal < file->chain_length) {
+		return file->chain[ordinal];
+	}
+	if(ordinal == file->clusters - 1) {
+		return file->last;
+	}
+	uint32_t i = 0;
+	ClusterLocation cluster = file->first;
+	if(file->chain_length == 0) {
+		chain_note(file, 0, cluster);
+	} else {
+		i = file->chain_length - 1;
+		cluster = file->chain[i];
+	}
+	stat_add(&fs->stats.fat_hops, ordinal - i);
+	while(i != ordinal) {
+		cluster = fs->table_cache[cluster];
+		if(cluster == TV_FINAL) {
+			return TV_FINAL;
+		}
+		chain_note(file, ++i, cluster);
+	}
+	return cluster;
+}
+
+Result extend_file(FileSystem* fs, FileIO* file, ClusterLocation* cursor) {
+	assert(fs->table_cache[*cursor] == TV_FINAL);
+
+	ClusterLocation nc = allocate_for(fs, file, *cursor);
+	if(nc == TV_CANT_ALLOC) {
+		return 1;
+	}
+	set_next(fs, *cursor, nc);
+	*cursor = nc;
+	chain_note(file, file->clusters, nc);
+	file->last = nc;
+	file->clusters++;
+	return 0;
+}
+
+// Clusters in the chain and the number of physically contiguous runs they form
+void chain_extents(FileSystem* fs, ClusterLocation first, uint32_t* clusters, uint32_t* extents) {
+	*clusters = 1;
+	*extents = 1;
+	for(ClusterLocation c = first; fs->table_cache[c] != TV_FINAL; c = fs->table_cache[c]) {
+		if(fs->table_cache[c] != c + 1) {
+			(*extents)++;
+		}
+		(*clusters)++;
+	}
+}
+
+// Ordinal of the first cluster of the file that another chain links to as
+// well, or the cluster count if the whole chain is the file's own. Clusters
+// the file grows by are its own, so the answer stays valid while it grows.
+uint32_t shared_from(FileSystem* fs, FileIO* file) {
+	if(fs->join_points == 0) {
+		return file->clusters;
+	}
+	if(file->shared_epoch != fs->sharing) {
+		file->shared = UINT32_MAX;
+		for(uint32_t i = 1; i < file->clusters; i++) {
+			if(fs->refs[chain_lookup(fs, file, i)] > 1) {
+				file->shared = i;
+				break;
+			}
+		}
+		file->shared_epoch = fs->sharing;
+	}
+	return min(file->shared, file->clusters);
+}
+
+// Gives the file copies of its shared clusters up to `ordinal`, leaving the
+// ones after it shared. Called with the exclusive lock held.
+Result unshare_chain(FileSystem* fs, FileIO* file, uint32_t ordinal) {
+	uint32_t from = shared_from(fs, file);
+	if(ordinal < from) {
+		return 0;
+	}
+	uint8_t* buffer = malloc(fs->cluster_size);
+	if(buffer == NULL) {
+		return 1;
+	}
+	ClusterLocation previous = chain_lookup(fs, file, from - 1);
+	for(uint32_t i = from; i <= ordinal; i++) {
+		ClusterLocation original = chain_lookup(fs, file, i);
+		ClusterLocation copy = allocate(fs);
+		if(copy == TV_CANT_ALLOC) {
+			free(buffer);
+			return 1;
+		}
+		cache_writeback(fs, original);
+		io_read(fs, cluster_offset(fs, original), buffer, fs->cluster_size);
+		cache_drop(fs, copy);
+		io_write(fs, cluster_offset(fs, copy), buffer, fs->cluster_size);
+		stat_add(&fs->stats.clusters_read, 1);
+		stat_add(&fs->stats.clusters_written, 1);
+		set_next(fs, copy, fs->table_cache[original]);
+		set_next(fs, previous, copy);
+		if(fs->refs[original] == 0) { // The other chain has let go of it since it was counted
+			release(fs, original);
+		}
+		if(i < file->chain_length) {
+			file->chain[i] = copy;
+		}
+		if(file->position == i) {
+			file->current = copy;
+		}
+		if(i == file->clusters - 1) {
+			file->last = copy;
+		}
+		previous = copy;
+	}
+	free(buffer);
+	file->shared = ordinal + 1 == file->clusters ? UINT32_MAX : ordinal + 1;
+	file->shared_epoch = fs->sharing;
+	return fs_error(fs);
+}
+
+// Makes sure that writing up to `end` bytes, or growing the chain, only
+// touches clusters of the file's own. Returns OPTIONAL_OK with the shared lock
+// held, so that nothing can share them again before the write is done.
+OptionalResult prepare_write(FileSystem* fs, FileIO* file, FileCursor end) {
+	uint32_t ordinal = min(end / fs->cluster_size, file->clusters - 1);
+	while(1) {
+		fs_lock_shared(fs);
+		if(shared_from(fs, file) > ordinal) {
+			return OPTIONAL_OK;
+		}
+		fs_unlock(fs);
+		fs_lock_exclusive(fs);
+		Result failed = unshare_chain(fs, file, ordinal);
+		fs_unlock(fs);
+		if(failed) {
+			return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_STRUCTURE_ERROR;
+		}
+	}
+}
+
+uint8_t chain_shared(FileSystem* fs, ClusterLocation first) {
+	if(fs->join_points == 0) {
+		return 0;
+	}
+	for(ClusterLocation c = fs->table_cache[first]; c != TV_FINAL; c = fs->table_cache[c]) {
+		if(fs->refs[c] > 1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void count_extents(FileSystem* fs, ClusterLocation first, uint32_t* clusters, uint32_t* extents) {
+	fs_lock_shared(fs);
+	chain_extents(fs, first, clusters, extents);
+	fs_unlock(fs);
+}
+
+ClusterLocation chain_at(FileSystem* fs, ClusterLocation cluster, size_t hops) {
+	stat_add(&fs->stats.fat_hops, hops);
+	while(hops--) {
+		cluster = fs->table_cache[cluster];
+	}
+	return cluster;
+}
+
+// Releases the chain from `current` up to the first cluster that another
+// chain still links to
+void free_chain(FileSystem* fs, ClusterLocation current) {
+	while(current != TV_EMPTY && current < fs->clusters_count && fs->refs[current] == 0) {
+		ClusterLocation next = fs->table_cache[current];
+		release(fs, current);
+		current = next;
+	}
+}
+
+uint32_t name_hash(uint8_t* name) {
+	uint32_t ret = 2166136261u;
+	for(size_t i = 0; i != FILE_NAME_BUFFER && name[i]; i++) {
+		ret = (ret ^ name[i]) * 16777619u;
+	}
+	return ret;
+}
+
+// Indexed directories keep a header entry in their first slot. It points at
+// a linear-probing hash table of (name hash >> 16, ordinal) slots that lives
+// in its own cluster chain. Directories without the header are scanned.
+uint8_t load_index(FileSystem* fs, ClusterLocation directory, DirIndex* index) {
+	uint8_t header[FILE_META];
+	cache_read(fs, directory, 0, header, FILE_META);
+	if(read_u16(header + OFFSET_SIZE) != FS_INDEX || header[OFFSET_NAME] != INDEX_MARKER) {
+		return 0;
+	}
+	index->directory = directory;
+	// Legacy images only have room for a 16-bit cluster
+	index->first = fs->address_width == sizeof(uint16_t) ? read_u16(header + OFFSET_CLUSTER) : read_u32(header + OFFSET_INDEX_FIRST);
+	index->count = read_u16(header + OFFSET_INDEX_COUNT);
+	index->clusters = read_u16(header + OFFSET_INDEX_CLUSTERS);
+	return 1;
+}
+
+void store_index(FileSystem* fs, DirIndex* index) {
+	CacheSlot* slot = cache_get(fs, index->directory, 1);
+	write_u16(slot->data + OFFSET_SIZE, FS_INDEX);
+	write_u16(slot->data + OFFSET_CLUSTER, index->first);
+	slot->data[OFFSET_NAME] = INDEX_MARKER;
+	write_u16(slot->data + OFFSET_INDEX_COUNT, index->count);
+	write_u16(slot->data + OFFSET_INDEX_CLUSTERS, index->clusters);
+	write_u32(slot->data + OFFSET_INDEX_FIRST, index->first);
+	cache_mark(fs, slot, 0, FILE_META);
+}
+
+uint32_t index_slots(FileSystem* fs, DirIndex* index) {
+	return (uint32_t) index->clusters * fs->slots_per_cluster;
+}
+
+uint32_t index_home(FileSystem* fs, DirIndex* index, uint16_t tag) {
+	return (uint32_t) (((uint64_t) tag * index_slots(fs, index)) >> 16);
+}
+
+uint32_t index_get(FileSystem* fs, DirIndex* index, uint32_t position) {
+	ClusterLocation cluster = chain_at(fs, index->first, position / fs->slots_per_cluster);
+	uint8_t value[INDEX_SLOT];
+	cache_read(fs, cluster, position % fs->slots_per_cluster * INDEX_SLOT, value, INDEX_SLOT);
+	return read_u32(value);
+}
+
+void index_set(FileSystem* fs, DirIndex* index, uint32_t position, uint32_t value) {
+	ClusterLocation cluster = chain_at(fs, index->first, position / fs->slots_per_cluster);
+	CacheSlot* slot = cache_get(fs, cluster, 1);
+	write_u32(slot->data + position % fs->slots_per_cluster * INDEX_SLOT, value);
+	cache_mark(fs, slot, position % fs->slots_per_cluster * INDEX_SLOT, INDEX_SLOT);
+}
+
+void entry_location(FileSystem* fs, DirIndex* index, uint16_t ordinal, DirEntry* entry) {
+	entry->directory = index->directory;
+	entry->current_cluster = chain_at(fs, index->directory, ordinal / fs->files_per_cluster);
+	entry->current_offset = ordinal % fs->files_per_cluster * FILE_META;
+}
+
+void index_insert(FileSystem* fs, DirIndex* index, uint32_t hash, uint16_t ordinal) {
+	uint16_t tag = hash >> 16;
+	uint32_t position = index_home(fs, index, tag);
+	while(index_get(fs, index, position) != 0) {
+		position = (position + 1) % index_slots(fs, index);
+	}
+	index_set(fs, index, position, (uint32_t) tag << 16 | ordinal);
+}
+
+uint32_t index_find_slot(FileSystem* fs, DirIndex* index, uint32_t hash, uint16_t ordinal) {
+	uint32_t wanted = (hash >> 16) << 16 | ordinal;
+	uint32_t position = index_home(fs, index, hash >> 16);
+	while(index_get(fs, index, position) != wanted) {
+		position = (position + 1) % index_slots(fs, index);
+	}
+	return position;
+}
+
+// Backward-shift deletion, so that no tombstones are needed
+void index_remove(FileSystem* fs, DirIndex* index, uint32_t hash, uint16_t ordinal) {
+	uint32_t total = index_slots(fs, index);
+	uint32_t hole = index_find_slot(fs, index, hash, ordinal);
+	uint32_t position = hole;
+	while(1) {
+		position = (position + 1) % total;
+		uint32_t value = index_get(fs, index, position);
+		if(value == 0) {
+			break;
+		}
+		uint32_t home = index_home(fs, index, value >> 16);
+		uint8_t movable = hole <= position ? (home <= hole || home > position) : (home <= hole && home > position);
+		if(movable) {
+			index_set(fs, index, hole, value);
+			hole = position;
+		}
+	}
+	index_set(fs, index, hole, 0);
+}
+
+OptionalResult index_lookup(FileSystem* fs, DirIndex* index, uint8_t* target, DirEntry* result) {
+	uint32_t hash = name_hash(target);
+	uint16_t tag = hash >> 16;
+	uint32_t position = index_home(fs, index, tag);
+	while(1) {
+		uint32_t value = index_get(fs, index, position);
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		if(value == 0) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		if(value >> 16 == tag) {
+			stat_add(&fs->stats.entries_compared, 1);
+			entry_location(fs, index, value & 0xFFFF, result);
+			cache_read(fs, result->current_cluster, result->current_offset, result->meta, FILE_META);
+			if(name_equals(result->meta, target)) {
+				return OPTIONAL_OK;
+			}
+		}
+		position = (position + 1) % index_slots(fs, index);
+	}
+}
+
+// Clears the hash table and inserts the entries again
+void index_rebuild(FileSystem* fs, DirIndex* index) {
+	for(ClusterLocation c = index->first; ; c = fs->table_cache[c]) {
+		zero_cluster(fs, c);
+		if(fs->table_cache[c] == TV_FINAL) {
+			break;
+		}
+	}
+	DirEntry entry;
+	for(uint16_t ordinal = 1; ordinal != index->count; ordinal++) {
+		entry_location(fs, index, ordinal, &entry);
+		uint8_t* meta = cache_get(fs, entry.current_cluster, 1)->data + entry.current_offset;
+		index_insert(fs, index, name_hash(meta+OFFSET_NAME), ordinal);
+	}
+	store_index(fs, index);
+}
+
+// Grows the hash table when one more entry would take it past 3/4 load
+Result index_reserve(FileSystem* fs, DirIndex* index) {
+	if((uint32_t) (index->count + 1) * 4 <= index_slots(fs, index) * 3) {
+		return 0;
+	}
+	if(index->clusters * 2 > INDEX_MAX_CLUSTERS) {
+		return (uint32_t) index->count + 1 >= index_slots(fs, index);
+	}
+	ClusterLocation last = chain_at(fs, index->first, index->clusters - 1);
+	ClusterLocation tail = last;
+	for(uint16_t i = index->clusters; i != index->clusters * 2; i++) {
+		if(extend(fs, &tail)) {
+			// The table keeps its size, so the clusters added so far go back
+			ClusterLocation added = fs->table_cache[last];
+			if(added != TV_FINAL) {
+				set_next(fs, last, TV_FINAL);
+				free_chain(fs, added);
+			}
+			return (uint32_t) index->count + 1 >= index_slots(fs, index);
+		}
+	}
+	index->clusters *= 2;
+	index_rebuild(fs, index);
+	return fs_error(fs);
+}
+
+// Writes the first cluster of a new directory, with an index if there is space for one
+void init_directory(FileSystem* fs, ClusterLocation directory) {
+	ClusterLocation first = allocate(fs);
+	zero_cluster(fs, directory);
+	if(first != TV_CANT_ALLOC) {
+		zero_cluster(fs, first);
+		DirIndex index = { directory, first, 1, 1 };
+		store_index(fs, &index);
+	}
+}
+
+// A bound of 0 disables the cache
+Result dentry_init(FileSystem* fs, size_t bytes) {
+	DentryCache* cache = &fs->dentries;
+	memset(cache, 0, sizeof(DentryCache));
+	cache->slot_count = min(bytes / sizeof(Dentry), UINT32_MAX / 4);
+	if(cache->slot_count == 0) {
+		return 0;
+	}
+	uint32_t buckets = 1;
+	while(buckets < cache->slot_count * 2) {
+		buckets *= 2;
+	}
+	cache->mask = buckets - 1;
+	cache->slots = calloc(cache->slot_count, sizeof(Dentry));
+	cache->buckets = calloc(buckets, sizeof(uint32_t));
+	if(cache->slots == NULL || cache->buckets == NULL) {
+		free(cache->slots);
+		free(cache->buckets);
+		memset(cache, 0, sizeof(DentryCache));
+		return 1;
+	}
+	return 0;
+}
+
+void dentry_free(FileSystem* fs) {
+	free(fs->dentries.slots);
+	free(fs->dentries.buckets);
+}
+
+// Link that holds the slot of the name, or the CACHE_EMPTY ending its bucket
+uint32_t* dentry_link(DentryCache* cache, ClusterLocation directory, uint8_t* name) {
+	uint32_t* link = &cache->buckets[(directory * 2654435761u ^ name_hash(name)) & cache->mask];
+	while(*link != CACHE_EMPTY) {
+		Dentry* slot = &cache->slots[*link-1];
+		if(slot->entry.directory == directory && name_equals(slot->entry.meta, name)) {
+			break;
+		}
+		link = &slot->next;
+	}
+	return link;
+}
+
+void dentry_forget(FileSystem* fs, ClusterLocation directory, uint8_t* name) {
+	DentryCache* cache = &fs->dentries;
+	if(cache->slot_count == 0) {
+		return;
+	}
+	uint32_t* link = dentry_link(cache, directory, name);
+	if(*link != CACHE_EMPTY) {
+		Dentry* slot = &cache->slots[*link-1];
+		*link = slot->next;
+		slot->valid = 0;
+		cache->used--;
+	}
+}
+
+// For a deleted directory, whose first cluster may become another one
+void dentry_forget_directory(FileSystem* fs, ClusterLocation directory) {
+	DentryCache* cache = &fs->dentries;
+	for(uint32_t i = 0; i != cache->slot_count && cache->used != 0; i++) {
+		Dentry* slot = &cache->slots[i];
+		if(slot->valid && slot->entry.directory == directory) {
+			dentry_forget(fs, directory, get_file_name(&slot->entry));
+		}
+	}
+}
+
+void dentry_clear(FileSystem* fs) {
+	DentryCache* cache = &fs->dentries;
+	if(cache->slot_count == 0) {
+		return;
+	}
+	memset(cache->slots, 0, (size_t) cache->slot_count * sizeof(Dentry));
+	memset(cache->buckets, 0, ((size_t) cache->mask + 1) * sizeof(uint32_t));
+	cache->used = 0;
+}
+
+Result resize_dentry_cache(FileSystem* fs, size_t bytes) {
+	fs_lock_exclusive(fs);
+	dentry_free(fs);
+	Result ret = dentry_init(fs, bytes);
+	fs_unlock(fs);
+	return ret;
+}
+
+// Returns 1 if the outcome of the lookup is known, leaving it in `found`
+uint8_t dentry_get(FileSystem* fs, ClusterLocation directory, uint8_t* name, DirEntry* result, OptionalResult* found) {
+	DentryCache* cache = &fs->dentries;
+	if(cache->slot_count == 0) {
+		return 0;
+	}
+	uint32_t index = *dentry_link(cache, directory, name);
+	if(index == CACHE_EMPTY) {
+		cache->misses++;
+		return 0;
+	}
+	Dentry* slot = &cache->slots[index-1];
+	slot->referenced = 1;
+	cache->hits++;
+	if(slot->negative) {
+		*found = OPTIONAL_STRUCTURE_ERROR;
+	} else {
+		*result = slot->entry;
+		*found = OPTIONAL_OK;
+	}
+	return 1;
+}
+
+// Remembers the entry, or that the name is missing if `entry` is NULL
+void dentry_put(FileSystem* fs, ClusterLocation directory, uint8_t* name, DirEntry* entry) {
+	DentryCache* cache = &fs->dentries;
+	if(cache->slot_count == 0 || *dentry_link(cache, directory, name) != CACHE_EMPTY) {
+		return;
+	}
+	Dentry* slot;
+	while(1) {
+		slot = &cache->slots[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->slot_count;
+		if(!slot->valid) {
+			break;
+		}
+		if(slot->referenced) {
+			slot->referenced = 0;
+			continue;
+		}
+		dentry_forget(fs, slot->entry.directory, get_file_name(&slot->entry));
+		break;
+	}
+	if(entry == NULL) {
+		memset(&slot->entry, 0, sizeof(DirEntry));
+		strncpy(get_file_name(&slot->entry), name, FILE_NAME_BUFFER - 1);
+		slot->entry.directory = directory;
+	} else {
+		slot->entry = *entry;
+	}
+	uint32_t* link = dentry_link(cache, directory, name);
+	slot->next = *link;
+	slot->valid = 1;
+	slot->negative = entry == NULL;
+	slot->referenced = 1;
+	*link = slot - cache->slots + 1;
+	cache->used++;
+}
+
+uint64_t host_file_length(FILE* file) {
+	fseek64(file, 0, SEEK_END);
+	int64_t ret = ftell64(file);
+	return ret < 0 ? 0 : ret;
+}
+
+void set_geometry(FileSystem* fs, uint32_t cluster_size, ClusterLocation clusters_count, uint8_t address_width, uint64_t fat_offset, uint64_t data_offset) {
+	fs->cluster_size = cluster_size;
+	fs->clusters_count = clusters_count;
+	fs->address_width = address_width;
+	fs->fat_offset = fat_offset;
+	fs->refs_offset = 0;
+	fs->data_offset = data_offset;
+	fs->files_per_cluster = cluster_size / FILE_META;
+	fs->slots_per_cluster = cluster_size / INDEX_SLOT;
+	memset(&fs->journal, 0, sizeof(Journal));
+}
+
+void set_journal(FileSystem* fs, uint64_t offset, uint32_t size) {
+	fs->journal.offset = offset;
+	fs->journal.size = size;
+	// FAT pages that may pile up before a commit, leaving room for the rest
+	fs->journal.fat_budget = (size - JOURNAL_HEADER - JOURNAL_META_RESERVE) / FAT_RECORD;
+}
+
+// Enough for every FAT page and its link counts to change in one
+// transaction, within limits
+uint64_t journal_size_for(uint64_t clusters) {
+	uint64_t size = JOURNAL_HEADER + 2 * ((clusters + FAT_PAGE - 1) / FAT_PAGE) * FAT_RECORD + JOURNAL_META_RESERVE;
+	size = (size + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+	return min(max(size, JOURNAL_MIN), JOURNAL_MAX);
+}
+
+uint8_t valid_cluster_size(uint64_t cluster_size) {
+	return cluster_size >= MIN_CLUSTER_SIZE && cluster_size <= MAX_CLUSTER_SIZE && (cluster_size & (cluster_size - 1)) == 0;
+}
+
+// Lays out an image of `size` bytes: superblock, 32-bit FAT, link counts,
+// journal, then the clusters starting at a multiple of the cluster size.
+Result plan_geometry(FileSystem* fs, uint64_t size, uint64_t cluster_size) {
+	if(!valid_cluster_size(cluster_size) || size <= SUPERBLOCK_SIZE) {
+		return 1;
+	}
+	uint64_t per_cluster = cluster_size + 2 * sizeof(ClusterLocation);
+	uint64_t clusters = min((size - SUPERBLOCK_SIZE) / per_cluster, MAX_VOLUME_CLUSTERS);
+	uint64_t journal_size = journal_size_for(clusters);
+	if(size <= SUPERBLOCK_SIZE + journal_size) {
+		return 1;
+	}
+	clusters = min((size - SUPERBLOCK_SIZE - journal_size) / per_cluster, clusters);
+	uint64_t refs_offset = SUPERBLOCK_SIZE + clusters * sizeof(ClusterLocation);
+	uint64_t journal_offset = (refs_offset + clusters * sizeof(ClusterLocation) + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+	uint64_t data_offset = (journal_offset + journal_size + cluster_size - 1) / cluster_size * cluster_size;
+	if(data_offset + clusters * cluster_size > size) {
+		clusters = data_offset < size ? (size - data_offset) / cluster_size : 0;
+	}
+	if(clusters < 2) { // Root directory and its index
+		return 1;
+	}
+	set_geometry(fs, cluster_size, clusters, sizeof(ClusterLocation), SUPERBLOCK_SIZE, data_offset);
+	set_journal(fs, journal_offset, journal_size);
+	fs->refs_offset = refs_offset;
+	return 0;
+}
+
+void write_superblock(FileSystem* fs, uint8_t* superblock) {
+	memset(superblock, 0, SUPERBLOCK_SIZE);
+	memcpy(superblock + SB_MAGIC, SUPERBLOCK_MAGIC, sizeof(SUPERBLOCK_MAGIC));
+	write_u32(superblock + SB_VERSION, SUPERBLOCK_VERSION);
+	write_u32(superblock + SB_CLUSTER_SIZE, fs->cluster_size);
+	write_u32(superblock + SB_CLUSTERS, fs->clusters_count);
+	write_u32(superblock + SB_ADDRESS_WIDTH, fs->address_width);
+	write_u64(superblock + SB_FAT_OFFSET, fs->fat_offset);
+	write_u64(superblock + SB_DATA_OFFSET, fs->data_offset);
+	write_u64(superblock + SB_JOURNAL_OFFSET, fs->journal.offset);
+	write_u32(superblock + SB_JOURNAL_SIZE, fs->journal.size);
+	write_u64(superblock + SB_REFS_OFFSET, fs->refs_offset);
+}
+
+Result read_superblock(FileSystem* fs, uint8_t* superblock, uint64_t file_length) {
+	uint32_t cluster_size = read_u32(superblock + SB_CLUSTER_SIZE);
+	ClusterLocation clusters_count = read_u32(superblock + SB_CLUSTERS);
+	uint64_t fat_offset = read_u64(superblock + SB_FAT_OFFSET);
+	uint64_t data_offset = read_u64(superblock + SB_DATA_OFFSET);
+	uint64_t journal_offset = read_u64(superblock + SB_JOURNAL_OFFSET);
+	uint32_t journal_size = read_u32(superblock + SB_JOURNAL_SIZE);
+	uint64_t refs_offset = read_u64(superblock + SB_REFS_OFFSET);
+	if(read_u32(superblock + SB_VERSION) != SUPERBLOCK_VERSION
+			|| read_u32(superblock + SB_ADDRESS_WIDTH) != sizeof(ClusterLocation)
+			|| !valid_cluster_size(cluster_size)
+			|| clusters_count < 2 || clusters_count > MAX_VOLUME_CLUSTERS
+			|| fat_offset < SUPERBLOCK_SIZE || fat_offset % sizeof(ClusterLocation) != 0
+			|| fat_offset + (uint64_t) clusters_count * sizeof(ClusterLocation) > data_offset
+			|| data_offset + (uint64_t) clusters_count * cluster_size > file_length) {
+		return 1;
+	}
+	// Images made before the journal have zeroes here
+	if(journal_size != 0 && (journal_size < JOURNAL_MIN || journal_size > JOURNAL_MAX
+			|| journal_offset < fat_offset + (uint64_t) clusters_count * sizeof(ClusterLocation)
+			|| journal_offset + journal_size > data_offset)) {
+		return 1;
+	}
+	// And before the link counts. The table is only written through the journal.
+	if(refs_offset != 0 && (journal_size == 0 || refs_offset % sizeof(ClusterLocation) != 0
+			|| refs_offset < fat_offset + (uint64_t) clusters_count * sizeof(ClusterLocation)
+			|| refs_offset + (uint64_t) clusters_count * sizeof(ClusterLocation) > journal_offset)) {
+		return 1;
+	}
+	set_geometry(fs, cluster_size, clusters_count, sizeof(ClusterLocation), fat_offset, data_offset);
+	if(journal_size != 0) {
+		set_journal(fs, journal_offset, journal_size);
+	}
+	fs->refs_offset = refs_offset;
+	return 0;
+}
+
+uint8_t table_in_map(FileSystem* fs) {
+	return fs->map != NULL && (uint8_t*) fs->table_cache == fs->map + fs->fat_offset;
+}
+
+// Legacy images store 16-bit entries with LEGACY_FINAL as the end of a chain
+void load_table(FileSystem* fs) {
+	if(table_in_map(fs)) {
+		return;
+	}
+	if(fs->address_width == sizeof(ClusterLocation)) {
+		io_read(fs, fs->fat_offset, (uint8_t*) fs->table_cache, (size_t) fs->clusters_count * sizeof(ClusterLocation));
+		return;
+	}
+	uint8_t buffer[IO_BUFFER];
+	for(ClusterLocation i = 0; i < fs->clusters_count; i += IO_BUFFER / sizeof(uint16_t)) {
+		ClusterLocation count = min(fs->clusters_count - i, IO_BUFFER / sizeof(uint16_t));
+		io_read(fs, fs->fat_offset + i * sizeof(uint16_t), buffer, count * sizeof(uint16_t));
+		for(ClusterLocation j = 0; j != count; j++) {
+			uint16_t value = read_u16(buffer + j * sizeof(uint16_t));
+			fs->table_cache[i + j] = value == LEGACY_FINAL ? TV_FINAL : value;
+		}
+	}
+}
+
+void store_table(FileSystem* fs) {
+	if(table_in_map(fs)) {
+		return;
+	}
+	if(fs->address_width == sizeof(ClusterLocation)) {
+		io_write(fs, fs->fat_offset, (uint8_t*) fs->table_cache, (size_t) fs->clusters_count * sizeof(ClusterLocation));
+		return;
+	}
+	uint8_t buffer[IO_BUFFER];
+	for(ClusterLocation i = 0; i < fs->clusters_count; i += IO_BUFFER / sizeof(uint16_t)) {
+		ClusterLocation count = min(fs->clusters_count - i, IO_BUFFER / sizeof(uint16_t));
+		for(ClusterLocation j = 0; j != count; j++) {
+			ClusterLocation value = fs->table_cache[i + j];
+			write_u16(buffer + j * sizeof(uint16_t), value == TV_FINAL ? LEGACY_FINAL : value);
+		}
+		io_write(fs, fs->fat_offset + i * sizeof(uint16_t), buffer, count * sizeof(uint16_t));
+	}
+}
+
+// Switches a freshly opened image over to the chosen backend
+Result attach_backend(FileSystem* fs, uint8_t backend) {
+	fs->backend = BACKEND_STDIO;
+	fs->io_error = 0;
+	fs->map = NULL;
+	fs->refs = NULL;
+	memset(&fs->dedup, 0, sizeof(DedupIndex));
+	fflush(fs->file); // Later I/O bypasses the stream buffer
+	if(backend == BACKEND_MMAP) {
+#ifdef FS_MMAP
+		uint64_t file_length = host_file_length(fs->file);
+		if(file_length > SIZE_MAX) {
+			return 1;
+		}
+		void* map = mmap(NULL, file_length, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fs->file), 0);
+		if(map == MAP_FAILED) {
+			return 1;
+		}
+		fs->backend = BACKEND_MMAP;
+		fs->map = map;
+		fs->map_size = file_length;
+		if(fs->address_width == sizeof(ClusterLocation) && fs->journal.size == 0) {
+			fs->table_cache = (ClusterLocation*) (fs->map + fs->fat_offset);
+			return 0;
+		}
+#else
+		return 1;
+#endif
+	}
+#ifdef FS_URING
+	// Without io_uring the volume keeps BACKEND_STDIO, which does the same synchronously
+	if(backend == BACKEND_URING && uring_open(&fs->uring) == 0) {
+		fs->backend = BACKEND_URING;
+	}
+#endif
+	fs->table_cache = malloc((size_t) fs->clusters_count * sizeof(ClusterLocation));
+	return fs->table_cache == NULL;
+}
+
+Result init_fs_file(FileSystem* fs, char* path, uint64_t size, uint64_t cluster_size, uint8_t backend) {
+	if(plan_geometry(fs, size, cluster_size)) {
+		return 1;
+	}
+
+	fs->file = fopen(path, "wb+");
+	memset(&fs->stats, 0, sizeof(Stats));
+
+	if(fs->file == NULL || cache_init(fs) || dentry_init(fs, DENTRY_CACHE_BYTES) || locks_init(fs)) {
+		return 1;
+	}
+
+	uint8_t superblock[SUPERBLOCK_SIZE];
+	write_superblock(fs, superblock);
+	fwrite(superblock, 1, SUPERBLOCK_SIZE, fs->file);
+
+	// The FAT and the clusters are left as a hole
+	fseek64(fs->file, cluster_offset(fs, fs->clusters_count) - 1, SEEK_SET);
+	fputc(0, fs->file);
+
+	if(ferror(fs->file) || attach_backend(fs, backend) || journal_open(fs)) {
+		return 1;
+	}
+
+	memset(fs->table_cache, 0, (size_t) fs->clusters_count * sizeof(ClusterLocation));
+	set_next(fs, 0, TV_FINAL);
+
+	if(free_map_build(fs) || refs_build(fs)) {
+		return 1;
+	}
+	init_directory(fs, 0);
+	journal_commit(fs);
+
+	return fs_error(fs);
+}
+
+Result open_fs_file(FileSystem* fs, char* path, uint8_t backend) {
+	fs->file = fopen(path, "rb+");
+	memset(&fs->stats, 0, sizeof(Stats));
+
+	if(fs->file == NULL) {
+		return 1;
+	}
+
+	uint64_t file_length = host_file_length(fs->file);
+	uint8_t superblock[SB_HEADER];
+	fseek64(fs->file, 0, SEEK_SET);
+	if(file_length >= SUPERBLOCK_SIZE && fread(superblock, 1, SB_HEADER, fs->file) == SB_HEADER
+			&& memcmp(superblock + SB_MAGIC, SUPERBLOCK_MAGIC, sizeof(SUPERBLOCK_MAGIC)) == 0) {
+		if(read_superblock(fs, superblock, file_length)) {
+			return 1;
+		}
+	} else {
+		if (file_length < LEGACY_DATA_OFFSET + DEFAULT_CLUSTER_SIZE) {
+			return 1;
+		}
+		ClusterLocation clusters_count = min(LEGACY_CLUSTERS, (file_length - LEGACY_DATA_OFFSET) / DEFAULT_CLUSTER_SIZE);
+		set_geometry(fs, DEFAULT_CLUSTER_SIZE, clusters_count, sizeof(uint16_t), 0, LEGACY_DATA_OFFSET);
+	}
+
+	if(cache_init(fs) || dentry_init(fs, DENTRY_CACHE_BYTES) || locks_init(fs) || attach_backend(fs, backend) || journal_open(fs)) {
+		return 1;
+	}
+	load_table(fs);
+
+	if(free_map_build(fs) || refs_build(fs)) {
+		return 1;
+	}
+
+	return fs_error(fs);
+}
+
+void get_root(FileSystem* fs, DirCursor* out) {
+	out->current_cluster = 0;
+}
+
+// TODO: restrict: а если target из dir?
+OptionalResult lookup(FileSystem* fs, DirCursor* current, DirEntry* result, uint8_t* target) {
+	stat_add(&fs->stats.lookups, 1);
+	DirIndex index;
+	if(load_index(fs, current->current_cluster, &index)) {
+		return index_lookup(fs, &index, target, result);
+	}
+	result->directory = current->current_cluster;
+	result->current_cluster = current->current_cluster;
+	while(1) {
+		result->current_offset = 0;
+		while(result->current_offset != fs->cluster_size) {
+			cache_read(fs, result->current_cluster, result->current_offset, result->meta, FILE_META);
+			if(fs_error(fs)) {
+				return OPTIONAL_IO_ERROR;
+			}
+			if (result->meta[OFFSET_NAME] == 0) { // Empty file name
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+			stat_add(&fs->stats.entries_compared, 1);
+			if(name_equals(result->meta, target)) {
+				return OPTIONAL_OK;
+			}
+			result->current_offset += FILE_META;
+		}
+		if(fs->table_cache[result->current_cluster] == TV_FINAL) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		result->current_cluster = fs->table_cache[result->current_cluster];
+		stat_add(&fs->stats.fat_hops, 1);
+	}
+}
+
+// lookup() through the dentry cache
+OptionalResult resolve(FileSystem* fs, DirCursor* current, DirEntry* result, uint8_t* target) {
+	OptionalResult ret;
+	fs_lock_shared(fs);
+	cache_lock(fs);
+	uint8_t cached = dentry_get(fs, current->current_cluster, target, result, &ret);
+	cache_unlock(fs);
+	if(!cached) {
+		ret = lookup(fs, current, result, target);
+		if(ret != OPTIONAL_IO_ERROR) {
+			cache_lock(fs);
+			dentry_put(fs, current->current_cluster, target, ret == OPTIONAL_OK ? result : NULL);
+			cache_unlock(fs);
+		}
+	}
+	fs_unlock(fs);
+	return ret;
+}
+
+// Allocates the first cluster of the new file and stores the entry at the given
+// place. Inline files only need the entry.
+OptionalResult place_entry(FileSystem* fs, DirEntry* target) {
+	if(is_inline(target)) {
+		CacheSlot* slot = cache_get(fs, target->current_cluster, 1);
+		memcpy(slot->data+target->current_offset, target->meta, FILE_META);
+		cache_mark(fs, slot, target->current_offset, FILE_META);
+		return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+	}
+	ClusterLocation first_cluster = allocate(fs);
+	if(first_cluster == TV_CANT_ALLOC) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	set_cluster(target, first_cluster);
+	CacheSlot* slot = cache_get(fs, target->current_cluster, 1);
+	memcpy(slot->data+target->current_offset, target->meta, FILE_META);
+	cache_mark(fs, slot, target->current_offset, FILE_META);
+
+	if(is_folder(target)) {
+		init_directory(fs, first_cluster);
+	} else { // File contents are not journaled
+		slot = cache_get(fs, first_cluster, 0);
+		memset(slot->data, 0, fs->cluster_size);
+		slot->dirty = 1;
+	}
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// The caller has checked that the name is free
+OptionalResult create_file_indexed(FileSystem* fs, DirIndex* index, DirEntry* target) {
+	if(index->count == UINT16_MAX || index_reserve(fs, index)) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	uint16_t ordinal = index->count;
+	uint8_t grow = ordinal % fs->files_per_cluster == 0;
+	uint32_t needed = grow + !is_inline(target);
+	if(available_clusters(fs) < needed) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	if(grow) {
+		ClusterLocation tail = chain_at(fs, index->directory, ordinal / fs->files_per_cluster - 1);
+		if(extend(fs, &tail)) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		zero_cluster(fs, tail);
+	}
+	entry_location(fs, index, ordinal, target);
+	OptionalResult ret = place_entry(fs, target);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	index_insert(fs, index, name_hash(target->meta+OFFSET_NAME), ordinal);
+	index->count++;
+	store_index(fs, index);
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+OptionalResult create_file_linear(FileSystem* fs, DirCursor* current, DirEntry* target) {
+	target->directory = current->current_cluster;
+	target->current_cluster = current->current_cluster;
+	while(1) {
+		uint8_t* buffer = cache_get(fs, target->current_cluster, 1)->data;
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		target->current_offset = 0;
+		while(1) {
+			if (buffer[target->current_offset+OFFSET_NAME] == 0) { // Empty file name
+				return place_entry(fs, target);
+			}
+			if(name_equals(buffer+target->current_offset, get_file_name(target))) {
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+			target->current_offset += FILE_META;
+			if (target->current_offset == fs->cluster_size) {
+				if(fs->table_cache[target->current_cluster] == TV_FINAL) {
+					if(extend(fs, &target->current_cluster)) {
+						return OPTIONAL_STRUCTURE_ERROR;
+					}
+					zero_cluster(fs, target->current_cluster);
+					break;
+				} else {
+					target->current_cluster = fs->table_cache[target->current_cluster];
+					break;
+				}
+			}
+		}
+	}
+}
+
+// The name is looked up under the shared lock, so creators in different
+// directories only serialize for the insert itself
+OptionalResult create_file(FileSystem* fs, DirCursor* current, DirEntry* target) {
+	dir_lock(fs, current->current_cluster);
+	DirEntry existing;
+	fs_lock_shared(fs);
+	OptionalResult ret = lookup(fs, current, &existing, get_file_name(target));
+	fs_unlock(fs);
+	if(ret == OPTIONAL_OK) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	} else if(ret == OPTIONAL_STRUCTURE_ERROR) {
+		fs_lock_exclusive(fs);
+		// A cluster for the directory, the file and the index of a new directory
+		journal_reclaim(fs, 1 + !is_inline(target) + is_folder(target));
+		DirIndex index;
+		if(load_index(fs, current->current_cluster, &index)) {
+			ret = create_file_indexed(fs, &index, target);
+		} else {
+			ret = create_file_linear(fs, current, target);
+		}
+		dentry_forget(fs, current->current_cluster, get_file_name(target));
+		journal_operation(fs);
+		fs_unlock(fs);
+	}
+	dir_unlock(fs, current->current_cluster);
+	return ret;
+}
+
+OptionalResult delete_file_indexed(FileSystem* fs, DirIndex* index, DirEntry* target) {
+	size_t hops = 0;
+	for(ClusterLocation c = index->directory; c != target->current_cluster; c = fs->table_cache[c]) {
+		hops++;
+	}
+	uint16_t ordinal = hops * fs->files_per_cluster + target->current_offset / FILE_META;
+	uint16_t last = index->count - 1;
+
+	index_remove(fs, index, name_hash(get_file_name(target)), ordinal);
+	DirEntry moved;
+	entry_location(fs, index, last, &moved);
+	CacheSlot* slot = cache_get(fs, moved.current_cluster, 1);
+	memcpy(moved.meta, slot->data+moved.current_offset, FILE_META);
+	memset(slot->data+moved.current_offset, 0, FILE_META);
+	cache_mark(fs, slot, moved.current_offset, FILE_META);
+	if(last != ordinal) {
+		slot = cache_get(fs, target->current_cluster, 1);
+		memcpy(slot->data+target->current_offset, moved.meta, FILE_META);
+		cache_mark(fs, slot, target->current_offset, FILE_META);
+		uint32_t hash = name_hash(get_file_name(&moved));
+		index_set(fs, index, index_find_slot(fs, index, hash, last), (hash >> 16) << 16 | ordinal);
+		dentry_forget(fs, index->directory, get_file_name(&moved));
+	}
+	if(last % fs->files_per_cluster == 0) {
+		ClusterLocation prev = chain_at(fs, index->directory, last / fs->files_per_cluster - 1);
+		set_next(fs, prev, TV_FINAL);
+		release(fs, moved.current_cluster);
+	}
+	index->count--;
+	store_index(fs, index);
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+OptionalResult delete_file_linear(FileSystem* fs, DirCursor* parent, DirEntry* target) {
+	uint8_t* buffer;
+	uint8_t last[FILE_META];
+	size_t offset;
+	ClusterLocation prev = TV_EMPTY;
+	ClusterLocation current = parent->current_cluster;
+	// Find the last entry of the directory
+	while(1) {
+		buffer = cache_get(fs, current, 1)->data;
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		offset = 0;
+		while(offset != fs->cluster_size && buffer[offset+OFFSET_NAME] != 0) { // Empty file name
+			offset += FILE_META;
+		}
+		if(offset != fs->cluster_size || fs->table_cache[current] == TV_FINAL) {
+			break;
+		}
+		prev = current;
+		current = fs->table_cache[current];
+	}
+	offset -= FILE_META;
+	memcpy(last, buffer+offset, FILE_META);
+	if(offset == 0 && prev != TV_EMPTY) {
+		set_next(fs, prev, TV_FINAL);
+		release(fs, current);
+	} else {
+		CacheSlot* slot = cache_get(fs, current, 1);
+		memset(slot->data+offset, 0, FILE_META);
+		cache_mark(fs, slot, offset, FILE_META);
+	}
+	// Move it into the slot of the deleted one
+	if(target->current_cluster != current || target->current_offset != offset) {
+		CacheSlot* slot = cache_get(fs, target->current_cluster, 1);
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		memcpy(slot->data+target->current_offset, last, FILE_META);
+		cache_mark(fs, slot, target->current_offset, FILE_META);
+		dentry_forget(fs, parent->current_cluster, last+OFFSET_NAME);
+	}
+	return OPTIONAL_OK;
+}
+
+// The entry is looked up again, as another deletion may have moved it since
+// `target` was resolved
+OptionalResult delete_file(FileSystem* fs, DirCursor* parent, DirEntry* target) {
+	uint8_t name[FILE_NAME_BUFFER];
+	memcpy(name, get_file_name(target), FILE_NAME_BUFFER);
+	dir_lock(fs, parent->current_cluster);
+	fs_lock_exclusive(fs);
+	OptionalResult ret = lookup(fs, parent, target, name);
+	if(ret == OPTIONAL_OK) {
+		dentry_forget(fs, parent->current_cluster, name);
+		if(is_folder(target)) {
+			DirIndex own;
+			if(load_index(fs, get_cluster(target), &own)) {
+				free_chain(fs, own.first);
+			}
+			dentry_forget_directory(fs, get_cluster(target));
+		}
+		if(!is_inline(target)) {
+			free_chain(fs, get_cluster(target));
+		}
+
+		DirIndex index;
+		if(load_index(fs, parent->current_cluster, &index)) {
+			ret = delete_file_indexed(fs, &index, target);
+		} else {
+			ret = delete_file_linear(fs, parent, target);
+		}
+		journal_operation(fs);
+	}
+	fs_unlock(fs);
+	dir_unlock(fs, parent->current_cluster);
+	return ret;
+}
+
+// A byte-oriented LZ77 codec in the manner of LZ4. Every sequence is a token
+// with the literal count in the high nibble and the match length less
+// LZ_MIN_MATCH in the low one, the literals, and a 16-bit match offset. Counts
+// of LZ_RUN continue in the following bytes. The last sequence has no match.
+void lz_put_length(uint8_t* out, size_t* at, size_t value) {
+	if(value < LZ_RUN) {
+		return;
+	}
+	value -= LZ_RUN;
+	while(value >= UINT8_MAX) {
+		out[(*at)++] = UINT8_MAX;
+		value -= UINT8_MAX;
+	}
+	out[(*at)++] = value;
+}
+
+Result lz_get_length(uint8_t* in, size_t length, size_t* at, size_t* value) {
+	if(*value != LZ_RUN) {
+		return 0;
+	}
+	uint8_t byte;
+	do {
+		if(*at == length) {
+			return 1;
+		}
+		byte = in[(*at)++];
+		*value += byte;
+	} while(byte == UINT8_MAX);
+	return 0;
+}
+
+// A match of length 0 ends the data
+Result lz_sequence(uint8_t* out, size_t* at, size_t capacity, uint8_t* literals, size_t count, size_t offset, size_t match) {
+	size_t extra = match == 0 ? 0 : match - LZ_MIN_MATCH;
+	if(*at + 1 + count / UINT8_MAX + 1 + count + sizeof(uint16_t) + extra / UINT8_MAX + 1 > capacity) {
+		return 1;
+	}
+	out[(*at)++] = min(count, LZ_RUN) << 4 | min(extra, LZ_RUN);
+	lz_put_length(out, at, count);
+	memcpy(out + *at, literals, count);
+	*at += count;
+	if(match != 0) {
+		write_u16(out + *at, offset);
+		*at += sizeof(uint16_t);
+		lz_put_length(out, at, extra);
+	}
+	return 0;
+}
+
+// Returns the compressed size, or 0 if it would not fit `capacity`
+size_t lz_compress(uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xFF, sizeof(table));
+	size_t at = 0;
+	size_t anchor = 0;
+	size_t i = 0;
+	while(i + LZ_MIN_MATCH <= length) {
+		uint32_t sequence = read_u32(in + i);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		uint32_t candidate = table[hash];
+		table[hash] = i;
+		if(candidate == UINT32_MAX || i - candidate > LZ_MAX_OFFSET || read_u32(in + candidate) != sequence) {
+			i++;
+			continue;
+		}
+		size_t match = LZ_MIN_MATCH;
+		while(i + match < length && in[candidate + match] == in[i + match]) {
+			match++;
+		}
+		if(lz_sequence(out, &at, capacity, in + anchor, i - anchor, i - candidate, match)) {
+			return 0;
+		}
+		i += match;
+		anchor = i;
+	}
+	if(lz_sequence(out, &at, capacity, in + anchor, length - anchor, 0, 0)) {
+		return 0;
+	}
+	return at;
+}
+
+// Returns the decompressed size, or SIZE_MAX if the input is damaged
+size_t lz_decompress(uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+	size_t i = 0;
+	size_t at = 0;
+	while(i != length) {
+		uint8_t token = in[i++];
+		size_t count = token >> 4;
+		if(lz_get_length(in, length, &i, &count) || count > length - i || count > capacity - at) {
+			return SIZE_MAX;
+		}
+		memcpy(out + at, in + i, count);
+		i += count;
+		at += count;
+		if(i == length) {
+			break;
+		}
+		if(length - i < sizeof(uint16_t)) {
+			return SIZE_MAX;
+		}
+		size_t offset = read_u16(in + i);
+		i += sizeof(uint16_t);
+		size_t match = token & LZ_RUN;
+		if(lz_get_length(in, length, &i, &match)) {
+			return SIZE_MAX;
+		}
+		match += LZ_MIN_MATCH;
+		if(offset == 0 || offset > at || match > capacity - at) {
+			return SIZE_MAX;
+		}
+		for(size_t k = 0; k != match; k++, at++) { // Overlapping copies repeat the pattern
+			out[at] = out[at - offset];
+		}
+	}
+	return at;
+}
+
+size_t group_bytes(FileSystem* fs) {
+	return (size_t) COMPRESS_GROUP * fs->cluster_size;
+}
+
+uint32_t stored_clusters(FileSystem* fs, uint32_t stored) {
+	return ((stored & ~COMPRESS_RAW) + fs->cluster_size - 1) / fs->cluster_size;
+}
+
+uint32_t map_clusters(FileSystem* fs, uint32_t groups) {
+	return max(((size_t) groups * COMPRESS_MAP_SLOT + fs->cluster_size - 1) / fs->cluster_size, 1);
+}
+
+Packed* packed_open(FileCursor size) {
+	Packed* packed = calloc(1, sizeof(Packed));
+	if(packed != NULL) {
+		packed->size = size;
+		packed->decoded = UINT32_MAX;
+	}
+	return packed;
+}
+
+void packed_free(FileIO* file) {
+	Packed* packed = file->packed;
+	if(packed != NULL) {
+		free(packed->stored);
+		free(packed->start);
+		free(packed->tail);
+		free(packed->group);
+		free(packed->scratch);
+		free(packed);
+		file->packed = NULL;
+	}
+}
+
+Result packed_reserve(Packed* packed, uint32_t count) {
+	if(count <= packed->capacity) {
+		return 0;
+	}
+	uint32_t capacity = max(count, max(packed->capacity * 2, CHAIN_INITIAL));
+	uint32_t* stored = realloc(packed->stored, capacity * sizeof(uint32_t));
+	if(stored == NULL) {
+		return 1;
+	}
+	packed->stored = stored;
+	uint32_t* start = realloc(packed->start, capacity * sizeof(uint32_t));
+	if(start == NULL) {
+		return 1;
+	}
+	packed->start = start;
+	packed->capacity = capacity;
+	return 0;
+}
+
+// Cluster at `ordinal` of the file being read. While appending, the ones
+// from `kept` on are in the fresh chain.
+ClusterLocation packed_lookup(FileSystem* fs, FileIO* file, uint32_t ordinal) {
+	Packed* packed = file->packed;
+	if(packed->appending && ordinal >= packed->kept) {
+		return ordinal - packed->kept < packed->fresh_clusters ? chain_at(fs, packed->fresh_first, ordinal - packed->kept) : TV_FINAL;
+	}
+	return ordinal < file->clusters ? chain_lookup(fs, file, ordinal) : TV_FINAL;
+}
+
+// Moves whole clusters between the file and `buffer`, starting at the given
+// ordinal. Writes append to the fresh chain, which needs the exclusive lock;
+// reading needs the shared one.
+OptionalResult packed_clusters(FileSystem* fs, FileIO* file, uint32_t ordinal, uint8_t* buffer, size_t size, uint8_t write) {
+	Packed* packed = file->packed;
+	assert(!write || ordinal == packed->kept + packed->fresh_clusters);
+	while(size != 0) {
+		ClusterLocation cluster;
+		if(write) {
+			cluster = allocate_for(fs, file, packed->fresh_first == TV_EMPTY ? file->last : packed->fresh_last);
+			if(cluster == TV_CANT_ALLOC) {
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+			if(packed->fresh_first == TV_EMPTY) {
+				packed->fresh_first = cluster;
+			} else {
+				set_next(fs, packed->fresh_last, cluster);
+			}
+			packed->fresh_last = cluster;
+			packed->fresh_clusters++;
+		} else {
+			cluster = packed_lookup(fs, file, ordinal);
+			if(cluster == TV_FINAL) {
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+		}
+		size_t length = min(size, fs->cluster_size);
+		if(write) {
+			cache_drop(fs, cluster);
+			io_write(fs, cluster_offset(fs, cluster), buffer, length);
+			stat_add(&fs->stats.clusters_written, 1);
+		} else {
+			cache_writeback(fs, cluster);
+			io_read(fs, cluster_offset(fs, cluster), buffer, length);
+			stat_add(&fs->stats.clusters_read, 1);
+		}
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		ordinal++;
+		buffer += length;
+		size -= length;
+	}
+	return OPTIONAL_OK;
+}
+
+// Allocates the buffers and reads the map at the end of the chain
+OptionalResult packed_load(FileSystem* fs, FileIO* file) {
+	Packed* packed = file->packed;
+	if(packed == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	if(packed->loaded) {
+		return OPTIONAL_OK;
+	}
+	size_t bytes = group_bytes(fs);
+	if(packed->tail == NULL) {
+		packed->tail = malloc(bytes);
+	}
+	if(packed->group == NULL) {
+		packed->group = malloc(bytes);
+	}
+	if(packed->scratch == NULL) {
+		packed->scratch = malloc(bytes);
+	}
+	uint32_t count = (packed->size + bytes - 1) / bytes;
+	if(packed->tail == NULL || packed->group == NULL || packed->scratch == NULL || packed_reserve(packed, count)) {
+		return OPTIONAL_IO_ERROR;
+	}
+	uint32_t map = map_clusters(fs, count);
+	if(map > file->clusters) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	uint32_t ordinal = file->clusters - map;
+	uint32_t next = 0;
+	for(uint32_t i = 0; i != count; i++) {
+		uint32_t slot = i % (fs->cluster_size / COMPRESS_MAP_SLOT);
+		if(slot == 0) {
+			OptionalResult ret = packed_clusters(fs, file, ordinal++, packed->scratch, fs->cluster_size, 0);
+			if(ret != OPTIONAL_OK) {
+				return ret;
+			}
+		}
+		packed->stored[i] = read_u32(packed->scratch + slot * COMPRESS_MAP_SLOT);
+		packed->start[i] = next;
+		next += stored_clusters(fs, packed->stored[i]);
+		if((packed->stored[i] & ~COMPRESS_RAW) > bytes || next > file->clusters - map) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+	}
+	packed->count = count;
+	packed->loaded = 1;
+	return OPTIONAL_OK;
+}
+
+size_t group_length(FileSystem* fs, Packed* packed, uint32_t group) {
+	return min(group_bytes(fs), packed->size - (FileCursor) group * group_bytes(fs));
+}
+
+OptionalResult packed_decode(FileSystem* fs, FileIO* file, uint32_t group) {
+	Packed* packed = file->packed;
+	if(packed->decoded == group) {
+		return OPTIONAL_OK;
+	}
+	uint32_t stored = packed->stored[group];
+	size_t length = stored & ~COMPRESS_RAW;
+	size_t expected = group_length(fs, packed, group);
+	uint8_t* target = stored & COMPRESS_RAW ? packed->group : packed->scratch;
+	OptionalResult ret = packed_clusters(fs, file, packed->start[group], target, length, 0);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	if(stored & COMPRESS_RAW) {
+		if(length != expected) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+	} else {
+		uint64_t started = now_us();
+		if(lz_decompress(packed->scratch, length, packed->group, group_bytes(fs)) != expected) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		stat_add(&fs->stats.unpack_time, now_us() - started);
+		stat_add(&fs->stats.unpacked, expected);
+	}
+	packed->decoded = group;
+	return OPTIONAL_OK;
+}
+
+// Stores a group after the ones already written. It is kept as is unless
+// compressing saves at least a cluster.
+OptionalResult packed_emit(FileSystem* fs, FileIO* file, uint8_t* data, size_t length) {
+	Packed* packed = file->packed;
+	if(packed_reserve(packed, packed->count + 1)) {
+		return OPTIONAL_IO_ERROR;
+	}
+	size_t clusters = (length + fs->cluster_size - 1) / fs->cluster_size;
+	uint64_t started = now_us();
+	size_t size = lz_compress(data, length, packed->scratch, (clusters - 1) * fs->cluster_size);
+	stat_add(&fs->stats.pack_time, now_us() - started);
+	stat_add(&fs->stats.packed_in, length);
+	uint32_t stored = size;
+	if(size == 0) {
+		size = length;
+		stored = length | COMPRESS_RAW;
+	} else {
+		data = packed->scratch;
+	}
+	stat_add(&fs->stats.packed_out, size);
+	OptionalResult ret = packed_clusters(fs, file, packed->data_clusters, data, size, 1);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	packed->stored[packed->count] = stored;
+	packed->start[packed->count] = packed->data_clusters;
+	packed->count++;
+	packed->data_clusters += stored_clusters(fs, stored);
+	return OPTIONAL_OK;
+}
+
+// Takes a partial last group back into `tail`, so that appending rewrites it
+OptionalResult packed_append(FileSystem* fs, FileIO* file) {
+	Packed* packed = file->packed;
+	if(packed->appending) {
+		return OPTIONAL_OK;
+	}
+	OptionalResult ret = packed_load(fs, file);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	if(packed->count != 0 && packed->size % group_bytes(fs) != 0) {
+		uint32_t last = packed->count - 1;
+		ret = packed_decode(fs, file, last);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+		memcpy(packed->tail, packed->group, group_length(fs, packed, last));
+		packed->count--;
+	}
+	packed->data_clusters = packed->count == 0 ? 0 : packed->start[packed->count - 1] + stored_clusters(fs, packed->stored[packed->count - 1]);
+	packed->kept = packed->data_clusters;
+	packed->fresh_first = TV_EMPTY;
+	packed->fresh_clusters = 0;
+	packed->decoded = UINT32_MAX;
+	packed->appending = 1;
+	return OPTIONAL_OK;
+}
+
+// Lets go of the clusters written since the append began. The chain of the
+// file is left as it was.
+void packed_discard(FileSystem* fs, FileIO* file) {
+	Packed* packed = file->packed;
+	if(packed != NULL && packed->fresh_first != TV_EMPTY) {
+		free_chain(fs, packed->fresh_first);
+		packed->fresh_first = TV_EMPTY;
+		packed->fresh_clusters = 0;
+	}
+}
+
+OptionalResult packed_write(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	Packed* packed = file->packed;
+	if(packed == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	if(packed->cursor != packed->size) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+	fs_lock_exclusive(fs);
+	file->modified = 1;
+	stat_add(&fs->stats.file_writes, 1);
+	OptionalResult ret = packed_append(fs, file);
+	size_t bytes = group_bytes(fs);
+	while(ret == OPTIONAL_OK && size != 0) {
+		size_t pending = packed->size - (FileCursor) packed->count * bytes;
+		size_t length = min(size, bytes - pending);
+		memcpy(packed->tail + pending, buffer, length);
+		packed->size += length;
+		packed->cursor += length;
+		buffer += length;
+		size -= length;
+		if(pending + length == bytes) {
+			ret = packed_emit(fs, file, packed->tail, bytes);
+		}
+	}
+	fs_unlock(fs);
+	return ret;
+}
+
+Result packed_read(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	Packed* packed = file->packed;
+	if(packed == NULL) {
+		return 1;
+	}
+	fs_lock_shared(fs);
+	stat_add(&fs->stats.file_reads, 1);
+	OptionalResult ret = packed_load(fs, file);
+	size_t bytes = group_bytes(fs);
+	while(ret == OPTIONAL_OK && size != 0 && packed->cursor < packed->size) {
+		uint32_t group = packed->cursor / bytes;
+		size_t offset = packed->cursor % bytes;
+		uint8_t* data = packed->tail;
+		if(group < packed->count) {
+			ret = packed_decode(fs, file, group);
+			data = packed->group;
+		}
+		size_t length = min(size, group_length(fs, packed, group) - offset);
+		memcpy(buffer, data + offset, length);
+		packed->cursor += length;
+		buffer += length;
+		size -= length;
+	}
+	fs_unlock(fs);
+	return ret != OPTIONAL_OK;
+}
+
+// Writes the last partial group and the map to the fresh chain
+OptionalResult packed_store(FileSystem* fs, FileIO* file) {
+	Packed* packed = file->packed;
+	size_t pending = packed->size - (FileCursor) packed->count * group_bytes(fs);
+	if(pending != 0) {
+		OptionalResult ret = packed_emit(fs, file, packed->tail, pending);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	uint32_t per_cluster = fs->cluster_size / COMPRESS_MAP_SLOT;
+	uint32_t map = map_clusters(fs, packed->count);
+	for(uint32_t i = 0; i != map; i++) {
+		memset(packed->scratch, 0, fs->cluster_size);
+		for(uint32_t slot = 0; slot != per_cluster && i * per_cluster + slot < packed->count; slot++) {
+			write_u32(packed->scratch + slot * COMPRESS_MAP_SLOT, packed->stored[i * per_cluster + slot]);
+		}
+		OptionalResult ret = packed_clusters(fs, file, packed->data_clusters + i, packed->scratch, fs->cluster_size, 1);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	return OPTIONAL_OK;
+}
+
+// Stores the last partial group and the map, then links the fresh chain in
+// place of the old tail of the file and releases that. The caller writes the
+// entry in the same operation. Called with the exclusive lock held.
+OptionalResult packed_finish(FileSystem* fs, FileIO* file) {
+	Packed* packed = file->packed;
+	if(packed == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	if(!packed->appending) {
+		return OPTIONAL_OK;
+	}
+	OptionalResult ret = packed_store(fs, file);
+	if(ret == OPTIONAL_OK && packed->kept != 0 && unshare_chain(fs, file, packed->kept - 1)) {
+		ret = fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_STRUCTURE_ERROR;
+	}
+	if(ret != OPTIONAL_OK) {
+		packed_discard(fs, file);
+		return ret;
+	}
+	ClusterLocation old;
+	if(packed->kept == 0) {
+		old = file->first;
+		file->first = packed->fresh_first;
+	} else {
+		ClusterLocation tail = chain_lookup(fs, file, packed->kept - 1);
+		old = fs->table_cache[tail];
+		set_next(fs, tail, packed->fresh_first);
+	}
+	if(old != TV_FINAL) {
+		free_chain(fs, old);
+	}
+	file->clusters = packed->kept + packed->fresh_clusters;
+	file->last = packed->fresh_last;
+	file->chain_length = min(file->chain_length, packed->kept);
+	file->shared_epoch = 0;
+	packed->fresh_first = TV_EMPTY;
+	packed->fresh_clusters = 0;
+	packed->appending = 0;
+	return OPTIONAL_OK;
+}
+
+OptionalResult relocate_entry(FileSystem* fs, FileIO* file);
+OptionalResult inline_spill(FileSystem* fs, FileIO* file);
+
+Holes* holes_open(FileSystem* fs, FileCursor size) {
+	Holes* holes = calloc(1, sizeof(Holes));
+	if(holes == NULL) {
+		return NULL;
+	}
+	holes->capacity = (fs->cluster_size - sizeof(uint32_t)) / SPARSE_HOLE;
+	holes->start = malloc(holes->capacity * sizeof(uint32_t));
+	holes->length = malloc(holes->capacity * sizeof(uint32_t));
+	if(holes->start == NULL || holes->length == NULL) {
+		free(holes->start);
+		free(holes->length);
+		free(holes);
+		return NULL;
+	}
+	holes->size = size;
+	return holes;
+}
+
+void holes_free(FileIO* file) {
+	Holes* holes = file->holes;
+	if(holes != NULL) {
+		free(holes->start);
+		free(holes->length);
+		free(holes);
+		file->holes = NULL;
+	}
+}
+
+// Reads the map from the last cluster of the chain
+OptionalResult holes_load(FileSystem* fs, FileIO* file) {
+	Holes* holes = file->holes;
+	if(holes == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	if(holes->loaded) {
+		return OPTIONAL_OK;
+	}
+	uint8_t* map = malloc(fs->cluster_size);
+	if(map == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	cache_read(fs, file->last, 0, map, fs->cluster_size);
+	uint32_t count = read_u32(map);
+	uint32_t clusters = holes->size / fs->cluster_size + 1;
+	uint32_t data = clusters;
+	uint32_t end = 1;
+	OptionalResult ret = fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+	if(count > holes->capacity) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	}
+	for(uint32_t i = 0; ret == OPTIONAL_OK && i != count; i++) {
+		uint32_t start = read_u32(map + sizeof(uint32_t) + i * SPARSE_HOLE);
+		uint32_t length = read_u32(map + sizeof(uint32_t) + i * SPARSE_HOLE + sizeof(uint32_t));
+		if(start < end || start >= clusters || length == 0 || length > clusters - start) {
+			ret = OPTIONAL_STRUCTURE_ERROR;
+			break;
+		}
+		holes->start[i] = start;
+		holes->length[i] = length;
+		end = start + length;
+		data -= length;
+	}
+	free(map);
+	if(ret == OPTIONAL_OK && data != file->clusters - 1) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	}
+	if(ret == OPTIONAL_OK) {
+		holes->count = count;
+		holes->loaded = 1;
+	}
+	return ret;
+}
+
+// Ordinal in the chain of cluster `index` of the file, or UINT32_MAX if it is
+// in a hole. `hole` receives the first hole that does not end before it.
+uint32_t holes_locate(Holes* holes, uint32_t index, uint32_t* hole) {
+	uint32_t skipped = 0;
+	uint32_t i = 0;
+	for(; i != holes->count && holes->start[i] <= index; i++) {
+		if(index - holes->start[i] < holes->length[i]) {
+			*hole = i;
+			return UINT32_MAX;
+		}
+		skipped += holes->length[i];
+	}
+	*hole = i;
+	return index - skipped;
+}
+
+void holes_insert(Holes* holes, uint32_t at, uint32_t start, uint32_t length) {
+	memmove(holes->start + at + 1, holes->start + at, (holes->count - at) * sizeof(uint32_t));
+	memmove(holes->length + at + 1, holes->length + at, (holes->count - at) * sizeof(uint32_t));
+	holes->start[at] = start;
+	holes->length[at] = length;
+	holes->count++;
+}
+
+void holes_remove(Holes* holes, uint32_t at) {
+	holes->count--;
+	memmove(holes->start + at, holes->start + at + 1, (holes->count - at) * sizeof(uint32_t));
+	memmove(holes->length + at, holes->length + at + 1, (holes->count - at) * sizeof(uint32_t));
+}
+
+// Links a zeroed cluster into the chain at `ordinal`, which is never the
+// first. Called with the exclusive lock held.
+OptionalResult sparse_link(FileSystem* fs, FileIO* file, uint32_t ordinal) {
+	ClusterLocation cluster = allocate(fs);
+	if(cluster == TV_CANT_ALLOC) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	CacheSlot* slot = cache_get(fs, cluster, 0);
+	memset(slot->data, 0, fs->cluster_size);
+	slot->dirty = 1;
+	ClusterLocation previous = chain_lookup(fs, file, ordinal - 1);
+	set_next(fs, cluster, fs->table_cache[previous]);
+	set_next(fs, previous, cluster);
+	file->chain_length = min(file->chain_length, ordinal);
+	file->clusters++;
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// Gives cluster `index`, which is in hole `hole`, a cluster of its own
+OptionalResult holes_fill(FileSystem* fs, FileIO* file, uint32_t hole, uint32_t index) {
+	Holes* holes = file->holes;
+	uint32_t end = holes->start[hole] + holes->length[hole];
+	if(index != holes->start[hole] && index != end - 1 && holes->count == holes->capacity) {
+		while(holes->start[hole] != index) { // No room to split it, the part before is filled in
+			OptionalResult ret = holes_fill(fs, file, hole, holes->start[hole]);
+			if(ret != OPTIONAL_OK) {
+				return ret;
+			}
+		}
+	}
+	uint32_t start = holes->start[hole];
+	uint32_t skipped = 0;
+	for(uint32_t i = 0; i != hole; i++) {
+		skipped += holes->length[i];
+	}
+	OptionalResult ret = sparse_link(fs, file, start - skipped);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	if(holes->length[hole] == 1) {
+		holes_remove(holes, hole);
+	} else if(index == start) {
+		holes->start[hole]++;
+		holes->length[hole]--;
+	} else if(index == end - 1) {
+		holes->length[hole]--;
+	} else {
+		holes_insert(holes, hole + 1, index + 1, end - index - 1);
+		holes->length[hole] = index - start;
+	}
+	return OPTIONAL_OK;
+}
+
+// Extends the file to `size` bytes, the new clusters in a hole
+OptionalResult holes_grow(FileSystem* fs, FileIO* file, FileCursor size) {
+	Holes* holes = file->holes;
+	uint32_t clusters = holes->size / fs->cluster_size + 1;
+	uint32_t wanted = size / fs->cluster_size + 1;
+	uint32_t hole;
+	uint32_t ordinal = holes_locate(holes, clusters - 1, &hole);
+	if(ordinal != UINT32_MAX) { // The bytes after the old end are not zeroed on truncation
+		size_t offset = holes->size % fs->cluster_size;
+		CacheSlot* slot = cache_get(fs, chain_lookup(fs, file, ordinal), 1);
+		memset(slot->data + offset, 0, fs->cluster_size - offset);
+		slot->dirty = 1;
+	}
+	if(wanted > clusters) {
+		uint32_t last = holes->count - 1;
+		if(holes->count != 0 && holes->start[last] + holes->length[last] == clusters) {
+			holes->length[last] += wanted - clusters;
+		} else if(holes->count != holes->capacity) {
+			holes_insert(holes, holes->count, clusters, wanted - clusters);
+		} else {
+			for(uint32_t i = clusters; i != wanted; i++) {
+				OptionalResult ret = sparse_link(fs, file, file->clusters - 1);
+				if(ret != OPTIONAL_OK) {
+					return ret;
+				}
+			}
+		}
+	}
+	holes->size = size;
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// Loads the map and gives the file copies of its shared clusters, as any
+// change rewrites the map. Called with the exclusive lock held.
+OptionalResult holes_prepare(FileSystem* fs, FileIO* file) {
+	OptionalResult ret = holes_load(fs, file);
+	if(ret == OPTIONAL_OK && unshare_chain(fs, file, file->clusters - 1)) {
+		ret = fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_STRUCTURE_ERROR;
+	}
+	file->modified |= ret == OPTIONAL_OK;
+	return ret;
+}
+
+OptionalResult sparse_write(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	Holes* holes = file->holes;
+	if(holes == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	fs_lock_exclusive(fs);
+	stat_add(&fs->stats.file_writes, 1);
+	OptionalResult ret = holes_prepare(fs, file);
+	if(ret == OPTIONAL_OK && holes->cursor + size > holes->size) {
+		ret = holes_grow(fs, file, holes->cursor + size);
+	}
+	while(ret == OPTIONAL_OK && size != 0) {
+		uint32_t index = holes->cursor / fs->cluster_size;
+		size_t offset = holes->cursor % fs->cluster_size;
+		size_t length = min(size, fs->cluster_size - offset);
+		uint32_t hole;
+		uint32_t ordinal = holes_locate(holes, index, &hole);
+		if(ordinal == UINT32_MAX) {
+			ret = holes_fill(fs, file, hole, index);
+			ordinal = holes_locate(holes, index, &hole);
+		}
+		if(ret != OPTIONAL_OK) {
+			break;
+		}
+		ClusterLocation cluster = chain_lookup(fs, file, ordinal);
+		cache_drop(fs, cluster);
+		io_write(fs, cluster_offset(fs, cluster) + offset, buffer, length);
+		stat_add(&fs->stats.clusters_written, 1);
+		if(fs_error(fs)) {
+			ret = OPTIONAL_IO_ERROR;
+		}
+		holes->cursor += length;
+		buffer += length;
+		size -= length;
+	}
+	fs_unlock(fs);
+	return ret;
+}
+
+// Holes are filled with zeros without touching the disk
+Result sparse_read(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	Holes* holes = file->holes;
+	if(holes == NULL) {
+		return 1;
+	}
+	fs_lock_shared(fs);
+	stat_add(&fs->stats.file_reads, 1);
+	OptionalResult ret = holes_load(fs, file);
+	while(ret == OPTIONAL_OK && size != 0 && holes->cursor < holes->size) {
+		size_t offset = holes->cursor % fs->cluster_size;
+		size_t length = min(min(size, fs->cluster_size - offset), holes->size - holes->cursor);
+		uint32_t hole;
+		uint32_t ordinal = holes_locate(holes, holes->cursor / fs->cluster_size, &hole);
+		if(ordinal == UINT32_MAX) {
+			memset(buffer, 0, length);
+		} else {
+			ClusterLocation cluster = chain_lookup(fs, file, ordinal);
+			cache_writeback(fs, cluster);
+			io_read(fs, cluster_offset(fs, cluster) + offset, buffer, length);
+			stat_add(&fs->stats.clusters_read, 1);
+			if(fs_error(fs)) {
+				ret = OPTIONAL_IO_ERROR;
+			}
+		}
+		holes->cursor += length;
+		buffer += length;
+		size -= length;
+	}
+	fs_unlock(fs);
+	return ret != OPTIONAL_OK;
+}
+
+// Growing leaves a hole; shrinking drops the holes and data clusters past the
+// new end
+OptionalResult sparse_set_length(FileSystem* fs, FileIO* file, FileCursor length) {
+	Holes* holes = file->holes;
+	if(holes == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	fs_lock_exclusive(fs);
+	OptionalResult ret = holes_prepare(fs, file);
+	if(ret == OPTIONAL_OK && length >= holes->size) {
+		ret = holes_grow(fs, file, length);
+	} else if(ret == OPTIONAL_OK) {
+		uint32_t wanted = length / fs->cluster_size + 1;
+		uint32_t skipped = 0;
+		uint32_t count = 0;
+		for(; count != holes->count && holes->start[count] < wanted; count++) {
+			holes->length[count] = min(holes->length[count], wanted - holes->start[count]);
+			skipped += holes->length[count];
+		}
+		holes->count = count;
+		uint32_t keep = wanted - skipped;
+		if(keep < file->clusters - 1) {
+			ClusterLocation tail = chain_lookup(fs, file, keep - 1);
+			ClusterLocation dropped = fs->table_cache[tail];
+			set_next(fs, chain_lookup(fs, file, file->clusters - 2), TV_FINAL);
+			set_next(fs, tail, file->last);
+			free_chain(fs, dropped);
+			file->clusters = keep + 1;
+			file->chain_length = min(file->chain_length, keep);
+		}
+		holes->size = length;
+	}
+	holes->cursor = 0;
+	fs_unlock(fs);
+	return ret;
+}
+
+// Stores the map in the last cluster. Called with the exclusive lock held.
+OptionalResult holes_finish(FileSystem* fs, FileIO* file) {
+	Holes* holes = file->holes;
+	if(holes == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	if(!holes->loaded) {
+		return OPTIONAL_OK;
+	}
+	CacheSlot* slot = cache_get(fs, file->last, 0);
+	memset(slot->data, 0, fs->cluster_size);
+	write_u32(slot->data, holes->count);
+	for(uint32_t i = 0; i != holes->count; i++) {
+		write_u32(slot->data + sizeof(uint32_t) + i * SPARSE_HOLE, holes->start[i]);
+		write_u32(slot->data + sizeof(uint32_t) + i * SPARSE_HOLE + sizeof(uint32_t), holes->length[i]);
+	}
+	slot->dirty = 1;
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// Turns a plain file into a sparse one without holes by appending the map.
+// Entries of legacy images with long names cannot hold the flag.
+OptionalResult make_sparse(FileSystem* fs, FileIO* file) {
+	if(file->is_inline) {
+		OptionalResult ret = inline_spill(fs, file);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	FileCursor position = (FileCursor) file->position * fs->cluster_size + file->offset;
+	Holes* holes = holes_open(fs, (FileCursor) (file->clusters - 1) * fs->cluster_size + file->metaFileSize);
+	if(holes == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	fs_lock_exclusive(fs);
+	OptionalResult ret = relocate_entry(fs, file);
+	if(ret == OPTIONAL_OK) {
+		uint8_t meta[FILE_META];
+		cache_read(fs, file->entry_cluster, file->entry_offset, meta, FILE_META);
+		if(!meta_is_v2(meta) && !name_fits_v2(meta + OFFSET_NAME)) {
+			ret = OPTIONAL_UNSUPPORTED;
+		}
+	}
+	if(ret == OPTIONAL_OK && unshare_chain(fs, file, file->clusters - 1)) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	}
+	ClusterLocation tail = file->last;
+	if(ret == OPTIONAL_OK && extend_file(fs, file, &tail)) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	}
+	if(ret == OPTIONAL_OK) {
+		holes->loaded = 1;
+		holes->cursor = position;
+		file->holes = holes;
+		file->sparse = 1;
+		file->modified = 1;
+	} else {
+		free(holes->start);
+		free(holes->length);
+		free(holes);
+	}
+	fs_unlock(fs);
+	return ret;
+}
+
+void open_dir(FileSystem* fs, DirEntry* entry, DirCursor* result) {
+	assert(is_folder(entry));
+	result->current_cluster = get_cluster(entry);
+}
+
+void open_file(FileSystem* fs, DirEntry* entry, FileIO* result) {
+	assert(!is_folder(entry));
+	result->offset = 0;
+	result->current = result->first = get_cluster(entry);
+	result->is_inline = is_inline(entry);
+	result->compressed = 0;
+	result->packed = NULL;
+	result->sparse = 0;
+	result->seek_pending = 0;
+	result->holes = NULL;
+	result->shared_epoch = 0;
+	if(result->is_inline) {
+		result->clusters = 0;
+		result->last = TV_FINAL;
+		result->metaFileSize = get_file_size(fs, entry);
+		result->inline_capacity = inline_capacity(entry->meta);
+		memset(result->inline_data, 0, FILE_META);
+		memcpy(result->inline_data, entry->meta + inline_offset(entry->meta), result->metaFileSize);
+		strcpy(result->entry_name, get_file_name(entry));
+	} else if(is_v2(entry)) {
+		result->clusters = read_u32(entry->meta + OFFSET_V2_CLUSTERS);
+		result->last = read_u32(entry->meta + OFFSET_V2_LAST);
+		result->metaFileSize = read_u64(entry->meta + OFFSET_V2_SIZE) - (FileCursor) (result->clusters - 1) * fs->cluster_size;
+		result->compressed = is_compressed(entry);
+		result->sparse = is_sparse(entry);
+	} else {
+		// Walked once here, the entry is upgraded by close_file() after a write
+		result->metaFileSize = get_meta_size(entry);
+		result->clusters = 1;
+		result->last = result->first;
+		fs_lock_shared(fs);
+		while(fs->table_cache[result->last] != TV_FINAL) {
+			result->last = fs->table_cache[result->last];
+			result->clusters++;
+		}
+		stat_add(&fs->stats.fat_hops, result->clusters - 1);
+		fs_unlock(fs);
+	}
+	result->position = 0;
+	result->chain = NULL;
+	result->chain_length = 0;
+	result->chain_capacity = 0;
+	if(!result->is_inline) {
+		chain_note(result, 0, result->first);
+	}
+	if(result->compressed) {
+		result->metaFileSize = 0;
+		result->packed = packed_open(get_file_size(fs, entry));
+	}
+	if(result->sparse) {
+		result->metaFileSize = 0;
+		result->holes = holes_open(fs, get_file_size(fs, entry));
+	}
+	result->sequential = 0;
+	result->readahead = 0;
+	result->readahead_mark = 0;
+	result->entry_directory = entry->directory;
+	result->entry_cluster = entry->current_cluster;
+	result->entry_offset = entry->current_offset;
+	result->entry_first = result->first;
+	result->modified = 0;
+	result->reserved_count = 0;
+	result->reserve_window = RESERVE_WINDOW_MIN;
+	result->reserve_expected = 0;
+}
+
+// Moves the bytes of an inline file into a cluster of its own. The entry keeps
+// FLAG_INLINE until close_file().
+OptionalResult inline_spill(FileSystem* fs, FileIO* file) {
+	fs_lock_exclusive(fs);
+	ClusterLocation cluster = allocate(fs);
+	if(cluster == TV_CANT_ALLOC) {
+		fs_unlock(fs);
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	CacheSlot* slot = cache_get(fs, cluster, 0);
+	memset(slot->data, 0, fs->cluster_size);
+	memcpy(slot->data, file->inline_data, file->metaFileSize);
+	slot->dirty = 1;
+	file->is_inline = 0;
+	file->modified = 1;
+	file->first = file->current = file->last = cluster;
+	file->clusters = 1;
+	file->position = 0;
+	file->chain_length = 0;
+	chain_note(file, 0, cluster);
+	fs_unlock(fs);
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// Reserves a run long enough for the file to grow to `size` bytes. An empty
+// file gives up its first cluster if a full run can be found elsewhere.
+void reserve_for_size(FileSystem* fs, FileIO* file, FileCursor size) {
+	uint32_t needed = min(size / fs->cluster_size + 1, fs->clusters_count);
+	uint32_t clusters = file->clusters;
+	if(clusters >= needed) {
+		return;
+	}
+	file->reserve_expected = needed - clusters;
+	if(clusters == 1 && file->metaFileSize == 0 && run_length(fs, file->first + 1, needed - 1) != needed - 1) {
+		uint32_t length;
+		ClusterLocation start = find_free_run(fs, fs->free_map.hint, needed, &length);
+		if(length == needed) {
+			release_reservation(fs, file);
+			release(fs, file->first);
+			file->first = file->current = file->last = start;
+			file->chain_length = 0;
+			chain_note(file, 0, start);
+			set_next(fs, start, TV_FINAL);
+			mark_used(fs, start);
+			reserve_run(fs, file, start + 1, needed - 1);
+			return;
+		}
+	}
+	reserve_after(fs, file, file->last, needed - clusters);
+}
+
+// Makes the clusters freed by earlier operations reusable if the file needs
+// them to grow to `length` bytes. A file that has changed is in the middle of
+// its operation, so it only gets what is free.
+void reclaim_for(FileSystem* fs, FileIO* file, FileCursor length) {
+	FileCursor wanted = length / fs->cluster_size + 1;
+	if(file->modified || fs->journal.size == 0 || wanted <= file->clusters) {
+		return;
+	}
+	fs_lock_exclusive(fs);
+	journal_reclaim(fs, min(wanted - file->clusters, fs->clusters_count));
+	fs_unlock(fs);
+}
+
+// Zeroes bytes [from, to) of a data cluster, which is not journaled
+void zero_data(FileSystem* fs, ClusterLocation cluster, ClusterOffset from, ClusterOffset to) {
+	if(from >= to) {
+		return;
+	}
+	CacheSlot* slot = cache_get(fs, cluster, from != 0 || to != fs->cluster_size);
+	memset(slot->data + from, 0, to - from);
+	slot->dirty = 1;
+}
+
+// Compressed files can only be emptied. Sparse files grow by a hole. Plain
+// files read zeros where they grow, unless `keep` is set because the caller
+// overwrites all of the new length anyway.
+OptionalResult resize_file(FileSystem* fs, FileIO* file, FileCursor length, uint8_t keep) {
+	reclaim_for(fs, file, length);
+	file->seek_pending = 0;
+	if(file->compressed) {
+		Packed* packed = file->packed;
+		if(packed == NULL) {
+			return OPTIONAL_IO_ERROR;
+		}
+		if(length != 0) {
+			return length == packed->size ? OPTIONAL_OK : OPTIONAL_UNSUPPORTED;
+		}
+		fs_lock_exclusive(fs);
+		OptionalResult ret = packed_load(fs, file);
+		if(ret == OPTIONAL_OK) {
+			packed_discard(fs, file);
+			packed->size = packed->cursor = 0;
+			packed->count = packed->data_clusters = packed->kept = 0;
+			packed->decoded = UINT32_MAX;
+			packed->appending = 1;
+			file->modified = 1;
+		}
+		fs_unlock(fs);
+		return ret;
+	}
+	if(file->sparse) {
+		return sparse_set_length(fs, file, length);
+	}
+	if(file->is_inline) {
+		if(length <= file->inline_capacity) {
+			memset(file->inline_data + length, 0, FILE_META - length);
+			file->metaFileSize = length;
+			file->offset = 0;
+			file->modified = 1;
+			return OPTIONAL_OK;
+		}
+		OptionalResult ret = inline_spill(fs, file);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	fs_lock_exclusive(fs);
+	if(unshare_chain(fs, file, min(length / fs->cluster_size, file->clusters - 1))) {
+		fs_unlock(fs);
+		return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_STRUCTURE_ERROR;
+	}
+	file->modified = 1;
+	reserve_for_size(fs, file, length);
+	uint32_t wanted = length / fs->cluster_size + 1;
+	// The old last cluster may hold bytes past the end from earlier contents
+	FileCursor last_start = (FileCursor) (file->clusters - 1) * fs->cluster_size;
+	if(length > last_start + file->metaFileSize) {
+		zero_data(fs, file->last, file->metaFileSize, min(length - last_start, fs->cluster_size));
+	}
+	file->metaFileSize = length % fs->cluster_size;
+	if(wanted > file->clusters) {
+		ClusterLocation tail = file->last;
+		while(file->clusters != wanted) {
+			if(extend_file(fs, file, &tail)) {
+				fs_unlock(fs);
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+			if(!keep) {
+				zero_data(fs, tail, 0, fs->cluster_size);
+			}
+		}
+	} else {
+		ClusterLocation tail = chain_lookup(fs, file, wanted - 1);
+		ClusterLocation current = fs->table_cache[tail];
+		set_next(fs, tail, TV_FINAL);
+		free_chain(fs, current);
+		file->last = tail;
+		file->clusters = wanted;
+		file->chain_length = min(file->chain_length, wanted);
+		file->shared_epoch = 0;
+		zero_data(fs, tail, file->metaFileSize, fs->cluster_size);
+	}
+	file->current = file->first;
+	file->position = 0;
+	file->offset = 0;
+	fs_unlock(fs);
+	return OPTIONAL_OK;
+}
+
+OptionalResult set_length(FileSystem* fs, FileIO* file, FileCursor length) {
+	return resize_file(fs, file, length, 0);
+}
+
+OptionalResult seek(FileSystem* fs, FileIO* file, FileCursor location) {
+	if(file->compressed) {
+		if(file->packed == NULL || location > file->packed->size) {
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		file->packed->cursor = location;
+		return OPTIONAL_OK;
+	}
+	if(file->sparse) {
+		if(file->holes == NULL) {
+			return OPTIONAL_IO_ERROR;
+		}
+		file->holes->cursor = location;
+		return OPTIONAL_OK;
+	}
+	file->seek_pending = 0;
+	if(file->is_inline && location <= file->inline_capacity) {
+		file->offset = location;
+		return OPTIONAL_OK;
+	}
+	if(location / fs->cluster_size >= (file->is_inline ? 1 : file->clusters)) { // Writing there leaves a hole
+		file->seek_pending = 1;
+		file->seek_target = location;
+		return OPTIONAL_OK;
+	}
+	if(file->is_inline) {
+		OptionalResult ret = inline_spill(fs, file);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	fs_lock_shared(fs);
+	ClusterLocation current = chain_lookup(fs, file, location / fs->cluster_size);
+	fs_unlock(fs);
+	if(current == TV_FINAL) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	file->current = current;
+	file->position = location / fs->cluster_size;
+	file->offset = location % fs->cluster_size;
+	file->sequential = 0;
+	file->readahead = 0;
+	file->readahead_mark = 0;
+	return OPTIONAL_OK;
+}
+
+// TODO: buffer?
+// Data goes to clusters the file already owns under the shared lock; only
+// growing the chain takes the exclusive one.
+OptionalResult write_to_file(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	OptionalResult ret = OPTIONAL_OK;
+	reclaim_for(fs, file, (FileCursor) file->position * fs->cluster_size + file->offset + size);
+	if(file->compressed) {
+		return packed_write(fs, file, buffer, size);
+	}
+	if(file->seek_pending) {
+		ret = make_sparse(fs, file);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+		file->seek_pending = 0;
+		file->holes->cursor = file->seek_target;
+	}
+	if(file->sparse) {
+		return sparse_write(fs, file, buffer, size);
+	}
+	if(file->is_inline) {
+		if(file->offset + size <= file->inline_capacity) {
+			memcpy(file->inline_data + file->offset, buffer, size);
+			file->offset += size;
+			file->metaFileSize = max(file->metaFileSize, file->offset);
+			file->modified = 1;
+			stat_add(&fs->stats.file_writes, 1);
+			return OPTIONAL_OK;
+		}
+		ret = inline_spill(fs, file);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	}
+	ret = prepare_write(fs, file, (FileCursor) file->position * fs->cluster_size + file->offset + size);
+	if(ret != OPTIONAL_OK) {
+		return ret;
+	}
+	file->modified = 1;
+	stat_add(&fs->stats.file_writes, 1);
+	IoBatch batch = { 0 };
+	while(size != 0) {
+		ClusterOffset left = fs->cluster_size - file->offset;
+		ClusterOffset to_write = min(size, left);
+		stat_add(&fs->stats.clusters_written, 1);
+		cache_drop(fs, file->current);
+		io_batch_add(fs, &batch, cluster_offset(fs, file->current) + file->offset, buffer, to_write, 1);
+		if(fs_error(fs)) {
+			ret = OPTIONAL_IO_ERROR;
+			break;
+		}
+		file->offset = (file->offset + to_write) % fs->cluster_size;
+		buffer += to_write;
+		size -= to_write;
+		if(fs->table_cache[file->current] == TV_FINAL && file->offset > file->metaFileSize) {
+			file->metaFileSize = file->offset;
+		}
+		if(to_write == left) {
+			// Выделять память под следующий блок, даже если нечего записывать
+			if(fs->table_cache[file->current] == TV_FINAL) {
+				file->metaFileSize = 0;
+				fs_unlock(fs);
+				fs_lock_exclusive(fs);
+				// The last cluster may have been shared while the lock was free
+				if(shared_from(fs, file) <= file->position) {
+					io_batch_wait(fs, &batch);
+				}
+				Result full = unshare_chain(fs, file, file->position) || extend_file(fs, file, &file->current);
+				fs_unlock(fs);
+				fs_lock_shared(fs);
+				if(full) {
+					ret = OPTIONAL_STRUCTURE_ERROR;
+					break;
+				}
+			} else {
+				file->current = fs->table_cache[file->current];
+				stat_add(&fs->stats.fat_hops, 1);
+			}
+			chain_note(file, ++file->position, file->current);
+		}
+	}
+	if(io_batch_wait(fs, &batch) && ret == OPTIONAL_OK) {
+		ret = OPTIONAL_IO_ERROR;
+	}
+	fs_unlock(fs);
+	return ret;
+}
+
+// Hints the kernel about the clusters that a sequential reader will want next.
+// The window doubles on every sequential call and is reset by seek().
+void file_readahead(FileSystem* fs, FileIO* file) {
+	file->readahead = min(max(file->readahead * 2, READAHEAD_MIN), READAHEAD_MAX);
+	uint32_t window = max(file->readahead / fs->cluster_size, 1);
+	uint32_t target = file->position + window;
+	if(file->readahead_mark >= target - window / 2) {
+		return;
+	}
+	uint32_t ordinal = max(file->readahead_mark, file->position);
+	ClusterLocation cluster = chain_lookup(fs, file, ordinal);
+	while(cluster != TV_FINAL && ordinal < target) {
+		ClusterLocation start = cluster;
+		uint32_t length = 1;
+		while(fs->table_cache[cluster] == cluster + 1 && ordinal + length < target) {
+			cluster++;
+			length++;
+		}
+		io_advise(fs, cluster_offset(fs, start), (size_t) length * fs->cluster_size);
+		ordinal += length;
+		cluster = fs->table_cache[cluster];
+	}
+	file->readahead_mark = ordinal;
+}
+
+// Reads whole runs of physically consecutive clusters with a single request
+Result read_from_file(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
+	if(file->compressed) {
+		return packed_read(fs, file, buffer, size);
+	}
+	if(file->sparse) {
+		return sparse_read(fs, file, buffer, size);
+	}
+	if(file->seek_pending) { // Past the end, there is nothing to read
+		stat_add(&fs->stats.file_reads, 1);
+		return 0;
+	}
+	if(file->is_inline) {
+		size_t left = file->metaFileSize > file->offset ? file->metaFileSize - file->offset : 0;
+		size_t to_read = min(size, left);
+		memcpy(buffer, file->inline_data + file->offset, to_read);
+		file->offset += to_read;
+		stat_add(&fs->stats.file_reads, 1);
+		return 0;
+	}
+	fs_lock_shared(fs);
+	stat_add(&fs->stats.file_reads, 1);
+	if(file->sequential) {
+		file_readahead(fs, file);
+	}
+	IoBatch batch = { 0 };
+	while(size != 0) {
+		ClusterLocation start = file->current;
+		ClusterLocation cluster = start;
+		uint32_t clusters = 1;
+		size_t available = 0;
+		while(1) {
+			cache_writeback(fs, cluster);
+			ClusterLocation next = fs->table_cache[cluster];
+			available += next == TV_FINAL ? file->metaFileSize : fs->cluster_size;
+			if(next != cluster + 1 || available - file->offset >= size) {
+				break;
+			}
+			cluster = next;
+			clusters++;
+		}
+		size_t left = available > file->offset ? available - file->offset : 0;
+		size_t to_read = min(size, left);
+		stat_add(&fs->stats.clusters_read, clusters);
+		stat_add(&fs->stats.fat_hops, clusters);
+		io_batch_add(fs, &batch, cluster_offset(fs, start) + file->offset, buffer, to_read, 0);
+		if(fs_error(fs)) {
+			break;
+		}
+		buffer += to_read;
+		size -= to_read;
+		size_t end = file->offset + to_read;
+		uint32_t hops = min(end / fs->cluster_size, clusters - 1);
+		for(uint32_t i = 1; i <= hops; i++) {
+			chain_note(file, file->position + i, start + i);
+		}
+		file->position += hops;
+		file->current = start + hops;
+		file->offset = end - (size_t) hops * fs->cluster_size;
+		ClusterLocation next = fs->table_cache[cluster];
+		if(to_read == left && next == TV_FINAL) {
+			break;
+		}
+		if(file->offset == fs->cluster_size) { // The run was read up to its last byte
+			file->offset = 0;
+			file->current = next;
+			chain_note(file, ++file->position, next);
+		}
+	}
+	if(io_batch_wait(fs, &batch)) {
+		fs_unlock(fs);
+		return 1;
+	}
+	file->sequential = 1;
+	fs_unlock(fs);
+	return 0;
+}
+
+// Moves `size` bytes between the start of the file and a host file descriptor
+// inside the kernel, one request per run of consecutive clusters. The chain
+// must already be long enough. OPTIONAL_UNSUPPORTED means that nothing was
+// transferred and the caller has to copy the data itself.
+OptionalResult transfer_runs(FileSystem* fs, FileIO* file, int host, FileCursor size, uint8_t to_volume) {
+#ifdef FS_MMAP
+#ifndef FS_COPY_RANGE
+	if(fs->backend != BACKEND_MMAP) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+#endif
+	fflush(fs->file);
+	ClusterLocation cluster = file->first;
+	FileCursor done = 0;
+	while(done < size) {
+		ClusterLocation start = cluster;
+		size_t length = min(fs->cluster_size, size - done);
+		uint32_t clusters = 1;
+		while(1) {
+			if(to_volume) {
+				cache_drop(fs, cluster);
+			} else {
+				cache_writeback(fs, cluster);
+			}
+			if(fs->table_cache[cluster] != cluster + 1 || done + length == size) {
+				break;
+			}
+			cluster++;
+			clusters++;
+			length += min(fs->cluster_size, size - done - length);
+		}
+		fflush(fs->file);
+		uint64_t volume_offset = cluster_offset(fs, start);
+		uint64_t host_offset = done;
+		size_t left = length;
+		while(left != 0) {
+			ssize_t moved;
+			if(fs->backend == BACKEND_MMAP) {
+				uint8_t* slice = io_slice(fs, volume_offset, left);
+				if(slice == NULL) {
+					return OPTIONAL_IO_ERROR;
+				}
+				moved = to_volume ? pread(host, slice, left, host_offset) : pwrite(host, slice, left, host_offset);
+			} else {
+#ifdef FS_COPY_RANGE
+				loff_t in = to_volume ? host_offset : volume_offset;
+				loff_t out = to_volume ? volume_offset : host_offset;
+				int volume = fileno(fs->file);
+				moved = copy_file_range(to_volume ? host : volume, &in, to_volume ? volume : host, &out, left, 0);
+				if(moved < 0 && done == 0 && left == length && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+					return OPTIONAL_UNSUPPORTED;
+				}
+#endif
+			}
+			if(moved <= 0) {
+				return OPTIONAL_IO_ERROR;
+			}
+			stat_io(fs, volume_offset, moved, to_volume);
+			volume_offset += moved;
+			host_offset += moved;
+			left -= moved;
+		}
+		// Every cluster of the run had its FAT entry looked at
+		stat_add(to_volume ? &fs->stats.clusters_written : &fs->stats.clusters_read, clusters);
+		stat_add(&fs->stats.fat_hops, clusters);
+		done += length;
+		cluster = fs->table_cache[cluster];
+	}
+	stat_add(to_volume ? &fs->stats.file_writes : &fs->stats.file_reads, 1);
+	fflush(fs->file);
+	return OPTIONAL_OK;
+#else
+	return OPTIONAL_UNSUPPORTED;
+#endif
+}
+
+OptionalResult transfer_file(FileSystem* fs, FileIO* file, int host, FileCursor size, uint8_t to_volume) {
+	if(file->is_inline || file->compressed || file->sparse) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+	if(to_volume) {
+		OptionalResult ret = prepare_write(fs, file, size);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+	} else {
+		fs_lock_shared(fs);
+	}
+	file->modified |= to_volume;
+	OptionalResult ret = transfer_runs(fs, file, host, size, to_volume);
+	fs_unlock(fs);
+	return ret;
+}
+
+void dir_iter(FileSystem* fs, DirCursor* current, DirIter* iter) {
+	iter->directory = current->current_cluster;
+	iter->current_cluster = current->current_cluster;
+	iter->current_offset = 0;
+}
+
+OptionalResult dir_iter_step(FileSystem* fs, DirIter* iter, DirEntry* next) {
+	while(1) {
+		if(iter->current_offset == fs->cluster_size) {
+			if(fs->table_cache[iter->current_cluster] == TV_FINAL) {
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+			iter->current_cluster = fs->table_cache[iter->current_cluster];
+			iter->current_offset = 0;
+			stat_add(&fs->stats.fat_hops, 1);
+		}
+		cache_read(fs, iter->current_cluster, iter->current_offset, next->meta, FILE_META);
+		if(fs_error(fs)) {
+			return OPTIONAL_IO_ERROR;
+		}
+		if (next->meta[OFFSET_NAME] == 0) { // Empty file name
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		next->directory = iter->directory;
+		next->current_cluster = iter->current_cluster;
+		next->current_offset = iter->current_offset;
+		iter->current_offset += FILE_META;
+		if(get_meta_size(next) != FS_INDEX) {
+			return OPTIONAL_OK;
+		}
+	}
+}
+
+OptionalResult dir_iter_next(FileSystem* fs, DirIter* iter, DirEntry* next) {
+	fs_lock_shared(fs);
+	OptionalResult ret = dir_iter_step(fs, iter, next);
+	fs_unlock(fs);
+	return ret;
+}
+
+uint8_t entry_of(FileIO* file, DirEntry* entry) {
+	if(file->entry_first == TV_FINAL) {
+		return is_inline(entry) && name_equals(entry->meta, file->entry_name);
+	}
+	return get_cluster(entry) == file->entry_first;
+}
+
+// Finds the entry of an open file after a deletion in its directory moved it
+OptionalResult relocate_entry(FileSystem* fs, FileIO* file) {
+	DirEntry entry;
+	ClusterLocation cluster = file->entry_directory;
+	while(cluster != file->entry_cluster && cluster != TV_FINAL) { // The cluster itself may have been freed
+		cluster = fs->table_cache[cluster];
+	}
+	if(cluster != TV_FINAL) {
+		cache_read(fs, cluster, file->entry_offset, entry.meta, FILE_META);
+		if(entry.meta[OFFSET_NAME] != 0 && get_meta_size(&entry) != FS_INDEX && entry_of(file, &entry)) {
+			return OPTIONAL_OK;
+		}
+	}
+	DirCursor directory = { file->entry_directory };
+	DirIter iter;
+	dir_iter(fs, &directory, &iter);
+	while(1) {
+		OptionalResult ret = dir_iter_step(fs, &iter, &entry);
+		if(ret != OPTIONAL_OK) {
+			return ret;
+		}
+		if(entry_of(file, &entry)) {
+			file->entry_cluster = entry.current_cluster;
+			file->entry_offset = entry.current_offset;
+			return OPTIONAL_OK;
+		}
+	}
+}
+
+// Only a file that was written to has its entry updated
+Result close_file(FileSystem* fs, FileIO* file) {
+	if(!file->modified) {
+		free(file->chain);
+		file->chain = NULL;
+		file->chain_length = file->chain_capacity = 0;
+		packed_free(file);
+		holes_free(file);
+		return 0;
+	}
+	fs_lock_exclusive(fs);
+	FileCursor size = (FileCursor) (file->clusters - 1) * fs->cluster_size + file->metaFileSize;
+	OptionalResult finished = OPTIONAL_OK;
+	if(file->compressed) {
+		finished = packed_finish(fs, file);
+		size = finished == OPTIONAL_OK ? file->packed->size : 0;
+	} else if(file->sparse) {
+		finished = holes_finish(fs, file);
+		size = finished == OPTIONAL_OK ? file->holes->size : 0;
+	}
+	free(file->chain);
+	file->chain = NULL;
+	file->chain_length = file->chain_capacity = 0;
+	packed_free(file);
+	holes_free(file);
+	release_reservation(fs, file);
+	if(finished != OPTIONAL_OK || relocate_entry(fs, file) != OPTIONAL_OK) {
+		fs_unlock(fs);
+		return 1;
+	}
+	CacheSlot* slot = cache_get(fs, file->entry_cluster, 1);
+	uint8_t* meta = slot->data + file->entry_offset;
+	if(file->is_inline) {
+		ClusterOffset data = inline_offset(meta);
+		write_u16(meta + OFFSET_CLUSTER, file->metaFileSize);
+		memcpy(meta + data, file->inline_data, FILE_META - data);
+	} else {
+		if(meta_is_inline(meta)) { // The file has just outgrown the entry
+			ClusterOffset data = inline_offset(meta);
+			write_u16(meta + OFFSET_SIZE, read_u16(meta + OFFSET_SIZE) & ~FLAG_INLINE);
+			memset(meta + data, 0, OFFSET_V2_SIZE - data);
+		}
+		if(!meta_is_v2(meta) && name_fits_v2(meta + OFFSET_NAME)) {
+			write_u16(meta + OFFSET_SIZE, ENTRY_V2);
+			memset(meta + OFFSET_V2_SIZE, 0, FILE_META - OFFSET_V2_SIZE);
+		}
+		write_u16(meta + OFFSET_CLUSTER, file->first);
+		if(meta_is_v2(meta)) {
+			uint16_t tag = read_u16(meta + OFFSET_SIZE) & ~(FLAG_COMPRESSED | FLAG_SPARSE);
+			write_u16(meta + OFFSET_SIZE, tag | (file->compressed ? FLAG_COMPRESSED : 0) | (file->sparse ? FLAG_SPARSE : 0));
+			write_u64(meta + OFFSET_V2_SIZE, size);
+			write_u32(meta + OFFSET_V2_CLUSTERS, file->clusters);
+			write_u32(meta + OFFSET_V2_LAST, file->last);
+			write_u32(meta + OFFSET_V2_FIRST, file->first);
+		} else {
+			write_u16(meta + OFFSET_SIZE, file->metaFileSize);
+		}
+	}
+	cache_mark(fs, slot, file->entry_offset, FILE_META);
+	dentry_forget(fs, file->entry_directory, meta + OFFSET_NAME);
+	file->entry_first = file->first;
+	journal_operation(fs);
+	fs_unlock(fs);
+	return fs_error(fs);
+}
+
+// Rewrites a file into a new chain, compressed or not. The entry is switched
+// to the new chain by close_file() before the old one is released.
+// OPTIONAL_UNSUPPORTED if the name is too long for the flag.
+OptionalResult convert_file(FileSystem* fs, DirEntry* entry, uint8_t compress) {
+	if(compress && !is_v2(entry) && !name_fits_v2(get_file_name(entry))) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+	FileCursor size = get_file_size(fs, entry);
+	uint8_t* buffer = malloc(STREAM_BUFFER);
+	if(buffer == NULL) {
+		return OPTIONAL_IO_ERROR;
+	}
+	FileIO source;
+	open_file(fs, entry, &source);
+	fs_lock_exclusive(fs);
+	ClusterLocation first = allocate(fs);
+	fs_unlock(fs);
+	if(first == TV_CANT_ALLOC) {
+		free(buffer);
+		close_file(fs, &source);
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	FileIO target = source;
+	target.first = target.current = target.last = first;
+	target.clusters = 1;
+	target.metaFileSize = 0;
+	target.offset = 0;
+	target.position = 0;
+	target.chain = NULL;
+	target.chain_length = target.chain_capacity = 0;
+	chain_note(&target, 0, first);
+	target.sequential = 0;
+	target.readahead = target.readahead_mark = 0;
+	target.modified = 1;
+	target.reserved_count = 0;
+	target.reserve_window = RESERVE_WINDOW_MIN;
+	target.reserve_expected = 0;
+	target.shared_epoch = 0;
+	target.compressed = compress;
+	target.packed = compress ? packed_open(0) : NULL;
+	target.sparse = 0;
+	target.seek_pending = 0;
+	target.holes = NULL;
+	OptionalResult ret = compress ? set_length(fs, &target, 0) : OPTIONAL_OK;
+	for(FileCursor done = 0; ret == OPTIONAL_OK && done < size; ) {
+		size_t length = min(size - done, STREAM_BUFFER);
+		if(read_from_file(fs, &source, buffer, length)) {
+			ret = OPTIONAL_IO_ERROR;
+			break;
+		}
+		ret = write_to_file(fs, &target, buffer, length);
+		done += length;
+	}
+	free(buffer);
+	if(ret == OPTIONAL_OK && close_file(fs, &target)) {
+		ret = OPTIONAL_IO_ERROR;
+	}
+	fs_lock_exclusive(fs);
+	if(ret == OPTIONAL_OK) {
+		free_chain(fs, source.first);
+	} else {
+		free(target.chain);
+		packed_discard(fs, &target);
+		packed_free(&target);
+		release_reservation(fs, &target);
+		free_chain(fs, target.first);
+	}
+	journal_operation(fs);
+	fs_unlock(fs);
+	close_file(fs, &source);
+	return ret;
+}
+
+// Creates `name` in `directory` as a copy of `source` that only has a first
+// cluster of its own, the entry has to point at it, and links it to the rest
+// of the source's chain. Writes to either file copy the clusters they touch.
+// OPTIONAL_UNSUPPORTED if the volume has no link counts to share them by.
+OptionalResult clone_file(FileSystem* fs, DirCursor* directory, DirEntry* source, uint8_t* name) {
+	if(fs->refs_offset == 0 && !is_inline(source)) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+	DirEntry target;
+	init_meta(&target, 0, name);
+	OptionalResult ret = create_file(fs, directory, &target);
+	if(ret != OPTIONAL_OK || is_inline(source)) {
+		if(ret == OPTIONAL_OK) { // Fits in the entry, copying is as cheap as sharing
+			uint8_t data[FILE_META];
+			FileIO from;
+			FileIO to;
+			open_file(fs, source, &from);
+			FileCursor size = from.metaFileSize;
+			ret = read_from_file(fs, &from, data, size) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+			close_file(fs, &from);
+			open_file(fs, &target, &to);
+			if(ret == OPTIONAL_OK) {
+				ret = write_to_file(fs, &to, data, size);
+			}
+			if(close_file(fs, &to) && ret == OPTIONAL_OK) {
+				ret = OPTIONAL_IO_ERROR;
+			}
+		}
+		return ret;
+	}
+	uint8_t* buffer = malloc(fs->cluster_size);
+	if(buffer == NULL) {
+		delete_file(fs, directory, &target);
+		return OPTIONAL_IO_ERROR;
+	}
+	fs_lock_exclusive(fs);
+	ClusterLocation head = get_cluster(source);
+	// A version 1 entry already got its first cluster from create_file()
+	ClusterLocation first = is_inline(&target) ? allocate(fs) : get_cluster(&target);
+	if(first == TV_CANT_ALLOC) {
+		fs_unlock(fs);
+		free(buffer);
+		delete_file(fs, directory, &target);
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	cache_writeback(fs, head);
+	io_read(fs, cluster_offset(fs, head), buffer, fs->cluster_size);
+	cache_drop(fs, first);
+	io_write(fs, cluster_offset(fs, first), buffer, fs->cluster_size);
+	stat_add(&fs->stats.clusters_read, 1);
+	stat_add(&fs->stats.clusters_written, 1);
+	set_next(fs, first, fs->table_cache[head]);
+	free(buffer);
+
+	uint32_t clusters;
+	uint32_t extents;
+	ClusterLocation last;
+	if(is_v2(source)) {
+		clusters = read_u32(source->meta + OFFSET_V2_CLUSTERS);
+		last = read_u32(source->meta + OFFSET_V2_LAST);
+	} else {
+		chain_extents(fs, head, &clusters, &extents);
+		last = chain_at(fs, head, clusters - 1);
+	}
+	uint8_t* meta = target.meta;
+	write_u16(meta + OFFSET_CLUSTER, first);
+	if(is_v2(&target)) {
+		write_u16(meta + OFFSET_SIZE, ENTRY_V2 | (is_compressed(source) ? FLAG_COMPRESSED : 0) | (is_sparse(source) ? FLAG_SPARSE : 0));
+		write_u64(meta + OFFSET_V2_SIZE, entry_size(fs, source));
+		write_u32(meta + OFFSET_V2_CLUSTERS, clusters);
+		write_u32(meta + OFFSET_V2_LAST, clusters == 1 ? first : last);
+		write_u32(meta + OFFSET_V2_FIRST, first);
+	} else { // The caller made sure that the source is neither compressed nor sparse
+		write_u16(meta + OFFSET_SIZE, entry_size(fs, source) - (FileCursor) (clusters - 1) * fs->cluster_size);
+	}
+	CacheSlot* slot = cache_get(fs, target.current_cluster, 1);
+	memcpy(slot->data + target.current_offset, meta, FILE_META);
+	cache_mark(fs, slot, target.current_offset, FILE_META);
+	dentry_forget(fs, directory->current_cluster, name);
+	journal_operation(fs);
+	fs_unlock(fs);
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+void dedup_free(FileSystem* fs) {
+	free(fs->dedup.keys);
+	free(fs->dedup.clusters);
+	free(fs->dedup.indexed);
+	memset(&fs->dedup, 0, sizeof(DedupIndex));
+}
+
+// Called with the exclusive lock held
+Result dedup_enable(FileSystem* fs) {
+	DedupIndex* index = &fs->dedup;
+	if(index->enabled) {
+		return 0;
+	}
+	uint32_t slots = 1;
+	while(slots < fs->clusters_count && slots < DEDUP_MAX_SLOTS) {
+		slots <<= 1;
+	}
+	index->keys = calloc(slots, sizeof(uint64_t));
+	index->clusters = malloc(slots * sizeof(ClusterLocation));
+	index->indexed = calloc(fs->clusters_count / MAP_WORD_BITS + 1, sizeof(uint64_t));
+	if(index->keys == NULL || index->clusters == NULL || index->indexed == NULL) {
+		dedup_free(fs);
+		return 1;
+	}
+	index->mask = slots - 1;
+	index->enabled = 1;
+	return 0;
+}
+
+uint64_t cluster_hash(uint8_t* data, size_t size) {
+	uint64_t hash = 0x9E3779B97F4A7C15ull;
+	for(size_t i = 0; i < size; i += sizeof(uint64_t)) {
+		hash = (hash ^ read_u64(data + i)) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+// Two clusters can only be merged if they link to the same cluster as well
+uint64_t dedup_key(uint64_t hash, ClusterLocation next) {
+	uint64_t key = hash ^ (next * 0xC4CEB9FE1A85EC53ull);
+	key ^= key >> 31;
+	return key | 1;
+}
+
+uint8_t dedup_indexed(FileSystem* fs, ClusterLocation cluster) {
+	return (fs->dedup.indexed[cluster / MAP_WORD_BITS] >> (cluster % MAP_WORD_BITS)) & 1;
+}
+
+// An indexed cluster holding the bytes of `data` and linking to `next`, or
+// TV_FINAL. Chain heads are never returned, their entries point at them.
+ClusterLocation dedup_find(FileSystem* fs, uint64_t key, ClusterLocation next, uint8_t* data, uint8_t* scratch) {
+	DedupIndex* index = &fs->dedup;
+	for(uint32_t i = 0; i != DEDUP_PROBES; i++) {
+		uint32_t slot = (key + i) & index->mask;
+		if(index->keys[slot] == 0) {
+			break;
+		}
+		ClusterLocation cluster = index->clusters[slot];
+		if(index->keys[slot] != key || !dedup_indexed(fs, cluster) || fs->refs[cluster] == 0 || fs->table_cache[cluster] != next) {
+			continue;
+		}
+		cache_writeback(fs, cluster);
+		io_read(fs, cluster_offset(fs, cluster), scratch, fs->cluster_size);
+		stat_add(&fs->stats.clusters_read, 1);
+		if(memcmp(scratch, data, fs->cluster_size) == 0) {
+			return cluster;
+		}
+	}
+	return TV_FINAL;
+}
+
+// Takes the first free probe, or the home slot when all of them are taken
+void dedup_insert(FileSystem* fs, uint64_t key, ClusterLocation cluster) {
+	DedupIndex* index = &fs->dedup;
+	uint32_t slot = key & index->mask;
+	for(uint32_t i = 0; i != DEDUP_PROBES; i++) {
+		uint32_t probe = (key + i) & index->mask;
+		if(index->keys[probe] == 0 || index->keys[probe] == key) {
+			slot = probe;
+			break;
+		}
+	}
+	index->keys[slot] = key;
+	index->clusters[slot] = cluster;
+	index->indexed[cluster / MAP_WORD_BITS] |= (uint64_t) 1 << (cluster % MAP_WORD_BITS);
+}
+
+// Cluster `ordinal` of a host file, zero-padded like the last cluster of a file
+Result host_cluster(FILE* external, FileCursor size, uint32_t ordinal, size_t cluster_size, uint8_t* data) {
+	FileCursor offset = (FileCursor) ordinal * cluster_size;
+	size_t length = min(size - offset, cluster_size);
+	memset(data + length, 0, cluster_size - length);
+	fseek64(external, offset, SEEK_SET);
+	return fread(data, 1, length, external) != length;
+}
+
+// Imports `size` bytes from `external`, linking to the longest tail of
+// clusters the volume already holds and writing only the clusters before it.
+// The first cluster is always written, entries point at chain heads.
+OptionalResult import_dedup(FileSystem* fs, FileIO* file, FILE* external, FileCursor size) {
+	size_t cs = fs->cluster_size;
+	uint32_t count = size / cs + 1;
+	uint64_t* hashes = malloc(count * sizeof(uint64_t));
+	uint8_t* data = malloc(cs);
+	uint8_t* scratch = malloc(cs);
+	OptionalResult ret = OPTIONAL_IO_ERROR;
+	if(hashes == NULL || data == NULL || scratch == NULL) {
+		goto done;
+	}
+	ret = file->is_inline ? inline_spill(fs, file) : set_length(fs, file, 0);
+	if(ret != OPTIONAL_OK) {
+		goto done;
+	}
+	for(uint32_t i = 0; i != count; i++) {
+		if(host_cluster(external, size, i, cs, data)) {
+			ret = OPTIONAL_IO_ERROR;
+			goto done;
+		}
+		hashes[i] = cluster_hash(data, cs);
+	}
+	fs_lock_exclusive(fs);
+	ClusterLocation next = TV_FINAL;
+	ClusterLocation last = TV_FINAL;
+	uint32_t written = count;
+	while(written > 1 && !host_cluster(external, size, written - 1, cs, data)) {
+		ClusterLocation found = dedup_find(fs, dedup_key(hashes[written - 1], next), next, data, scratch);
+		if(found == TV_FINAL) {
+			break;
+		}
+		if(last == TV_FINAL) {
+			last = found;
+		}
+		next = found;
+		written--;
+	}
+	ClusterLocation tail = file->first;
+	for(uint32_t i = 0; i != written; i++) {
+		if(i != 0 && extend_file(fs, file, &tail)) {
+			ret = OPTIONAL_STRUCTURE_ERROR;
+			break;
+		}
+		if(host_cluster(external, size, i, cs, data)) {
+			ret = OPTIONAL_IO_ERROR;
+			break;
+		}
+		cache_drop(fs, tail);
+		io_write(fs, cluster_offset(fs, tail), data, cs);
+	}
+	stat_add(&fs->stats.clusters_written, file->clusters);
+	stat_add(&fs->stats.dedup_written, file->clusters);
+	if(ret == OPTIONAL_OK) {
+		if(next != TV_FINAL) {
+			set_next(fs, tail, next);
+			file->last = last;
+			file->clusters = count;
+			stat_add(&fs->stats.dedup_linked, count - written);
+		}
+		file->metaFileSize = size % cs;
+		for(uint32_t i = 1; i != written; i++) {
+			ClusterLocation cluster = chain_lookup(fs, file, i);
+			dedup_insert(fs, dedup_key(hashes[i], fs->table_cache[cluster]), cluster);
+		}
+	}
+	file->modified = 1;
+	file->current = file->first;
+	file->position = 0;
+	file->offset = 0;
+	file->shared_epoch = 0;
+	fs_unlock(fs);
+	if(ret == OPTIONAL_OK && fs_error(fs)) {
+		ret = OPTIONAL_IO_ERROR;
+	}
+
+	done:
+	free(hashes);
+	free(data);
+	free(scratch);
+	return ret;
+}
+
+// Links the tail of a plain file to identical clusters indexed earlier and
+// releases its own copies. Only the part of the chain before its first shared
+// cluster is relinked, the clusters before a relinked one must be the file's.
+uint32_t dedup_chain(FileSystem* fs, DirEntry* entry, ClusterLocation* chain, uint32_t count, uint8_t* data, uint8_t* scratch) {
+	uint32_t from = count;
+	for(uint32_t i = 1; i != count; i++) {
+		if(fs->refs[chain[i]] > 1) {
+			from = i;
+			break;
+		}
+	}
+	uint32_t released = 0;
+	ClusterLocation next = TV_FINAL;
+	ClusterLocation last = chain[count - 1];
+	for(uint32_t k = count - 1; k != 0; k--) {
+		ClusterLocation cluster = chain[k];
+		cache_writeback(fs, cluster);
+		io_read(fs, cluster_offset(fs, cluster), data, fs->cluster_size);
+		stat_add(&fs->stats.clusters_read, 1);
+		uint64_t key = dedup_key(cluster_hash(data, fs->cluster_size), next);
+		ClusterLocation found = dedup_find(fs, key, next, data, scratch);
+		if(found == TV_FINAL) {
+			dedup_insert(fs, key, cluster);
+		} else if(found != cluster && k <= from) {
+			set_next(fs, chain[k - 1], found);
+			free_chain(fs, cluster);
+			released++;
+			if(k == count - 1) {
+				last = found;
+			}
+			cluster = found;
+		}
+		next = cluster;
+	}
+	if(last != chain[count - 1] && is_v2(entry)) {
+		CacheSlot* slot = cache_get(fs, entry->current_cluster, 1);
+		write_u32(slot->data + entry->current_offset + OFFSET_V2_LAST, last);
+		cache_mark(fs, slot, entry->current_offset, FILE_META);
+	}
+	journal_operation(fs);
+	return released;
+}
+
+// Offline pass over every plain file of the volume. Runs under the exclusive
+// lock, so no file may be open.
+Result dedup_volume(FileSystem* fs, uint32_t* released) {
+	*released = 0;
+	fs_lock_exclusive(fs);
+	uint8_t was_enabled = fs->dedup.enabled;
+	uint32_t stack_size = 1;
+	uint32_t stack_capacity = CHAIN_INITIAL;
+	uint32_t chain_capacity = CHAIN_INITIAL;
+	ClusterLocation* stack = malloc(stack_capacity * sizeof(ClusterLocation));
+	ClusterLocation* chain = malloc(chain_capacity * sizeof(ClusterLocation));
+	uint8_t* data = malloc(fs->cluster_size);
+	uint8_t* scratch = malloc(fs->cluster_size);
+	Result ret = stack == NULL || chain == NULL || data == NULL || scratch == NULL || dedup_enable(fs);
+	if(!ret) {
+		stack[0] = 0;
+	} else {
+		stack_size = 0;
+	}
+	while(stack_size != 0 && !ret) {
+		DirCursor directory = { stack[--stack_size] };
+		DirIter iter;
+		DirEntry entry;
+		dir_iter(fs, &directory, &iter);
+		while(!ret && dir_iter_step(fs, &iter, &entry) == OPTIONAL_OK) {
+			if(is_folder(&entry)) {
+				if(stack_size == stack_capacity) {
+					ClusterLocation* grown = realloc(stack, stack_capacity * 2 * sizeof(ClusterLocation));
+					if(grown == NULL) {
+						ret = 1;
+						break;
+					}
+					stack = grown;
+					stack_capacity *= 2;
+				}
+				stack[stack_size++] = get_cluster(&entry);
+				continue;
+			}
+			if(is_inline(&entry) || is_compressed(&entry)) {
+				continue;
+			}
+			uint32_t count = 0;
+			for(ClusterLocation c = get_cluster(&entry); c != TV_FINAL; c = fs->table_cache[c]) {
+				if(count == chain_capacity) {
+					ClusterLocation* grown = realloc(chain, chain_capacity * 2 * sizeof(ClusterLocation));
+					if(grown == NULL) {
+						ret = 1;
+						break;
+					}
+					chain = grown;
+					chain_capacity *= 2;
+				}
+				chain[count++] = c;
+			}
+			if(!ret && count > 1) {
+				*released += dedup_chain(fs, &entry, chain, count, data, scratch);
+				ret = fs_error(fs);
+			}
+		}
+	}
+	dentry_clear(fs);
+	if(!was_enabled) {
+		dedup_free(fs);
+	}
+	fs_unlock(fs);
+	free(stack);
+	free(chain);
+	free(data);
+	free(scratch);
+	return ret;
+}
+
+Result fsck_locks_init(Fsck* check) {
+#ifdef FS_THREADS
+	if(pthread_mutex_init(&check->mutex, NULL) != 0) {
+		return 1;
+	}
+	if(pthread_cond_init(&check->wake, NULL) != 0) {
+		pthread_mutex_destroy(&check->mutex);
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+void fsck_locks_destroy(Fsck* check) {
+#ifdef FS_THREADS
+	pthread_cond_destroy(&check->wake);
+	pthread_mutex_destroy(&check->mutex);
+#endif
+}
+
+void fsck_lock(Fsck* check) {
+#ifdef FS_THREADS
+	pthread_mutex_lock(&check->mutex);
+#endif
+}
+
+void fsck_unlock(Fsck* check) {
+#ifdef FS_THREADS
+	pthread_mutex_unlock(&check->mutex);
+#endif
+}
+
+// Prints a problem found at `path`. One that can't be repaired is counted as such.
+void fsck_problem(Fsck* check, uint8_t* path, uint8_t repairable, const char* format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	fsck_lock(check);
+	printf("%s: ", *path ? (char*) path : "/");
+	vprintf(format, arguments);
+	printf(".\n");
+	fsck_unlock(check);
+	va_end(arguments);
+	stat_add(&check->problems, 1);
+	if(!repairable) {
+		stat_add(&check->unrepaired, 1);
+	}
+}
+
+void fsck_fix(Fsck* check, FsckFix* fix) {
+	if(!check->repair) {
+		return;
+	}
+	fsck_lock(check);
+	if(check->fix_count == check->fix_capacity) {
+		uint32_t capacity = check->fix_capacity ? check->fix_capacity * 2 : CHAIN_INITIAL;
+		FsckFix* fixes = realloc(check->fixes, capacity * sizeof(FsckFix));
+		if(fixes != NULL) {
+			check->fixes = fixes;
+			check->fix_capacity = capacity;
+		}
+	}
+	if(check->fix_count != check->fix_capacity) {
+		check->fixes[check->fix_count++] = *fix;
+	} else {
+		check->unrepaired++;
+	}
+	fsck_unlock(check);
+}
+
+// Ends a chain at `cluster`, releasing the clusters after it if asked to
+void fsck_cut(Fsck* check, ClusterLocation cluster, uint8_t release) {
+	FsckFix fix;
+	memset(&fix, 0, sizeof(FsckFix));
+	fix.kind = FIX_CUT;
+	fix.flag = release;
+	fix.cluster = cluster;
+	fsck_fix(check, &fix);
+}
+
+// Takes over `path`
+void fsck_queue(Fsck* check, ClusterLocation cluster, uint32_t length, uint8_t* path) {
+	fsck_lock(check);
+	if(check->queued == check->queue_capacity) {
+		uint32_t capacity = check->queue_capacity ? check->queue_capacity * 2 : CHAIN_INITIAL;
+		FsckWork* queue = realloc(check->queue, capacity * sizeof(FsckWork));
+		if(queue != NULL) {
+			check->queue = queue;
+			check->queue_capacity = capacity;
+		}
+	}
+	if(check->queued != check->queue_capacity) {
+		FsckWork work = { cluster, length, path };
+		check->queue[check->queued++] = work;
+		check->pending++;
+#ifdef FS_THREADS
+		pthread_cond_signal(&check->wake);
+#endif
+	} else {
+		check->out_of_memory = 1;
+		free(path);
+	}
+	fsck_unlock(check);
+}
+
+uint8_t fsck_claim(Fsck* check, ClusterLocation cluster) {
+	uint64_t* word = &check->visited[cluster / MAP_WORD_BITS];
+	uint64_t bit = (uint64_t) 1 << (cluster % MAP_WORD_BITS);
+#if defined(__GNUC__)
+	return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+#else
+	uint8_t ret = !(*word & bit);
+	*word |= bit;
+	return ret;
+#endif
+}
+
+uint8_t fsck_claimed(Fsck* check, ClusterLocation cluster) {
+	return check->visited[cluster / MAP_WORD_BITS] >> (cluster % MAP_WORD_BITS) & 1;
+}
+
+// Counts the rest of a chain that another walk has claimed
+uint8_t fsck_follow(Fsck* check, ClusterLocation cluster, uint32_t* length, ClusterLocation* last) {
+	FileSystem* fs = check->fs;
+	for(ClusterLocation steps = 0; steps != fs->clusters_count; steps++) {
+		if(cluster >= fs->clusters_count) {
+			return CHAIN_OUT_OF_RANGE;
+		}
+		if(fs->table_cache[cluster] == TV_EMPTY) {
+			return CHAIN_FREE;
+		}
+		(*length)++;
+		*last = cluster;
+		if(fs->table_cache[cluster] == TV_FINAL) {
+			return CHAIN_OK;
+		}
+		cluster = fs->table_cache[cluster];
+	}
+	return CHAIN_CYCLE;
+}
+
+// Sharing is recorded by the link counts on disk, while `refs` is only what
+// the FAT says now. A link beyond the stored count is a cross-link.
+uint8_t fsck_shared(Fsck* check, ClusterLocation cluster) {
+	return check->links != NULL && check->links[cluster] > 1 && check->fs->refs[cluster] <= check->links[cluster];
+}
+
+// Claims the clusters of a chain. Stops before the first cluster that is
+// outside the volume, free or already claimed, and says which it was.
+// `length` and `last` describe the good part of the chain. File chains may
+// end in a tail shared with other files. The walk that gets there second
+// only counts the rest, which the first one checks.
+uint8_t fsck_walk(Fsck* check, ClusterLocation first, uint32_t* length, ClusterLocation* last, uint8_t shareable) {
+	FileSystem* fs = check->fs;
+	ClusterLocation cluster = first;
+	*length = 0;
+	*last = TV_FINAL;
+	while(1) {
+		if(cluster >= fs->clusters_count) {
+			return CHAIN_OUT_OF_RANGE;
+		}
+		if(fs->table_cache[cluster] == TV_EMPTY) {
+			return CHAIN_FREE;
+		}
+		if(!fsck_claim(check, cluster)) {
+			if(shareable && *length != 0 && fsck_shared(check, cluster)) {
+				return fsck_follow(check, cluster, length, last);
+			}
+			ClusterLocation c = first;
+			for(uint32_t i = 0; i != *length; i++, c = fs->table_cache[c]) {
+				if(c == cluster) {
+					return CHAIN_CYCLE;
+				}
+			}
+			return CHAIN_CROSS_LINKED;
+		}
+		(*length)++;
+		*last = cluster;
+		if(fs->table_cache[cluster] == TV_FINAL) {
+			return CHAIN_OK;
+		}
+		cluster = fs->table_cache[cluster];
+		stat_add(&fs->stats.fat_hops, 1);
+	}
+}
+
+// Checks an entry's name, chain and recorded size, and queues the folders.
+// Returns 1 if the name had to be changed.
+uint8_t fsck_entry(Fsck* check, uint8_t* path, uint8_t* meta, ClusterLocation cluster, ClusterOffset offset) {
+	FileSystem* fs = check->fs;
+	FsckFix fix;
+	memset(&fix, 0, sizeof(FsckFix));
+	fix.kind = FIX_ENTRY;
+	fix.cluster = cluster;
+	fix.offset = offset;
+	memcpy(fix.meta, meta, FILE_META);
+	size_t buffer = meta_is_v2(meta) ? V2_NAME_BUFFER : FILE_NAME_BUFFER;
+	uint8_t* child = malloc(strlen(path) + FILE_NAME_BUFFER + 2);
+	if(child == NULL) {
+		check->out_of_memory = 1;
+		return 0;
+	}
+	sprintf(child, "%s/%.*s", path, (int) (buffer - 1), meta + OFFSET_NAME);
+	uint8_t renamed = strnlen(meta + OFFSET_NAME, buffer) == buffer;
+	if(renamed) {
+		fsck_problem(check, child, 1, "name is not terminated");
+		fix.meta[OFFSET_NAME + buffer - 1] = 0;
+	}
+	if(read_u16(meta + OFFSET_SIZE) == FS_INDEX) {
+		fsck_problem(check, child, 0, "index header in the middle of the directory");
+		free(child);
+		return renamed;
+	}
+	if(meta_is_inline(meta)) {
+		stat_add(&check->files, 1);
+		uint16_t tag = read_u16(meta + OFFSET_SIZE);
+		if(tag & FLAG_FOLDER) {
+			fsck_problem(check, child, 1, "directory is marked inline");
+			write_u16(fix.meta + OFFSET_SIZE, tag & ~FLAG_FOLDER);
+		}
+		ClusterOffset capacity = inline_capacity(fix.meta);
+		if(read_u16(meta + OFFSET_CLUSTER) > capacity) {
+			fsck_problem(check, child, 1, "inline size %u is larger than the entry", read_u16(meta + OFFSET_CLUSTER));
+			write_u16(fix.meta + OFFSET_CLUSTER, capacity);
+		}
+		if(memcmp(fix.meta, meta, FILE_META) != 0) {
+			fsck_fix(check, &fix);
+		}
+		free(child);
+		return renamed;
+	}
+
+	DirEntry entry;
+	memcpy(entry.meta, meta, FILE_META);
+	uint8_t folder = is_folder(&entry);
+	uint32_t length;
+	ClusterLocation last;
+	uint8_t status = fsck_walk(check, get_cluster(&entry), &length, &last, !folder);
+	if(status != CHAIN_OK) {
+		fsck_problem(check, child, 1, "%s chain %s after %u clusters", folder ? "directory" : "file", CHAIN_PROBLEMS[status], length);
+		if(length == 0) {
+			fix.kind = FIX_RESET;
+			fix.flag = folder;
+			fsck_fix(check, &fix);
+			free(child);
+			return renamed;
+		}
+		fsck_cut(check, last, 0);
+	}
+	if(folder) {
+		stat_add(&check->directories, 1);
+		fsck_queue(check, get_cluster(&entry), length, child);
+		child = NULL;
+	} else if(is_v2(&entry)) {
+		stat_add(&check->files, 1);
+		uint32_t clusters = read_u32(meta + OFFSET_V2_CLUSTERS);
+		ClusterLocation tail = read_u32(meta + OFFSET_V2_LAST);
+		FileCursor size = read_u64(meta + OFFSET_V2_SIZE);
+		if(clusters != length || tail != last) {
+			fsck_problem(check, child, 1, "entry records %u clusters ending at %u, the chain has %u ending at %u", clusters, tail, length, last);
+			write_u32(fix.meta + OFFSET_V2_CLUSTERS, length);
+			write_u32(fix.meta + OFFSET_V2_LAST, last);
+		}
+		FileCursor smallest = (FileCursor) (length - 1) * fs->cluster_size;
+		if(!is_compressed(&entry) && !is_sparse(&entry) && (size < smallest || size > smallest + fs->cluster_size)) {
+			fsck_problem(check, child, 1, "size %llu does not fit %u clusters", (unsigned long long) size, length);
+			write_u64(fix.meta + OFFSET_V2_SIZE, size < smallest ? smallest : smallest + fs->cluster_size);
+		}
+	} else {
+		stat_add(&check->files, 1);
+		if(get_meta_size(&entry) > fs->cluster_size) {
+			fsck_problem(check, child, 1, "size %u is larger than a cluster", get_meta_size(&entry));
+			write_u16(fix.meta + OFFSET_SIZE, fs->cluster_size);
+		}
+	}
+	if(memcmp(fix.meta, meta, FILE_META) != 0) {
+		fsck_fix(check, &fix);
+	}
+	free(child);
+	return renamed;
+}
+
+// Checks the header and the hash table of an indexed directory. `tags` holds
+// the name tag of every entry by ordinal.
+void fsck_index(Fsck* check, FsckWork* work, DirIndex* index, uint32_t entries, uint16_t* tags, uint8_t renamed) {
+	FileSystem* fs = check->fs;
+	uint32_t needed = (entries + fs->files_per_cluster - 1) / fs->files_per_cluster;
+	if(work->length > needed) {
+		fsck_problem(check, work->path, 1, "%u clusters past the last entry", work->length - needed);
+		fsck_cut(check, chain_at(fs, work->cluster, needed - 1), 1);
+	}
+	uint32_t length;
+	ClusterLocation last;
+	uint8_t status = fsck_walk(check, index->first, &length, &last, 0);
+	if(status != CHAIN_OK) {
+		fsck_problem(check, work->path, length != 0, "index chain %s after %u clusters", CHAIN_PROBLEMS[status], length);
+		if(length == 0) {
+			return;
+		}
+		fsck_cut(check, last, 0);
+	}
+	uint8_t damaged = renamed || status != CHAIN_OK || length != index->clusters || index->count != entries;
+	if(!damaged) {
+		uint32_t slots = index_slots(fs, index);
+		uint8_t* table = malloc((size_t) slots * INDEX_SLOT);
+		uint8_t* seen = calloc(entries, 1);
+		if(table == NULL || seen == NULL) {
+			free(table);
+			free(seen);
+			check->out_of_memory = 1;
+			return;
+		}
+		ClusterLocation c = index->first;
+		for(uint32_t i = 0; i != index->clusters; i++, c = fs->table_cache[c]) {
+			cache_read(fs, c, 0, table + (size_t) i * fs->cluster_size, fs->cluster_size);
+		}
+		uint32_t used = 0;
+		for(uint32_t position = 0; position != slots && !damaged; position++) {
+			uint32_t value = read_u32(table + position * INDEX_SLOT);
+			if(value == 0) {
+				continue;
+			}
+			used++;
+			uint16_t ordinal = value & 0xFFFF;
+			if(ordinal == 0 || ordinal >= entries || seen[ordinal] || tags[ordinal] != value >> 16) {
+				damaged = 1;
+				break;
+			}
+			seen[ordinal] = 1;
+			// Lookups stop at the first empty slot after the home one
+			for(uint32_t probe = index_home(fs, index, value >> 16); probe != position; probe = (probe + 1) % slots) {
+				if(read_u32(table + probe * INDEX_SLOT) == 0) {
+					damaged = 1;
+					break;
+				}
+			}
+		}
+		damaged |= used != entries - 1;
+		free(table);
+		free(seen);
+	}
+	if(damaged) {
+		uint16_t clusters = min(length, index->clusters);
+		uint8_t repairable = entries <= UINT16_MAX && clusters != 0 && entries < (uint32_t) clusters * fs->slots_per_cluster;
+		fsck_problem(check, work->path, repairable, "index does not match the %u entries", entries - 1);
+		if(length > index->clusters && index->clusters != 0) {
+			fsck_cut(check, chain_at(fs, index->first, index->clusters - 1), 1);
+		}
+		if(repairable) {
+			FsckFix rebuild;
+			memset(&rebuild, 0, sizeof(FsckFix));
+			rebuild.kind = FIX_INDEX;
+			rebuild.cluster = work->cluster;
+			rebuild.count = entries;
+			rebuild.clusters = clusters;
+			fsck_fix(check, &rebuild);
+		}
+	}
+}
+
+// Checks the entries of a directory. Entries after the first empty one can't
+// be reached and are cleared by the repair.
+void fsck_directory(Fsck* check, FsckWork* work, uint8_t* buffer) {
+	FileSystem* fs = check->fs;
+	DirIndex index;
+	uint8_t indexed = load_index(fs, work->cluster, &index);
+	uint16_t* tags = NULL;
+	if(indexed) {
+		tags = malloc(((size_t) work->length * fs->files_per_cluster) * sizeof(uint16_t));
+		if(tags == NULL) {
+			check->out_of_memory = 1;
+			return;
+		}
+	}
+	uint32_t entries = 0;
+	uint32_t strays = 0;
+	uint8_t ended = 0;
+	uint8_t renamed = 0;
+	ClusterLocation cluster = work->cluster;
+	for(uint32_t i = 0; i != work->length; i++, cluster = fs->table_cache[cluster]) {
+		cache_read(fs, cluster, 0, buffer, fs->cluster_size);
+		for(ClusterOffset offset = 0; offset != fs->cluster_size; offset += FILE_META) {
+			uint8_t* meta = buffer + offset;
+			if(indexed && entries == 0) {
+				entries++;
+				continue;
+			}
+			if(meta[OFFSET_NAME] == 0) { // Empty file name
+				ended = 1;
+				continue;
+			}
+			if(ended) {
+				FsckFix clear;
+				memset(&clear, 0, sizeof(FsckFix));
+				clear.kind = FIX_ENTRY;
+				clear.cluster = cluster;
+				clear.offset = offset;
+				fsck_fix(check, &clear);
+				strays++;
+				continue;
+			}
+			if(indexed) {
+				tags[entries] = name_hash(meta + OFFSET_NAME) >> 16;
+			}
+			entries++;
+			renamed |= fsck_entry(check, work->path, meta, cluster, offset);
+		}
+	}
+	if(strays != 0) {
+		fsck_problem(check, work->path, 1, "%u entries after the end of the directory", strays);
+	}
+	if(indexed) {
+		fsck_index(check, work, &index, entries, tags, renamed);
+	}
+	free(tags);
+}
+
+// Worker loop: checks directories until none are queued or being checked
+void fsck_run(Fsck* check) {
+	uint8_t* buffer = malloc(check->fs->cluster_size);
+	if(buffer == NULL) {
+		check->out_of_memory = 1;
+		return;
+	}
+	fsck_lock(check);
+	while(1) {
+#ifdef FS_THREADS
+		while(check->queued == 0 && check->pending != 0) {
+			pthread_cond_wait(&check->wake, &check->mutex);
+		}
+#endif
+		if(check->queued == 0) {
+			break;
+		}
+		FsckWork work = check->queue[--check->queued];
+		fsck_unlock(check);
+		fsck_directory(check, &work, buffer);
+		free(work.path);
+		fsck_lock(check);
+		if(--check->pending == 0) {
+#ifdef FS_THREADS
+			pthread_cond_broadcast(&check->wake);
+#endif
+		}
+	}
+	fsck_unlock(check);
+	free(buffer);
+}
+
+#ifdef FS_THREADS
+void* fsck_thread(void* argument) {
+	fsck_run(argument);
+	return NULL;
+}
+#endif
+
+// Clusters in use that no entry reaches, and disagreements with the free map
+void fsck_space(Fsck* check) {
+	FileSystem* fs = check->fs;
+	uint32_t orphans = 0;
+	uint32_t mismatched = 0;
+	uint32_t miscounted = 0;
+	for(ClusterLocation c = 0; c < fs->clusters_count; c++) {
+		uint8_t taken = fs->table_cache[c] != TV_EMPTY;
+		orphans += taken && !fsck_claimed(check, c);
+		mismatched += taken == is_free(fs, c);
+		miscounted += check->links != NULL && check->links[c] != fs->refs[c];
+	}
+	if(orphans != 0) {
+		fsck_problem(check, "", 1, "%u clusters are in use but not reachable", orphans);
+	}
+	if(mismatched != 0) {
+		fsck_problem(check, "", 1, "free map disagrees with the FAT on %u clusters", mismatched);
+	}
+	if(miscounted != 0) {
+		fsck_problem(check, "", 1, "link counts disagree with the FAT on %u clusters", miscounted);
+	}
+	if(!check->repair) {
+		return;
+	}
+	// Rewritten from `refs` by the commit after the repairs
+	for(ClusterLocation c = 0; miscounted != 0 && c < fs->clusters_count; c += FAT_PAGE) {
+		journal_page(fs, fs->journal.refs_log, c);
+	}
+	if(mismatched != 0) {
+		free(fs->free_map.used);
+		free(fs->free_map.full);
+		if(free_map_build(fs)) {
+			check->out_of_memory = 1;
+			return;
+		}
+	}
+	for(ClusterLocation c = 0; orphans != 0 && c < fs->clusters_count; c++) {
+		if(fs->table_cache[c] != TV_EMPTY && !fsck_claimed(check, c)) {
+			release(fs, c);
+		}
+	}
+}
+
+// Gives an entry whose chain is unusable from the start an empty one. Files
+// that can be rewritten as version 2 entries become empty inline files.
+Result fsck_reset(FileSystem* fs, FsckFix* fix) {
+	DirEntry entry;
+	memcpy(entry.meta, fix->meta, FILE_META);
+	uint8_t name[FILE_NAME_BUFFER];
+	memcpy(name, get_file_name(&entry), FILE_NAME_BUFFER);
+	init_meta(&entry, fix->flag, name);
+	if(!is_inline(&entry)) {
+		ClusterLocation first = allocate(fs);
+		if(first == TV_CANT_ALLOC) {
+			return 1;
+		}
+		set_cluster(&entry, first);
+		if(fix->flag) {
+			init_directory(fs, first);
+		} else { // File contents are not journaled
+			CacheSlot* slot = cache_get(fs, first, 0);
+			memset(slot->data, 0, fs->cluster_size);
+			slot->dirty = 1;
+		}
+	}
+	memcpy(fix->meta, entry.meta, FILE_META);
+	return 0;
+}
+
+// Entries first, then the chains, so that a cleared entry is not written into
+// a released cluster, and the indexes last, as they are rebuilt from the entries
+void fsck_repair(Fsck* check) {
+	FileSystem* fs = check->fs;
+	for(uint32_t i = 0; i != check->fix_count; i++) {
+		FsckFix* fix = &check->fixes[i];
+		if(fix->kind == FIX_RESET && fsck_reset(fs, fix)) {
+			check->unrepaired++;
+			continue;
+		}
+		if(fix->kind == FIX_ENTRY || fix->kind == FIX_RESET) {
+			CacheSlot* slot = cache_get(fs, fix->cluster, 1);
+			memcpy(slot->data + fix->offset, fix->meta, FILE_META);
+			cache_mark(fs, slot, fix->offset, FILE_META);
+		}
+	}
+	for(uint32_t i = 0; i != check->fix_count; i++) {
+		FsckFix* fix = &check->fixes[i];
+		if(fix->kind == FIX_CUT) {
+			ClusterLocation next = fs->table_cache[fix->cluster];
+			set_next(fs, fix->cluster, TV_FINAL);
+			if(fix->flag && next != TV_FINAL) {
+				free_chain(fs, next);
+			}
+		}
+	}
+	for(uint32_t i = 0; i != check->fix_count; i++) {
+		FsckFix* fix = &check->fixes[i];
+		DirIndex index;
+		if(fix->kind == FIX_INDEX && load_index(fs, fix->cluster, &index)) {
+			index.count = fix->count;
+			index.clusters = fix->clusters;
+			index_rebuild(fs, &index);
+		}
+	}
+	dentry_clear(fs);
+	journal_commit(fs);
+}
+
+// Checks the whole volume with `threads` workers, the calling thread being
+// one of them, and repairs what it can if asked to. Runs under the exclusive
+// lock, so no file may be open.
+Result check_volume(FileSystem* fs, Fsck* check, uint8_t repair, uint32_t threads) {
+	memset(check, 0, sizeof(Fsck));
+	check->fs = fs;
+	check->repair = repair;
+	fs_lock_exclusive(fs);
+	journal_commit(fs); // Clusters freed since the last commit are free in the map afterwards
+	check->visited = calloc(fs->free_map.words, sizeof(uint64_t));
+	if(fs->refs_offset != 0) {
+		journal_checkpoint(fs); // The stored counts are read from their home
+		check->links = malloc((size_t) fs->clusters_count * sizeof(uint32_t));
+		if(check->links != NULL) {
+			io_read(fs, fs->refs_offset, (uint8_t*) check->links, (size_t) fs->clusters_count * sizeof(uint32_t));
+		}
+	}
+	if(check->visited == NULL || (fs->refs_offset != 0 && check->links == NULL) || fsck_locks_init(check)) {
+		free(check->visited);
+		free(check->links);
+		check->out_of_memory = 1;
+		fs_unlock(fs);
+		return 0;
+	}
+
+	uint32_t length;
+	ClusterLocation last;
+	uint8_t status = fsck_walk(check, 0, &length, &last, 0);
+	if(status != CHAIN_OK) {
+		fsck_problem(check, "", length != 0, "root directory chain %s after %u clusters", CHAIN_PROBLEMS[status], length);
+		if(length != 0) {
+			fsck_cut(check, last, 0);
+		}
+	}
+	uint8_t* root = calloc(1, 1);
+	if(length != 0 && root != NULL) {
+		stat_add(&check->directories, 1);
+		fsck_queue(check, 0, length, root);
+	} else {
+		free(root);
+	}
+
+#ifdef FS_THREADS
+	pthread_t* handles = calloc(threads, sizeof(pthread_t));
+	uint32_t started = 0;
+	while(handles != NULL && started + 1 < threads && pthread_create(&handles[started], NULL, fsck_thread, check) == 0) {
+		started++;
+	}
+	fsck_run(check);
+	for(uint32_t t = 0; t != started; t++) {
+		pthread_join(handles[t], NULL);
+	}
+	free(handles);
+#else
+	fsck_run(check);
+#endif
+	// Left over if a worker ran out of memory
+	for(uint32_t i = 0; i != check->queued; i++) {
+		free(check->queue[i].path);
+	}
+	if(!check->out_of_memory && !fs_error(fs)) {
+		fsck_space(check);
+		if(repair) {
+			fsck_repair(check);
+		}
+	}
+	fsck_locks_destroy(check);
+	free(check->visited);
+	free(check->links);
+	free(check->queue);
+	free(check->fixes);
+	fs_unlock(fs);
+	return fs_error(fs);
+}
+
+// Files sort by the share of their cluster links that jump, then by extents
+int defrag_order(const void* left, const void* right) {
+	const DefragFile* a = left;
+	const DefragFile* b = right;
+	uint64_t share_a = (uint64_t) (a->extents - 1) * (b->clusters - 1);
+	uint64_t share_b = (uint64_t) (b->extents - 1) * (a->clusters - 1);
+	if(share_a != share_b) {
+		return share_a > share_b ? -1 : 1;
+	}
+	return a->extents == b->extents ? 0 : a->extents > b->extents ? -1 : 1;
+}
+
+// Collects the files that have more than one extent and sums up the links
+// of all chains for the fragmentation score
+Result defrag_scan(FileSystem* fs, DefragReport* report, DefragFile** files, uint32_t* count) {
+	uint32_t capacity = 0;
+	uint32_t stack_size = 1;
+	uint32_t stack_capacity = CHAIN_INITIAL;
+	ClusterLocation* stack = malloc(stack_capacity * sizeof(ClusterLocation));
+	if(stack == NULL) {
+		return 1;
+	}
+	stack[0] = 0;
+	*files = NULL;
+	*count = 0;
+	while(stack_size != 0) {
+		DirCursor directory = { stack[--stack_size] };
+		DirIter iter;
+		DirEntry entry;
+		dir_iter(fs, &directory, &iter);
+		while(dir_iter_step(fs, &iter, &entry) == OPTIONAL_OK) {
+			if(is_folder(&entry)) {
+				if(stack_size == stack_capacity) {
+					ClusterLocation* grown = realloc(stack, stack_capacity * 2 * sizeof(ClusterLocation));
+					if(grown == NULL) {
+						free(stack);
+						return 1;
+					}
+					stack = grown;
+					stack_capacity *= 2;
+				}
+				stack[stack_size++] = get_cluster(&entry);
+				continue;
+			}
+			if(is_inline(&entry)) {
+				continue;
+			}
+			DefragFile file = { entry.current_cluster, entry.current_offset, get_cluster(&entry), 0, 0 };
+			chain_extents(fs, file.first, &file.clusters, &file.extents);
+			report->links += file.clusters - 1;
+			report->jumps_before += file.extents - 1;
+			if(file.extents == 1 || chain_shared(fs, file.first)) { // Moving a shared tail would copy it
+				continue;
+			}
+			if(*count == capacity) {
+				capacity = capacity ? capacity * 2 : CHAIN_INITIAL;
+				DefragFile* grown = realloc(*files, capacity * sizeof(DefragFile));
+				if(grown == NULL) {
+					free(stack);
+					return 1;
+				}
+				*files = grown;
+			}
+			(*files)[(*count)++] = file;
+		}
+	}
+	free(stack);
+	return 0;
+}
+
+// Moves a file into one free run. The data reaches the disk before the FAT
+// and the entry point at the copy, so after a crash the file is either in its
+// old chain or fully in the new one.
+OptionalResult defrag_file(FileSystem* fs, DefragFile* file, uint8_t* buffer, uint32_t buffer_clusters) {
+	uint32_t length;
+	ClusterLocation start = find_free_run(fs, fs->free_map.hint, file->clusters, &length);
+	if(start == TV_CANT_ALLOC || length != file->clusters) {
+		return OPTIONAL_STRUCTURE_ERROR;
+	}
+	ClusterLocation cluster = file->first;
+	for(uint32_t done = 0; done != file->clusters; ) {
+		// One extent of the old chain at a time, as far as the buffer allows
+		ClusterLocation from = cluster;
+		uint32_t count = 0;
+		do {
+			cache_writeback(fs, cluster);
+			cluster = fs->table_cache[cluster];
+			count++;
+		} while(count != buffer_clusters && done + count != file->clusters && cluster == from + count);
+		io_read(fs, cluster_offset(fs, from), buffer, (size_t) count * fs->cluster_size);
+		io_write(fs, cluster_offset(fs, start + done), buffer, (size_t) count * fs->cluster_size);
+		done += count;
+	}
+	if(fs->journal.size != 0) {
+		io_sync(fs, cluster_offset(fs, start), (uint64_t) file->clusters * fs->cluster_size);
+	}
+	if(fs_error(fs)) {
+		return OPTIONAL_IO_ERROR;
+	}
+	for(uint32_t i = 0; i != file->clusters; i++) {
+		set_next(fs, start + i, i + 1 == file->clusters ? TV_FINAL : start + i + 1);
+		mark_used(fs, start + i);
+	}
+	stat_add(&fs->stats.allocations, file->clusters);
+	CacheSlot* slot = cache_get(fs, file->entry_cluster, 1);
+	uint8_t* meta = slot->data + file->entry_offset;
+	write_u16(meta + OFFSET_CLUSTER, start);
+	if(meta_is_v2(meta)) {
+		write_u32(meta + OFFSET_V2_FIRST, start);
+		write_u32(meta + OFFSET_V2_LAST, start + file->clusters - 1);
+	}
+	cache_mark(fs, slot, file->entry_offset, FILE_META);
+	free_chain(fs, file->first);
+	journal_operation(fs);
+	return fs_error(fs) ? OPTIONAL_IO_ERROR : OPTIONAL_OK;
+}
+
+// Rewrites the most fragmented files into contiguous runs until `budget`
+// microseconds have passed, so that a large volume is done over several
+// passes. Runs under the exclusive lock, so no file may be open.
+Result defrag_volume(FileSystem* fs, uint64_t budget, DefragReport* report) {
+	uint64_t deadline = now_us() + budget;
+	memset(report, 0, sizeof(DefragReport));
+	fs_lock_exclusive(fs);
+	DefragFile* files;
+	uint32_t count;
+	uint32_t buffer_clusters = max(STREAM_BUFFER / fs->cluster_size, 1);
+	uint8_t* buffer = malloc((size_t) buffer_clusters * fs->cluster_size);
+	if(buffer == NULL || defrag_scan(fs, report, &files, &count)) {
+		free(buffer);
+		report->out_of_memory = 1;
+		fs_unlock(fs);
+		return 0;
+	}
+	report->fragmented = count;
+	report->jumps_after = report->jumps_before;
+	if(count != 0) {
+		qsort(files, count, sizeof(DefragFile), defrag_order);
+	}
+	for(uint32_t i = 0; i != count && !fs_error(fs); i++) {
+		if(now_us() >= deadline) {
+			report->left = count - i;
+			break;
+		}
+		if(defrag_file(fs, &files[i], buffer, buffer_clusters) == OPTIONAL_OK) {
+			report->moved++;
+			report->moved_clusters += files[i].clusters;
+			report->jumps_after -= files[i].extents - 1;
+			dentry_clear(fs);
+		} else {
+			report->no_room++;
+		}
+	}
+	journal_commit(fs);
+	free(files);
+	free(buffer);
+	fs_unlock(fs);
+	return fs_error(fs);
+}
+
+void flush_volume(FileSystem* fs) {
+	if(fs->journal.size != 0) {
+		journal_commit(fs);
+		cache_flush(fs);
+		journal_checkpoint(fs);
+		io_sync(fs, 0, UINT64_MAX);
+		return;
+	}
+	store_table(fs);
+#ifdef FS_MMAP
+	if(fs->backend == BACKEND_MMAP) {
+		if(msync(fs->map, fs->map_size, MS_SYNC)) {
+			fs->io_error = 1;
+		}
+		return;
+	}
+#endif
+	cache_flush(fs);
+	fflush(fs->file);
+}
+
+Result sync_fs_file(FileSystem* fs) {
+	fs_lock_exclusive(fs);
+	flush_volume(fs);
+	fs_unlock(fs);
+	return fs_error(fs);
+}
+
+Result close_fs_file(FileSystem* fs) {
+	Result ret = sync_fs_file(fs);
+	locks_destroy(fs);
+	if(!table_in_map(fs)) {
+		free(fs->table_cache);
+	}
+#ifdef FS_MMAP
+	if(fs->backend == BACKEND_MMAP) {
+		munmap(fs->map, fs->map_size);
+	}
+#endif
+#ifdef FS_URING
+	if(fs->backend == BACKEND_URING) {
+		uring_close(&fs->uring);
+	}
+#endif
+	free(fs->free_map.used);
+	free(fs->free_map.full);
+	free(fs->refs);
+	dedup_free(fs);
+	free(fs->journal.fat_log);
+	free(fs->journal.refs_log);
+	free(fs->journal.logged);
+	free(fs->journal.held);
+	free(fs->journal.freed);
+	free(fs->cache.slots);
+	free(fs->cache.buckets);
+	free(fs->cache.data);
+	dentry_free(fs);
+	return fclose(fs->file) != 0 || ret;
+}
+
+// Prints a message and makes it the outcome of the current command
+void report(const uint8_t* message) {
+	if (message == MESSAGE_IO_ERROR) {
+		command_status = STATUS_IO_ERROR;
+	} else if (message == MESSAGE_UNKNOWN_COMMAND) {
+		command_status = STATUS_UNKNOWN_COMMAND;
+	} else {
+		command_status = STATUS_FAILED;
+	}
+	printf(message);
+}
+
+void string_to_lower(uint8_t *string) {
+	for(uint8_t *p = string; *p; ++p)
+		*p = *p > 0x40 && *p < 0x5b ? *p | 0x60 : *p;
+}
+
+void split(uint8_t* before, uint8_t** after, uint8_t delimiter) {
+	uint8_t* p = before;
+	while(1) {
+		if(*p == '\0') {
+			*after = p;
+			break;
+		}
+		if(*p == delimiter) {
+			*p = '\0';
+			*after = p+1;
+			break;
+		}
+		p++;
+	}
+}
+
+void init_table() {
+	for (uint16_t c = 0; c != 256; c++) {
+		LUT[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-';
+	}
+}
+
+void trim_untill_newline(uint8_t *string) {
+	while(*string) {
+		if (*string == '\n') {
+			*string = '\0';
+			break;
+		}
+		string++;
+	}
+}
+
+uint8_t valid_filename(FileSystem* fs, uint8_t* filename) {
+	// TODO: forbid ..
+	if (strlen(filename) > (long_names_allowed(fs) ? MAX_FILE_NAME : MAX_V2_NAME)) {
+		return 0;
+	}
+	while(*filename) {
+		if (!LUT[*(filename++)]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// valid_filename() that tells the user what is wrong
+Result verify_filename(FileSystem* fs, uint8_t* filename) {
+	if (valid_filename(fs, filename)) {
+		return 0;
+	}
+	if (strlen(filename) > MAX_FILE_NAME) {
+		report(MESSAGE_FILENAME_IS_LONG);
+	} else if (strlen(filename) > MAX_V2_NAME) {
+		report(MESSAGE_FILENAME_NEEDS_V2);
+	} else {
+		report(MESSAGE_FILENAME_ILLEGAL_SYMBOLS);
+	}
+	return 1;
+}
+
+// Decimal number with an optional K, M or G suffix
+Result parse_size(uint8_t* text, uint64_t* value) {
+	char* end;
+	errno = 0;
+	uint64_t ret = strtoull(text, &end, 10);
+	if(end == (char*) text || errno != 0) {
+		return 1;
+	}
+	switch(*end) {
+		case 'g': ret *= 1024; // Fall through
+		case 'm': ret *= 1024; // Fall through
+		case 'k': ret *= 1024; end++;
+	}
+	if(*end != '\0') {
+		return 1;
+	}
+	*value = ret;
+	return 0;
+}
+
+// init <path> [size] [cluster size] [backend] [stats], mount <path> [backend] [stats].
+// The backend is stdio, mmap or uring.
+// "stats" prints the statistics on exit. OPTIONAL_STRUCTURE_ERROR means that
+// the line was not understood.
+OptionalResult open_volume(uint8_t* line, FileSystem* fs, uint8_t* dump_stats) {
+	uint8_t* path;
+	uint8_t* arguments;
+	split(line, &path, ' ');
+	split(path, &arguments, ' ');
+	string_to_lower(line);
+	uint8_t backend = BACKEND_STDIO;
+	uint64_t geometry[2] = { FS_SIZE, DEFAULT_CLUSTER_SIZE };
+	uint8_t numbers = 0;
+	while(*arguments) {
+		uint8_t* argument = arguments;
+		split(argument, &arguments, ' ');
+		string_to_lower(argument);
+		if (strcmp(argument, "stdio") == 0) {
+			backend = BACKEND_STDIO;
+		} else if (strcmp(argument, "mmap") == 0) {
+			backend = BACKEND_MMAP;
+		} else if (strcmp(argument, "uring") == 0) {
+			backend = BACKEND_URING;
+		} else if (strcmp(argument, "stats") == 0) {
+			*dump_stats = 1;
+		} else if (isdigit(*argument)) {
+			if (numbers == 2 || parse_size(argument, &geometry[numbers++])) {
+				report(MESSAGE_BAD_GEOMETRY);
+				return OPTIONAL_STRUCTURE_ERROR;
+			}
+		} else {
+			report(MESSAGE_UNKNOWN_BACKEND);
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+	}
+	if (strcmp(line, "init") == 0) {
+		if (plan_geometry(fs, geometry[0], geometry[1])) {
+			report(MESSAGE_BAD_GEOMETRY);
+			return OPTIONAL_STRUCTURE_ERROR;
+		}
+		if (init_fs_file(fs, path, geometry[0], geometry[1], backend)) {
+			report(MESSAGE_FS_CANT_INIT);
 			return OPTIONAL_IO_ERROR;
 		}
-		file->offset = (file->offset + to_write) % CLUSTER_SIZE;
-		buffer += to_write;
-		size -= to_write;
-		if(fs->table_cache[file->current] == TV_FINAL && file->offset > file->metaFileSize) {
-			file->metaFileSize = file->offset;
+		return OPTIONAL_OK;
+	} else if (strcmp(line, "mount") == 0) {
+		if (numbers != 0) {
+			report(MESSAGE_BAD_GEOMETRY);
+			return OPTIONAL_STRUCTURE_ERROR;
 		}
-		if(to_write == left) {
-			// Выделять память под следующий блок, даже если нечего записывать
-			if(fs->table_cache[file->current] == TV_FINAL) {
-				file->metaFileSize = 0;
-				if(extend(fs, &file->current)) {
-					return OPTIONAL_STRUCTURE_ERROR;
-				}
-			} else {
-				file->current = fs->table_cache[file->current];
+		if (open_fs_file(fs, path, backend)) {
+			report(MESSAGE_FS_CANT_MOUNT);
+			return OPTIONAL_IO_ERROR;
+		}
+		return OPTIONAL_OK;
+	} else if (strcmp(line, "exit") == 0) {
+		return OPTIONAL_IO_ERROR;
+	}
+	report(MESSAGE_UNKNOWN_COMMAND);
+	return OPTIONAL_STRUCTURE_ERROR;
+}
+
+Result init_or_mount(uint8_t* input_buffer, FileSystem* fs, uint8_t* dump_stats) {
+	while(1) {
+		printf("init or mount?\n");
+		if (fgets(input_buffer, INPUT_BUFFER, stdin) == NULL) {
+			return 1;
+		}
+		trim_untill_newline(input_buffer);
+		switch (open_volume(input_buffer, fs, dump_stats)) {
+			case OPTIONAL_OK:
+				return 0;
+			case OPTIONAL_IO_ERROR:
+				return 1;
+		}
+	}
+}
+
+Result action_write(uint8_t* input_buffer, FILE* input, FileSystem* fs, DirCursor* dir, uint8_t* after_command) {
+	if(verify_filename(fs, after_command)) {
+		return 0;
+	}
+	uint8_t file_name[FILE_NAME_BUFFER];
+	memset(file_name, 0, FILE_NAME_BUFFER);
+	strcpy(file_name, after_command);
+	DirEntry file;
+	FileIO file_io;
+	switch (resolve(fs, dir, &file, file_name)) {
+		case OPTIONAL_OK:
+			if (is_folder(&file)) {
+				report(MESSAGE_IS_DIR);
+				return 0;
 			}
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			init_meta(&file, 0, file_name);
+			switch (create_file(fs, dir, &file)) {
+				case OPTIONAL_OK:
+					break;
+				case OPTIONAL_STRUCTURE_ERROR:
+					report(MESSAGE_OUT_OF_SPACE);
+					return 0;
+				case OPTIONAL_IO_ERROR:
+					report(MESSAGE_IO_ERROR);
+					return 1;
+			}
+			break;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	open_file(fs, &file, &file_io);
+	if (file_io.compressed && set_length(fs, &file_io, 0)) { // Compressed files are rewritten from the start
+		report(MESSAGE_IO_ERROR);
+		close_file(fs, &file_io);
+		return 1;
+	}
+	while (1) {
+		if (fgets(input_buffer, INPUT_BUFFER, input) == NULL || input_buffer[0] == '\n') {
+			break;
+		}
+		switch (write_to_file(fs, &file_io, input_buffer, strlen(input_buffer))) {
+			case OPTIONAL_OK:
+				break;
+			case OPTIONAL_STRUCTURE_ERROR:
+				report(MESSAGE_OUT_OF_SPACE);
+				goto close_file;
+			case OPTIONAL_IO_ERROR:
+				report(MESSAGE_IO_ERROR);
+				return 1;
+		}
+	}
+	close_file:;
+	if (close_file(fs, &file_io)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	return 0;
+}
+Result action_mkdir(FileSystem* fs, DirCursor* current_dir, uint8_t* dir_name) {
+	if(verify_filename(fs, dir_name)) {
+		return 0;
+	}
+	DirEntry directory;
+	uint8_t name_buffer[FILE_NAME_BUFFER];
+	memset(name_buffer, 0, FILE_NAME_BUFFER);
+	strcpy(name_buffer, dir_name);
+	switch (resolve(fs, current_dir, &directory, name_buffer)) {
+		case OPTIONAL_OK:
+			report(MESSAGE_FILE_ALREADY_EXISTS);
+			return 0;
+		case OPTIONAL_STRUCTURE_ERROR:
+			break;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	init_meta(&directory, 1, name_buffer);
+	switch (create_file(fs, current_dir, &directory)) {
+		case OPTIONAL_OK:
+			return 0;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_OUT_OF_SPACE);
+			return 0;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+}
+Result action_read(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name) {
+	DirEntry file;
+	uint8_t file_name_buffer[FILE_NAME_BUFFER];
+	memset(file_name_buffer, 0, FILE_NAME_BUFFER);
+	strcpy(file_name_buffer, file_name);
+	switch (resolve(fs, current_dir, &file, file_name_buffer)) {
+		case OPTIONAL_OK:
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_NOT_FOUND);
+			return 0;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	if (is_folder(&file)) {
+		report(MESSAGE_IS_DIR);
+		return 0;
+	}
+	FileIO file_io;
+	uint8_t* buffer = malloc(STREAM_BUFFER);
+	if (buffer == NULL) {
+		report(MESSAGE_OUT_OF_MEMORY);
+		return 0;
+	}
+	FileCursor size = get_file_size(fs, &file);
+	FileCursor counter = 0;
+	open_file(fs, &file, &file_io);
+	printf("File length: %llu.\nFile contents:\n", (unsigned long long) size);
+	while (counter < size) {
+		size_t to_read = min(STREAM_BUFFER-1, size - counter);
+		if (read_from_file(fs, &file_io, buffer, to_read)) {
+			free(buffer);
+			report(MESSAGE_IO_ERROR);
+			return 1;
+		}
+		buffer[to_read] = '\0';
+		printf("%s", buffer);
+		counter += to_read;
+	}
+	free(buffer);
+	if(close_file(fs, &file_io)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	return 0;
+}
+Result action_dir(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name) {
+	DirIter iter;
+	DirEntry entry;
+
+	dir_iter(fs, current_dir, &iter);
+
+	while (1) {
+		switch (dir_iter_next(fs, &iter, &entry)) {
+			case OPTIONAL_OK:
+				printf("%s - ", get_file_name(&entry));
+				if (is_folder(&entry)) {
+					printf("DIR\n");
+				} else {
+					printf("FILE - %llu bytes", (unsigned long long) get_file_size(fs, &entry));
+					if (is_sparse(&entry)) {
+						printf(", %llu allocated", (unsigned long long) get_allocated_size(fs, &entry));
+					}
+					printf("\n");
+				}
+				break;
+			case OPTIONAL_STRUCTURE_ERROR:
+				return 0;
+			case OPTIONAL_IO_ERROR:
+				report(MESSAGE_IO_ERROR);
+				return 1;
+		}
+	}
+}
+Result action_export(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+	uint8_t *internal = after_command;
+	uint8_t *external;
+	split(internal, &external, ' ');
+
+	uint8_t file_name[FILE_NAME_BUFFER];
+	memset(file_name, 0, FILE_NAME_BUFFER);
+	strcpy(file_name, internal);
+	DirEntry file;
+	switch (resolve(fs, current_dir, &file, file_name)) {
+		case OPTIONAL_OK:
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_NOT_FOUND);
+			return 0;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	FileIO internal_file;
+	FileCursor size = get_file_size(fs, &file);
+	FileCursor cursor = 0;
+	uint8_t* buffer = malloc(STREAM_BUFFER);
+	if (buffer == NULL) {
+		report(MESSAGE_OUT_OF_MEMORY);
+		return 0;
+	}
+	FILE *external_file = fopen(external, "wb");
+	if (external_file == NULL) {
+		free(buffer);
+		report(MESSAGE_IO_ERROR);
+		return 0;
+	}
+	open_file(fs, &file, &internal_file);
+	switch (transfer_file(fs, &internal_file, fileno(external_file), size, 0)) {
+		case OPTIONAL_OK:
+			cursor = size;
+			break;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			goto bad_exit;
+	}
+	while(cursor < size) {
+		size_t to_transfer = min(size - cursor, STREAM_BUFFER);
+		if (read_from_file(fs, &internal_file, buffer, to_transfer)) {
+			report(MESSAGE_IO_ERROR);
+			goto bad_exit;
+		}
+		fwrite(buffer, 1, to_transfer, external_file);
+		if (ferror(external_file)) {
+			report(MESSAGE_IO_ERROR);
+			goto bad_exit;
+		}
+		cursor += to_transfer;
+	}
+	free(buffer);
+	fclose(external_file);
+	if (close_file(fs, &internal_file)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	return 0;
+
+	bad_exit:
+	free(buffer);
+	fclose(external_file);
+	close_file(fs, &internal_file);
+	return 1;
+}
+// Copies a host file into `name` of the directory, creating the entry or
+// overwriting the file it names. OPTIONAL_STRUCTURE_ERROR means that the
+// entry can't be created or the volume is full, and OPTIONAL_UNSUPPORTED
+// that `name` is a directory.
+// `name` is a FILE_NAME_BUFFER. Several threads may import at once.
+OptionalResult import_host_file(FileSystem* fs, DirCursor* directory, uint8_t* name, char* path) {
+	DirEntry file;
+	FileIO internal_file;
+
+	OptionalResult ret = resolve(fs, directory, &file, name);
+	if (ret == OPTIONAL_OK && is_folder(&file)) {
+		return OPTIONAL_UNSUPPORTED;
+	}
+	if (ret == OPTIONAL_STRUCTURE_ERROR) {
+		init_meta(&file, 0, name);
+		ret = create_file(fs, directory, &file);
+	}
+	if (ret != OPTIONAL_OK) {
+		return ret;
+	}
+	FILE *external_file = fopen(path, "rb");
+	if (external_file == NULL || ferror(external_file)) {
+		if (external_file != NULL) {
+			fclose(external_file);
 		}
+		return OPTIONAL_IO_ERROR;
 	}
-	return OPTIONAL_OK;
-}
-
-// TODO: buffer?
-Result read_from_file(FileSystem* fs, FileIO* file, uint8_t* buffer, size_t size) {
-	while(1) {
-		if(size == 0) {
-			return 0;
+	open_file(fs, &file, &internal_file);
+	uint8_t* buffer = NULL;
+	FileCursor expected_size = host_file_length(external_file);
+	fseek(external_file, 0, SEEK_SET);
+	if (internal_file.compressed) {
+		if (set_length(fs, &internal_file, 0)) {
+			ret = OPTIONAL_IO_ERROR;
+			goto done;
 		}
-		ClusterLocation next = fs->table_cache[file->current];
-		ClusterOffset length = CLUSTER_SIZE;
-		if(next == TV_FINAL) {
-			length = min(length, file->metaFileSize);
+	} else if (fs->dedup.enabled && !internal_file.sparse && expected_size >= fs->cluster_size) {
+		ret = import_dedup(fs, &internal_file, external_file, expected_size);
+		goto done;
+	} else {
+		if (resize_file(fs, &internal_file, expected_size, 1)) {
+			ret = OPTIONAL_STRUCTURE_ERROR;
+			goto done;
 		}
-		ClusterOffset left = length - file->offset;
-		ClusterOffset to_read = min(size, left);
-		fseek(fs->file, ROOT_OFFSET + file->current * CLUSTER_SIZE + file->offset, SEEK_SET);
-		fread(buffer, 1, to_read, fs->file);
-		if(ferror(fs->file)) {
-			return 1;
+		if (expected_size == 0) { // Emptied, nothing to copy
+			goto done;
 		}
-		file->offset = (file->offset + to_read) % CLUSTER_SIZE;
-		buffer += to_read;
-		size -= to_read;
-		if(to_read == left) {
-			if(next == TV_FINAL) {
-				return 0;
-			}
-			file->current = next;
+		ret = transfer_file(fs, &internal_file, fileno(external_file), expected_size, 1);
+		if (ret != OPTIONAL_UNSUPPORTED) {
+			goto done;
+		}
+		ret = OPTIONAL_OK;
+	}
+	buffer = malloc(STREAM_BUFFER);
+	if (buffer == NULL) {
+		ret = OPTIONAL_IO_ERROR;
+		goto done;
+	}
+	while(!feof(external_file)) {
+		size_t read = fread(buffer, 1, STREAM_BUFFER, external_file);
+		if(ferror(external_file)) {
+			ret = OPTIONAL_IO_ERROR;
+			goto done;
+		}
+		ret = write_to_file(fs, &internal_file, buffer, read);
+		if(ret != OPTIONAL_OK) {
+			goto done;
 		}
 	}
-}
 
-Result close_file(FileSystem* fs, FileIO* file) {
-	uint8_t buffer[sizeof(ClusterOffset)];
-	write_u16(buffer, file->metaFileSize);
-	fseek(fs->file, file->metaFileSizeLocation, SEEK_SET);
-	fwrite(buffer, 1, sizeof(ClusterOffset), fs->file);
-	return ferror(fs->file);
+	done:
+	free(buffer);
+	fclose(external_file);
+	if (close_file(fs, &internal_file) && ret == OPTIONAL_OK) {
+		ret = OPTIONAL_IO_ERROR;
+	}
+	return ret;
 }
 
-void dir_iter(FileSystem* fs, DirCursor* current, DirIter* iter) {
-	iter->current_cluster = current->current_cluster;
-	iter->current_offset = 0;
-	read(fs, iter->current_cluster, iter->buffer);
+// Opens `name` of the directory as a directory, creating it if needed.
+// OPTIONAL_STRUCTURE_ERROR means that a file has the name or that there is
+// no space for the directory.
+OptionalResult import_folder(FileSystem* fs, DirCursor* directory, uint8_t* name, DirCursor* result) {
+	DirEntry entry;
+	OptionalResult ret = resolve(fs, directory, &entry, name);
+	if (ret == OPTIONAL_STRUCTURE_ERROR) {
+		init_meta(&entry, 1, name);
+		ret = create_file(fs, directory, &entry);
+	} else if (ret == OPTIONAL_OK && !is_folder(&entry)) {
+		ret = OPTIONAL_STRUCTURE_ERROR;
+	}
+	if (ret == OPTIONAL_OK) {
+		open_dir(fs, &entry, result);
+	}
+	return ret;
 }
 
-OptionalResult dir_iter_next(FileSystem* fs, DirIter* iter, DirEntry* next) {
-	if(iter->current_offset == CLUSTER_SIZE) {
-		if(fs->table_cache[iter->current_cluster] == TV_FINAL) {
-			return OPTIONAL_STRUCTURE_ERROR;
-		}
-		iter->current_cluster = fs->table_cache[iter->current_cluster];
-		read(fs, iter->current_cluster, iter->buffer);
-		if(ferror(fs->file)) {
-			return OPTIONAL_IO_ERROR;
+#ifdef FS_THREADS
+typedef struct {
+	DirCursor directory; // Where the entry goes, or the directory to fill
+	uint8_t name[FILE_NAME_BUFFER];
+	char* path;
+	FileCursor size;
+	uint8_t folder;
+} ImportWork;
+
+// State shared by the workers of a recursive import. A worker that takes a
+// host directory creates its subdirectories on the volume and queues its
+// entries, so that files are copied side by side. The volume serializes
+// allocation and directory updates itself.
+typedef struct {
+	FileSystem* fs;
+	ImportWork* queue;
+	uint32_t queued;
+	uint32_t queue_capacity;
+	uint32_t pending; // Work queued or being done
+	uint8_t out_of_memory;
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes;
+	uint64_t skipped; // Neither a file nor a directory, or a name the volume can't hold
+	uint64_t failed;
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+} ImportTree;
+
+// Takes over `work->path`
+void import_queue(ImportTree* tree, ImportWork* work) {
+	pthread_mutex_lock(&tree->mutex);
+	if(tree->queued == tree->queue_capacity) {
+		uint32_t capacity = tree->queue_capacity ? tree->queue_capacity * 2 : CHAIN_INITIAL;
+		ImportWork* queue = realloc(tree->queue, capacity * sizeof(ImportWork));
+		if(queue != NULL) {
+			tree->queue = queue;
+			tree->queue_capacity = capacity;
 		}
-		iter->current_offset = 0;
 	}
-	next->current_cluster = iter->current_cluster;
-	if (iter->buffer[iter->current_offset+OFFSET_NAME] == 0) { // Empty file name
-		return OPTIONAL_STRUCTURE_ERROR;
+	if(tree->queued != tree->queue_capacity) {
+		tree->queue[tree->queued++] = *work;
+		tree->pending++;
+		pthread_cond_signal(&tree->wake);
+	} else {
+		tree->out_of_memory = 1;
+		free(work->path);
 	}
-	memcpy(next->meta, iter->buffer+iter->current_offset, FILE_META);
-	next->current_cluster = iter->current_cluster;
-	next->current_offset = iter->current_offset;
-	iter->current_offset += FILE_META;
-	return OPTIONAL_OK;
-}
-
-Result close_fs_file(FileSystem* fs) {
-	fseek(fs->file, 0, SEEK_SET);
-	fwrite(fs->table_cache, 1, sizeof(fs->table_cache), fs->file);
-	fflush(fs->file);
-	fclose(fs->file);
-	return ferror(fs->file);
+	pthread_mutex_unlock(&tree->mutex);
 }
 
-void string_to_lower(uint8_t *string) {
-	for(uint8_t *p = string; *p; ++p)
-		*p = *p > 0x40 && *p < 0x5b ? *p | 0x60 : *p;
+void import_directory(ImportTree* tree, ImportWork* work) {
+	DIR* host = opendir(work->path);
+	if(host == NULL) {
+		stat_add(&tree->failed, 1);
+		return;
+	}
+	struct dirent* item;
+	while((item = readdir(host)) != NULL) {
+		if(strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+			continue;
+		}
+		size_t length = strlen(work->path) + strlen(item->d_name) + 2;
+		ImportWork child;
+		memset(&child, 0, sizeof(ImportWork));
+		child.path = malloc(length);
+		if(child.path == NULL) {
+			pthread_mutex_lock(&tree->mutex);
+			tree->out_of_memory = 1;
+			pthread_mutex_unlock(&tree->mutex);
+			break;
+		}
+		snprintf(child.path, length, "%s/%s", work->path, item->d_name);
+		struct stat info;
+		// Symbolic links are skipped, they could lead back up the tree
+		if(!valid_filename(tree->fs, item->d_name) || lstat(child.path, &info) != 0 || !(S_ISREG(info.st_mode) || S_ISDIR(info.st_mode))) {
+			stat_add(&tree->skipped, 1);
+			free(child.path);
+			continue;
+		}
+		strcpy(child.name, item->d_name);
+		child.directory = work->directory;
+		child.size = info.st_size;
+		child.folder = S_ISDIR(info.st_mode);
+		if(child.folder) {
+			if(import_folder(tree->fs, &work->directory, child.name, &child.directory) != OPTIONAL_OK) {
+				stat_add(&tree->failed, 1);
+				free(child.path);
+				continue;
+			}
+			stat_add(&tree->directories, 1);
+		}
+		import_queue(tree, &child);
+	}
+	closedir(host);
 }
 
-void split(uint8_t* before, uint8_t** after, uint8_t delimiter) {
-	uint8_t* p = before;
+void import_run(ImportTree* tree) {
+	pthread_mutex_lock(&tree->mutex);
 	while(1) {
-		if(*p == '\0') {
-			*after = p;
-			break;
+		while(tree->queued == 0 && tree->pending != 0) {
+			pthread_cond_wait(&tree->wake, &tree->mutex);
 		}
-		if(*p == delimiter) {
-			*p = '\0';
-			*after = p+1;
+		if(tree->queued == 0) {
 			break;
 		}
-		p++;
+		ImportWork work = tree->queue[--tree->queued];
+		pthread_mutex_unlock(&tree->mutex);
+		if(work.folder) {
+			import_directory(tree, &work);
+		} else if(import_host_file(tree->fs, &work.directory, work.name, work.path) == OPTIONAL_OK) {
+			stat_add(&tree->files, 1);
+			stat_add(&tree->bytes, work.size);
+		} else {
+			stat_add(&tree->failed, 1);
+		}
+		free(work.path);
+		pthread_mutex_lock(&tree->mutex);
+		if(--tree->pending == 0) {
+			pthread_cond_broadcast(&tree->wake);
+		}
 	}
+	pthread_mutex_unlock(&tree->mutex);
 }
 
-void init_table() {
-	for (uint16_t c = 0; c != 256; c++) {
-		LUT[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-';
-	}
+void* import_thread(void* argument) {
+	import_run(argument);
+	return NULL;
 }
+#endif
 
-void trim_untill_newline(uint8_t *string) {
-	while(*string) {
-		if (*string == '\n') {
-			*string = '\0';
+// import -r <host directory> <directory>: copies the tree into the directory,
+// which is created if needed, with IMPORT_THREADS workers
+Result action_import_tree(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+#ifdef FS_THREADS
+	uint8_t* host = after_command;
+	uint8_t* internal;
+	split(host, &internal, ' ');
+	if(*host == '\0' || *internal == '\0') {
+		report(MESSAGE_BAD_IMPORT);
+		return 0;
+	}
+	if(verify_filename(fs, internal)) {
+		return 0;
+	}
+	struct stat info;
+	if(stat(host, &info) != 0 || !S_ISDIR(info.st_mode)) {
+		report(MESSAGE_IS_NOT_DIR);
+		return 0;
+	}
+	ImportTree tree;
+	memset(&tree, 0, sizeof(ImportTree));
+	tree.fs = fs;
+	ImportWork root;
+	memset(&root, 0, sizeof(ImportWork));
+	strcpy(root.name, internal);
+	root.folder = 1;
+	switch (import_folder(fs, current_dir, root.name, &root.directory)) {
+		case OPTIONAL_OK:
 			break;
-		}
-		string++;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_IS_NOT_DIR);
+			return 0;
+		default:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	root.path = strdup(host);
+	if(root.path == NULL || pthread_mutex_init(&tree.mutex, NULL) != 0 || pthread_cond_init(&tree.wake, NULL) != 0) {
+		free(root.path);
+		report(MESSAGE_OUT_OF_MEMORY);
+		return 0;
+	}
+	import_queue(&tree, &root);
+	pthread_t handles[IMPORT_THREADS];
+	uint32_t started = 0;
+	while(started + 1 < IMPORT_THREADS && pthread_create(&handles[started], NULL, import_thread, &tree) == 0) {
+		started++;
 	}
+	import_run(&tree);
+	for(uint32_t t = 0; t != started; t++) {
+		pthread_join(handles[t], NULL);
+	}
+	// Left over if a worker ran out of memory
+	for(uint32_t i = 0; i != tree.queued; i++) {
+		free(tree.queue[i].path);
+	}
+	free(tree.queue);
+	pthread_mutex_destroy(&tree.mutex);
+	pthread_cond_destroy(&tree.wake);
+	printf("%llu files (%llu bytes) and %llu directories imported, %llu skipped, %llu failed.\n",
+		(unsigned long long) tree.files, (unsigned long long) tree.bytes, (unsigned long long) tree.directories,
+		(unsigned long long) tree.skipped, (unsigned long long) tree.failed);
+	if(fs_error(fs)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	if(tree.out_of_memory) {
+		report(MESSAGE_OUT_OF_MEMORY);
+	} else if(tree.failed != 0) {
+		report(MESSAGE_IMPORT_INCOMPLETE);
+	}
+	return 0;
+#else
+	report(MESSAGE_NO_THREADS);
+	return 0;
+#endif
 }
 
-Result verify_filename(uint8_t* filename) {
-	size_t len = strlen(filename);
-	// TODO: forbid ..
-	if (len > MAX_FILE_NAME) {
-		printf(MESSAGE_FILENAME_IS_LONG);
-		return 1;
+// import <name> <host file>, or import -r <host directory> <directory>
+Result action_import(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+	uint8_t *internal = after_command;
+	uint8_t *external;
+	split(internal, &external, ' ');
+	if(strcmp(internal, "-r") == 0) {
+		return action_import_tree(fs, current_dir, external);
 	}
-	while(*filename) {
-		if (!LUT[*(filename++)]) {
-			printf(MESSAGE_FILENAME_ILLEGAL_SYMBOLS);
+	if(verify_filename(fs, internal)) {
+		return 0;
+	}
+	uint8_t file_name[FILE_NAME_BUFFER];
+	memset(file_name, 0, FILE_NAME_BUFFER);
+	strcpy(file_name, internal);
+
+	switch (import_host_file(fs, current_dir, file_name, external)) {
+		case OPTIONAL_OK:
+			return 0;
+		case OPTIONAL_UNSUPPORTED:
+			report(MESSAGE_IS_DIR);
+			return 0;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_OUT_OF_SPACE);
+			return 1;
+		default:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+}
+Result action_frag(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name) {
+	DirEntry file;
+	uint8_t file_name_buffer[FILE_NAME_BUFFER];
+	memset(file_name_buffer, 0, FILE_NAME_BUFFER);
+	strcpy(file_name_buffer, file_name);
+	switch (resolve(fs, current_dir, &file, file_name_buffer)) {
+		case OPTIONAL_OK:
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_NOT_FOUND);
+			return 0;
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
 			return 1;
-		}
 	}
+	if(is_inline(&file)) {
+		printf("Stored inline, %llu bytes.\n", (unsigned long long) get_file_size(fs, &file));
+		return 0;
+	}
+	uint32_t clusters;
+	uint32_t extents;
+	count_extents(fs, get_cluster(&file), &clusters, &extents);
+	uint32_t score = clusters == 1 ? 0 : (uint64_t) (extents - 1) * 100 / (clusters - 1);
+	printf("%u clusters in %u extents, fragmentation %u%%.\n", clusters, extents, score);
 	return 0;
 }
 
-Result init_or_mount(uint8_t* input_buffer, FileSystem* fs) {
-	while(1) {
-		printf("init or mount?\n");
-		fgets(input_buffer, INPUT_BUFFER, stdin);
-		trim_untill_newline(input_buffer);
-		uint8_t* path;
-		split(input_buffer, &path, ' ');
-		string_to_lower(input_buffer);
-		if (strcmp(input_buffer, "init") == 0) {
-			if (init_fs_file(fs, path, FS_SIZE / CLUSTER_SIZE)) {
-				printf(MESSAGE_FS_CANT_INIT);
-				return 1;
+// compress <file>, decompress <file>: rewrites the file in the other storage mode
+Result action_compress(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name, uint8_t compress) {
+	if(verify_filename(fs, file_name)) {
+		return 0;
+	}
+	DirEntry file;
+	uint8_t file_name_buffer[FILE_NAME_BUFFER];
+	memset(file_name_buffer, 0, FILE_NAME_BUFFER);
+	strcpy(file_name_buffer, file_name);
+	switch (resolve(fs, current_dir, &file, file_name_buffer)) {
+		case OPTIONAL_OK:
+			if (is_folder(&file)) {
+				report(MESSAGE_IS_DIR);
+				return 0;
 			}
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_NOT_FOUND);
 			return 0;
-		} else if (strcmp(input_buffer, "mount") == 0) {
-			if (open_fs_file(fs, path)) {
-				printf(MESSAGE_FS_CANT_MOUNT);
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	if (is_inline(&file)) {
+		report(MESSAGE_IS_INLINE);
+		return 0;
+	}
+	if (is_compressed(&file) != compress) {
+		switch (convert_file(fs, &file, compress)) {
+			case OPTIONAL_OK:
+				break;
+			case OPTIONAL_STRUCTURE_ERROR:
+				report(MESSAGE_OUT_OF_SPACE);
+				return 0;
+			case OPTIONAL_UNSUPPORTED:
+				report(MESSAGE_LONG_NAME_FEATURE);
+				return 0;
+			default:
+				report(MESSAGE_IO_ERROR);
 				return 1;
+		}
+		if (resolve(fs, current_dir, &file, file_name_buffer) != OPTIONAL_OK) {
+			report(MESSAGE_IO_ERROR);
+			return 1;
+		}
+	}
+	uint32_t clusters;
+	uint32_t extents;
+	count_extents(fs, get_cluster(&file), &clusters, &extents);
+	printf("%llu bytes in %u clusters.\n", (unsigned long long) get_file_size(fs, &file), clusters);
+	return 0;
+}
+
+// clone <source> <name>: the copy shares the source's clusters until one of
+// the two files writes to them
+Result action_clone(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+	uint8_t* source_name = after_command;
+	uint8_t* target_name;
+	split(source_name, &target_name, ' ');
+	if(*target_name == '\0') {
+		report(MESSAGE_BAD_CLONE);
+		return 0;
+	}
+	if(verify_filename(fs, target_name)) {
+		return 0;
+	}
+	DirEntry source;
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, source_name);
+	switch (resolve(fs, current_dir, &source, name)) {
+		case OPTIONAL_OK:
+			if (is_folder(&source)) {
+				report(MESSAGE_IS_DIR);
+				return 0;
 			}
+			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_NOT_FOUND);
 			return 0;
-		} else if (strcmp(input_buffer, "exit") == 0) {
+		case OPTIONAL_IO_ERROR:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, target_name);
+	DirEntry existing;
+	if (resolve(fs, current_dir, &existing, name) == OPTIONAL_OK) {
+		report(MESSAGE_FILE_ALREADY_EXISTS);
+		return 0;
+	}
+	if (!name_fits_v2(name) && (is_compressed(&source) || is_sparse(&source))) {
+		report(MESSAGE_LONG_NAME_FEATURE);
+		return 0;
+	}
+	switch (clone_file(fs, current_dir, &source, name)) {
+		case OPTIONAL_OK:
+			return 0;
+		case OPTIONAL_UNSUPPORTED:
+			report(MESSAGE_NO_SHARING);
+			return 0;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_OUT_OF_SPACE);
+			return 0;
+		default:
+			report(MESSAGE_IO_ERROR);
 			return 1;
-		} else {
-			printf(MESSAGE_UNKNOWN_COMMAND);
-		}
 	}
 }
 
-Result action_write(uint8_t* input_buffer, FileSystem* fs, DirCursor* dir, uint8_t* after_command) {
-	if(verify_filename(after_command)) {
+// truncate <name> <size>: growing a file past its last cluster leaves a hole,
+// the file becomes sparse
+Result action_truncate(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+	uint8_t* size_text;
+	split(after_command, &size_text, ' ');
+	uint64_t length;
+	if(*size_text == '\0' || parse_size(size_text, &length)) {
+		report(MESSAGE_BAD_TRUNCATE);
 		return 0;
 	}
-	uint8_t file_name[FILE_NAME_BUFFER];
-	memset(file_name, 0, FILE_NAME_BUFFER);
-	strcpy(file_name, after_command);
 	DirEntry file;
-	FileIO file_io;
-	switch (resolve(fs, dir, &file, file_name)) {
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, after_command);
+	switch (resolve(fs, current_dir, &file, name)) {
 		case OPTIONAL_OK:
 			if (is_folder(&file)) {
-				printf(MESSAGE_IS_DIR);
+				report(MESSAGE_IS_DIR);
 				return 0;
 			}
 			break;
 		case OPTIONAL_STRUCTURE_ERROR:
-			init_meta(&file, 0, file_name);
-			switch (create_file(fs, dir, &file)) {
-				case OPTIONAL_OK:
-					break;
-				case OPTIONAL_STRUCTURE_ERROR:
-					printf(MESSAGE_OUT_OF_SPACE);
-					return 0;
-				case OPTIONAL_IO_ERROR:
-					printf(MESSAGE_IO_ERROR);
-					return 1;
-			}
-			break;
+			report(MESSAGE_NOT_FOUND);
+			return 0;
 		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
+			report(MESSAGE_IO_ERROR);
 			return 1;
 	}
-	open_file(fs, &file, &file_io);
-	while (1) {
-		fgets(input_buffer, INPUT_BUFFER, stdin);
-		if (input_buffer[0] == '\n') {
+	FileIO io;
+	open_file(fs, &file, &io);
+	OptionalResult ret = OPTIONAL_OK;
+	if (!io.compressed && !io.sparse && length / fs->cluster_size >= (io.is_inline ? 1 : io.clusters)) {
+		ret = make_sparse(fs, &io);
+	}
+	if (ret == OPTIONAL_OK || ret == OPTIONAL_UNSUPPORTED) { // Legacy entries are extended in full
+		ret = set_length(fs, &io, length);
+	}
+	if (close_file(fs, &io) && ret == OPTIONAL_OK) {
+		ret = OPTIONAL_IO_ERROR;
+	}
+	switch (ret) {
+		case OPTIONAL_OK:
 			break;
+		case OPTIONAL_STRUCTURE_ERROR:
+			report(MESSAGE_OUT_OF_SPACE);
+			return 0;
+		case OPTIONAL_UNSUPPORTED:
+			report(MESSAGE_COMPRESSED_LENGTH);
+			return 0;
+		default:
+			report(MESSAGE_IO_ERROR);
+			return 1;
+	}
+	if (resolve(fs, current_dir, &file, name) != OPTIONAL_OK) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	printf("%llu bytes, %llu allocated.\n", (unsigned long long) get_file_size(fs, &file),
+		(unsigned long long) get_allocated_size(fs, &file));
+	return 0;
+}
+
+#ifdef FS_THREADS
+typedef struct {
+	FileSystem* fs;
+	DirCursor directory;
+	uint32_t thread;
+	uint32_t threads;
+	uint32_t files;
+	uint32_t errors;
+} StressTask;
+
+FileCursor stress_length(FileSystem* fs, uint32_t thread, uint32_t file) {
+	return ((uint64_t) thread * 7919 + (uint64_t) file * 104729) % (3 * fs->cluster_size) + 1;
+}
+
+uint8_t stress_byte(uint32_t thread, uint32_t file, FileCursor position) {
+	return position * 31 + (position >> 8) + thread * 7 + file * 13;
+}
+
+void stress_name(uint8_t* name, uint32_t thread, uint32_t file) {
+	memset(name, 0, FILE_NAME_BUFFER);
+	sprintf(name, "t%uf%u", thread, file);
+}
+
+// Counts an error if the file has wrong contents. A missing or unfinished
+// file is only an error when it is `required`.
+uint32_t stress_check(StressTask* task, uint32_t thread, uint32_t file, uint8_t required) {
+	FileSystem* fs = task->fs;
+	uint8_t name[FILE_NAME_BUFFER];
+	stress_name(name, thread, file);
+	DirEntry entry;
+	OptionalResult found = resolve(fs, &task->directory, &entry, name);
+	if(found != OPTIONAL_OK) {
+		return required || found == OPTIONAL_IO_ERROR;
+	}
+	FileCursor length = stress_length(fs, thread, file);
+	if(is_folder(&entry) || get_file_size(fs, &entry) != length) {
+		return required;
+	}
+	FileIO io;
+	uint8_t buffer[STRESS_CHUNK];
+	uint32_t ret = 0;
+	open_file(fs, &entry, &io);
+	for(FileCursor done = 0; done < length && ret == 0; done += STRESS_CHUNK) {
+		size_t size = min(STRESS_CHUNK, length - done);
+		ret = read_from_file(fs, &io, buffer, size);
+		for(size_t i = 0; i != size && ret == 0; i++) {
+			ret = buffer[i] != stress_byte(thread, file, done + i);
 		}
-		switch (write_to_file(fs, &file_io, input_buffer, strlen(input_buffer))) {
-			case OPTIONAL_OK:
+	}
+	return close_file(fs, &io) || ret;
+}
+
+// Writes its own files while checking the odd files of the next thread, then
+// deletes its even files, which moves entries of files that others still write
+void* stress_thread(void* argument) {
+	StressTask* task = argument;
+	FileSystem* fs = task->fs;
+	uint8_t name[FILE_NAME_BUFFER];
+	uint8_t buffer[STRESS_CHUNK];
+	for(uint32_t i = 0; i != task->files; i++) {
+		DirEntry entry;
+		FileIO io;
+		stress_name(name, task->thread, i);
+		init_meta(&entry, 0, name);
+		if(create_file(fs, &task->directory, &entry) != OPTIONAL_OK) {
+			task->errors++;
+			continue;
+		}
+		open_file(fs, &entry, &io);
+		FileCursor length = stress_length(fs, task->thread, i);
+		for(FileCursor done = 0; done < length; done += STRESS_CHUNK) {
+			size_t size = min(STRESS_CHUNK, length - done);
+			for(size_t j = 0; j != size; j++) {
+				buffer[j] = stress_byte(task->thread, i, done + j);
+			}
+			if(write_to_file(fs, &io, buffer, size) != OPTIONAL_OK) {
+				task->errors++;
 				break;
-			case OPTIONAL_STRUCTURE_ERROR:
-				printf(MESSAGE_OUT_OF_SPACE);
-				goto close_file;
-			case OPTIONAL_IO_ERROR:
-				printf(MESSAGE_IO_ERROR);
-				return 1;
+			}
+		}
+		task->errors += close_file(fs, &io);
+		task->errors += stress_check(task, task->thread, i, 1);
+		task->errors += stress_check(task, (task->thread + 1) % task->threads, i | 1, 0);
+	}
+	for(uint32_t i = 0; i < task->files; i += 2) {
+		DirEntry entry;
+		stress_name(name, task->thread, i);
+		if(resolve(fs, &task->directory, &entry, name) != OPTIONAL_OK || delete_file(fs, &task->directory, &entry) != OPTIONAL_OK) {
+			task->errors++;
+		}
+	}
+	return NULL;
+}
+#endif
+
+// Fills the volume with one file, deletes it and fills it again. Space freed
+// by one command has to be usable by the next, so the second file must get
+// as many clusters as the first.
+uint32_t stress_refill(FileSystem* fs, DirCursor* directory) {
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, "fill");
+	uint8_t* buffer = calloc(1, STREAM_BUFFER);
+	if(buffer == NULL) {
+		return 1;
+	}
+	FileCursor filled[2] = { 0, 0 };
+	uint32_t errors = 0;
+	for(uint32_t round = 0; round != 2 && errors == 0; round++) {
+		DirEntry entry;
+		FileIO io;
+		init_meta(&entry, 0, name);
+		if(create_file(fs, directory, &entry) != OPTIONAL_OK) {
+			errors++;
+			break;
+		}
+		open_file(fs, &entry, &io);
+		OptionalResult ret;
+		do {
+			ret = write_to_file(fs, &io, buffer, STREAM_BUFFER);
+		} while(ret == OPTIONAL_OK);
+		errors += ret != OPTIONAL_STRUCTURE_ERROR;
+		errors += close_file(fs, &io);
+		if(resolve(fs, directory, &entry, name) != OPTIONAL_OK) {
+			errors++;
+			break;
 		}
+		filled[round] = get_allocated_size(fs, &entry);
+		errors += delete_file(fs, directory, &entry) != OPTIONAL_OK;
 	}
-	close_file:;
-	if (close_file(fs, &file_io)) {
-		printf(MESSAGE_IO_ERROR);
+	free(buffer);
+	return errors + (filled[0] == 0 || filled[1] < filled[0]);
+}
+
+// Shrinks a file and grows it again, within its last cluster and down to a
+// cluster boundary. What lies past the shrunk end has to read as zeros.
+uint32_t stress_regrow(FileSystem* fs, DirCursor* directory) {
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, "regrow");
+	FileCursor steps[2][3] = {
+		{ 3000, 100, 200 },
+		{ fs->cluster_size + 1, fs->cluster_size, fs->cluster_size + 904 }
+	};
+	uint8_t* buffer = malloc(2 * fs->cluster_size);
+	if(buffer == NULL) {
 		return 1;
 	}
-	return 0;
+	uint32_t errors = 0;
+	for(uint32_t i = 0; i != 2 && errors == 0; i++) {
+		DirEntry entry;
+		FileIO io;
+		init_meta(&entry, 0, name);
+		if(create_file(fs, directory, &entry) != OPTIONAL_OK) {
+			errors++;
+			break;
+		}
+		open_file(fs, &entry, &io);
+		memset(buffer, 'x', steps[i][0]);
+		errors += write_to_file(fs, &io, buffer, steps[i][0]) != OPTIONAL_OK;
+		errors += set_length(fs, &io, steps[i][1]) != OPTIONAL_OK;
+		errors += set_length(fs, &io, steps[i][2]) != OPTIONAL_OK;
+		errors += close_file(fs, &io);
+		if(resolve(fs, directory, &entry, name) != OPTIONAL_OK) {
+			errors++;
+			break;
+		}
+		open_file(fs, &entry, &io);
+		memset(buffer, 'y', steps[i][2]);
+		errors += get_file_size(fs, &entry) != steps[i][2] || read_from_file(fs, &io, buffer, steps[i][2]);
+		for(FileCursor j = 0; j != steps[i][2] && errors == 0; j++) {
+			errors += buffer[j] != (j < steps[i][1] ? 'x' : 0);
+		}
+		errors += close_file(fs, &io);
+		errors += delete_file(fs, directory, &entry) != OPTIONAL_OK;
+	}
+	free(buffer);
+	return errors;
 }
-Result action_mkdir(FileSystem* fs, DirCursor* current_dir, uint8_t* dir_name) {
-	if(verify_filename(dir_name)) {
+
+// stress [threads] [files per thread]: runs the threads in a new "stress"
+// directory, checks what is left, fills the volume twice, shrinks and grows
+// a file and removes it all
+Result action_stress(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
+#ifdef FS_THREADS
+	uint8_t* files_text;
+	split(after_command, &files_text, ' ');
+	uint64_t threads = STRESS_THREADS;
+	uint64_t files = STRESS_FILES;
+	if((*after_command && parse_size(after_command, &threads)) || (*files_text && parse_size(files_text, &files))
+			|| threads == 0 || threads > MAX_DEPTH || files == 0 || files > UINT16_MAX) {
+		report(MESSAGE_BAD_STRESS);
 		return 0;
 	}
 	DirEntry directory;
-	uint8_t name_buffer[FILE_NAME_BUFFER];
-	memset(name_buffer, 0, FILE_NAME_BUFFER);
-	strcpy(name_buffer, dir_name);
-	switch (resolve(fs, current_dir, &directory, name_buffer)) {
-		case OPTIONAL_OK:
-			printf(MESSAGE_FILE_ALREADY_EXISTS);
-			return 0;
-		case OPTIONAL_STRUCTURE_ERROR:
-			break;
-		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
-			return 1;
-	}
-	init_meta(&directory, 1, name_buffer);
+	uint8_t name[FILE_NAME_BUFFER];
+	memset(name, 0, FILE_NAME_BUFFER);
+	strcpy(name, "stress");
+	init_meta(&directory, 1, name);
 	switch (create_file(fs, current_dir, &directory)) {
-		case OPTIONAL_OK:
-			return 0;
-		case OPTIONAL_STRUCTURE_ERROR:
-			printf(MESSAGE_OUT_OF_SPACE);
-			return 0;
-		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
-			return 1;
-	}
-}
-Result action_read(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name) {
-	DirEntry file;
-	uint8_t file_name_buffer[FILE_NAME_BUFFER];
-	memset(file_name_buffer, 0, FILE_NAME_BUFFER);
-	strcpy(file_name_buffer, file_name);
-	switch (resolve(fs, current_dir, &file, file_name_buffer)) {
 		case OPTIONAL_OK:
 			break;
 		case OPTIONAL_STRUCTURE_ERROR:
-			printf(MESSAGE_NOT_FOUND);
+			report(MESSAGE_FILE_ALREADY_EXISTS);
 			return 0;
-		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
+		default:
+			report(MESSAGE_IO_ERROR);
 			return 1;
 	}
-	if (is_folder(&file)) {
-		printf(MESSAGE_IS_DIR);
+	StressTask* tasks = calloc(threads, sizeof(StressTask));
+	pthread_t* handles = calloc(threads, sizeof(pthread_t));
+	if(tasks == NULL || handles == NULL) {
+		free(tasks);
+		free(handles);
+		report(MESSAGE_OUT_OF_MEMORY);
 		return 0;
 	}
-	FileIO file_io;
-	uint8_t buffer[IO_BUFFER];
-	FileCursor size = get_file_size(fs, &file);
-	FileCursor counter = 0;
-	open_file(fs, &file, &file_io);
-	printf("File length: %d.\nFile contents:\n", size);
-	while (counter < size) {
-		size_t to_read = min(IO_BUFFER-1, size - counter);
-		if (read_from_file(fs, &file_io, buffer, to_read)) {
-			printf(MESSAGE_IO_ERROR);
-			return 1;
+	uint32_t started = 0;
+	uint32_t errors = 0;
+	for(; started != threads; started++) {
+		tasks[started].fs = fs;
+		open_dir(fs, &directory, &tasks[started].directory);
+		tasks[started].thread = started;
+		tasks[started].threads = threads;
+		tasks[started].files = files;
+		if(pthread_create(&handles[started], NULL, stress_thread, &tasks[started])) {
+			errors++;
+			break;
 		}
-		buffer[to_read] = '\0';
-		printf("%s", buffer);
-		counter += to_read;
 	}
-	if(close_file(fs, &file_io)) {
-		printf(MESSAGE_IO_ERROR);
-		return 1;
+	for(uint32_t t = 0; t != started; t++) {
+		pthread_join(handles[t], NULL);
+		errors += tasks[t].errors;
+	}
+	// Only the odd files of finished threads remain
+	uint32_t expected = 0;
+	for(uint32_t t = 0; t != started; t++) {
+		for(uint32_t i = 1; i < files; i += 2) {
+			errors += stress_check(&tasks[0], t, i, 1);
+			expected++;
+		}
 	}
-	return 0;
-}
-Result action_dir(FileSystem* fs, DirCursor* current_dir, uint8_t* file_name) {
 	DirIter iter;
 	DirEntry entry;
-
-	dir_iter(fs, current_dir, &iter);
-
-	while (1) {
-		switch (dir_iter_next(fs, &iter, &entry)) {
-			case OPTIONAL_OK:
-				printf("%s - ", get_file_name(&entry));
-				if (is_folder(&entry)) {
-					printf("DIR\n");
-				} else {
-					printf("FILE - %d bytes\n", get_file_size(fs, &entry));
-				}
-				break;
-			case OPTIONAL_STRUCTURE_ERROR:
-				return 0;
-			case OPTIONAL_IO_ERROR:
-				printf(MESSAGE_IO_ERROR);
-				return 1;
+	uint32_t found = 0;
+	dir_iter(fs, &tasks[0].directory, &iter);
+	while(dir_iter_next(fs, &iter, &entry) == OPTIONAL_OK) {
+		found++;
+	}
+	errors += found != expected;
+	errors += stress_refill(fs, &tasks[0].directory);
+	errors += stress_regrow(fs, &tasks[0].directory);
+	for(uint32_t t = 0; t != started; t++) {
+		for(uint32_t i = 1; i < files; i += 2) {
+			stress_name(name, t, i);
+			if(resolve(fs, &tasks[0].directory, &entry, name) == OPTIONAL_OK) {
+				delete_file(fs, &tasks[0].directory, &entry);
+			}
 		}
 	}
+	delete_file(fs, current_dir, &directory);
+	free(tasks);
+	free(handles);
+	printf("%u threads, %llu files each, %u errors.\n", started, (unsigned long long) files, errors);
+	if(fs_error(fs)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	return 0;
+#else
+	report(MESSAGE_NO_THREADS);
+	return 0;
+#endif
 }
-Result action_export(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
-	uint8_t *internal = after_command;
-	uint8_t *external;
-	split(internal, &external, ' ');
 
-	uint8_t file_name[FILE_NAME_BUFFER];
-	memset(file_name, 0, FILE_NAME_BUFFER);
-	strcpy(file_name, internal);
-	DirEntry file;
-	switch (resolve(fs, current_dir, &file, file_name)) {
-		case OPTIONAL_OK:
-			break;
-		case OPTIONAL_STRUCTURE_ERROR:
-			printf(MESSAGE_NOT_FOUND);
+// fsck [repair] [threads]: checks the FAT chains and the directory tree
+Result action_fsck(FileSystem* fs, uint8_t* after_command) {
+	uint8_t repair = 0;
+	uint64_t threads = FSCK_THREADS;
+	uint8_t* arguments = after_command;
+	while(*arguments) {
+		uint8_t* argument = arguments;
+		split(argument, &arguments, ' ');
+		string_to_lower(argument);
+		if (strcmp(argument, "repair") == 0) {
+			repair = 1;
+		} else if (parse_size(argument, &threads) || threads == 0 || threads > MAX_DEPTH) {
+			report(MESSAGE_BAD_FSCK);
 			return 0;
-		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
-			return 1;
+		}
 	}
-	FileIO internal_file;
-	FileCursor size = get_file_size(fs, &file);
-	FileCursor cursor = 0;
-	FILE *external_file = fopen(external, "wb");
-	if (external_file == NULL) {
-		printf(MESSAGE_IO_ERROR);
+	Fsck check;
+	if(check_volume(fs, &check, repair, threads)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	if(check.out_of_memory) {
+		report(MESSAGE_OUT_OF_MEMORY);
 		return 0;
 	}
-	open_file(fs, &file, &internal_file);
-	while(cursor < size) {
-		size_t to_transfer = min(size - cursor, IO_BUFFER);
-		uint8_t buffer[IO_BUFFER];
-		if (read_from_file(fs, &internal_file, buffer, to_transfer)) {
-			fclose(external_file);
-			printf(MESSAGE_IO_ERROR);
-			return 1;
-		}
-		fwrite(buffer, 1, to_transfer, external_file);
-		if (ferror(external_file)) {
-			fclose(external_file);
-			printf(MESSAGE_IO_ERROR);
-			return 1;
-		}
-		cursor += to_transfer;
+	printf("%llu directories, %llu files, %llu problems", (unsigned long long) check.directories, (unsigned long long) check.files, (unsigned long long) check.problems);
+	if(repair) {
+		printf(", %llu repaired", (unsigned long long) (check.problems - check.unrepaired));
 	}
-	if (close_file(fs, &internal_file)) {
-		printf(MESSAGE_IO_ERROR);
-		return 1;
+	printf(".\n");
+	if(check.problems != 0 && (!repair || check.unrepaired != 0)) {
+		report(MESSAGE_VOLUME_DAMAGED);
 	}
-
-	fclose(external_file);
 	return 0;
 }
-Result action_import(FileSystem* fs, DirCursor* current_dir, uint8_t* after_command) {
-	uint8_t *internal = after_command;
-	uint8_t *external;
-	split(internal, &external, ' ');
-	if(verify_filename(internal)) {
-		return 0;
+
+void record_command(CommandStats* commands, uint8_t* name, uint64_t elapsed) {
+	uint32_t i = 0;
+	while (i != MAX_COMMANDS - 1 && commands[i].name[0] != '\0' && strcmp(commands[i].name, name) != 0) {
+		i++;
 	}
-	uint8_t file_name[FILE_NAME_BUFFER];
-	memset(file_name, 0, FILE_NAME_BUFFER);
-	strcpy(file_name, internal);
+	CommandStats* command = &commands[i];
+	// The last slot collects every command that did not get one of its own
+	strcpy(command->name, i == MAX_COMMANDS - 1 ? (uint8_t*) "other" : name);
+	uint32_t bucket = 0;
+	while (bucket != LATENCY_BUCKETS - 1 && elapsed >= (uint64_t) 1 << bucket) {
+		bucket++;
+	}
+	command->runs++;
+	command->total += elapsed;
+	command->longest = max(command->longest, elapsed);
+	command->buckets[bucket]++;
+}
 
-	DirEntry file;
-	FileIO internal_file;
+// Upper bound of the bucket that holds the given share of the runs
+uint64_t latency_percentile(CommandStats* command, uint32_t percent) {
+	uint64_t wanted = (command->runs * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (uint32_t bucket = 0; bucket != LATENCY_BUCKETS; bucket++) {
+		seen += command->buckets[bucket];
+		if (seen >= wanted) {
+			return (uint64_t) 1 << bucket;
+		}
+	}
+	return command->longest;
+}
 
-	switch (resolve(fs, current_dir, &file, file_name)) {
-		case OPTIONAL_OK:
-			if (is_folder(&file)) {
-				printf(MESSAGE_IS_DIR);
+void print_stats(FileSystem* fs, CommandStats* commands) {
+	Stats* stats = &fs->stats;
+	printf("Host: %llu reads, %llu writes, %llu seeks, %llu bytes read, %llu bytes written.\n",
+		(unsigned long long) stats->host_reads, (unsigned long long) stats->host_writes, (unsigned long long) stats->host_seeks,
+		(unsigned long long) stats->bytes_read, (unsigned long long) stats->bytes_written);
+	printf("Files: %llu reads over %llu clusters, %llu writes over %llu clusters.\n",
+		(unsigned long long) stats->file_reads, (unsigned long long) stats->clusters_read,
+		(unsigned long long) stats->file_writes, (unsigned long long) stats->clusters_written);
+	printf("Metadata: %llu allocations, %llu FAT hops, %llu lookups comparing %llu entries.\n",
+		(unsigned long long) stats->allocations, (unsigned long long) stats->fat_hops,
+		(unsigned long long) stats->lookups, (unsigned long long) stats->entries_compared);
+	printf("Cache: %u hits, %u misses, %u write-backs.\n", fs->cache.hits, fs->cache.misses, fs->cache.writebacks);
+	printf("Dentries: %u hits, %u misses.\n", fs->dentries.hits, fs->dentries.misses);
+	if (stats->packed_in != 0 || stats->unpacked != 0) {
+		printf("Compression: %llu bytes packed into %llu (ratio %.2f) at %llu MB/s, %llu bytes unpacked at %llu MB/s.\n",
+			(unsigned long long) stats->packed_in, (unsigned long long) stats->packed_out,
+			stats->packed_out == 0 ? 0.0 : (double) stats->packed_in / stats->packed_out,
+			(unsigned long long) (stats->packed_in / max(stats->pack_time, 1)),
+			(unsigned long long) stats->unpacked, (unsigned long long) (stats->unpacked / max(stats->unpack_time, 1)));
+	}
+	if (stats->dedup_linked != 0 || fs->join_points != 0) {
+		printf("Dedup: %llu clusters linked, %llu written, %u join points.\n",
+			(unsigned long long) stats->dedup_linked, (unsigned long long) stats->dedup_written, fs->join_points);
+	}
+	for (uint32_t i = 0; i != MAX_COMMANDS && commands[i].name[0] != '\0'; i++) {
+		CommandStats* command = &commands[i];
+		printf("%s: %llu runs, %llu us average, p50 < %llu us, p99 < %llu us, max %llu us\n", command->name,
+			(unsigned long long) command->runs, (unsigned long long) (command->total / command->runs),
+			(unsigned long long) latency_percentile(command, 50), (unsigned long long) latency_percentile(command, 99),
+			(unsigned long long) command->longest);
+		for (uint32_t bucket = 0; bucket != LATENCY_BUCKETS; bucket++) {
+			if (command->buckets[bucket] != 0) {
+				printf("  < %llu us: %llu\n", (unsigned long long) 1 << bucket, (unsigned long long) command->buckets[bucket]);
+			}
+		}
+	}
+}
+
+void reset_stats(FileSystem* fs, CommandStats* commands) {
+	memset(&fs->stats, 0, sizeof(Stats));
+	fs->cache.hits = fs->cache.misses = fs->cache.writebacks = 0;
+	fs->dentries.hits = fs->dentries.misses = 0;
+	memset(commands, 0, MAX_COMMANDS * sizeof(CommandStats));
+}
+
+// dcache [bytes]: shows the dentry cache, or sets its memory bound (0 turns it off)
+Result action_dcache(FileSystem* fs, uint8_t* after_command) {
+	uint64_t bytes;
+	if(*after_command) {
+		if(parse_size(after_command, &bytes) || bytes > SIZE_MAX) {
+			report(MESSAGE_BAD_DCACHE);
+			return 0;
+		}
+		if(resize_dentry_cache(fs, bytes)) {
+			report(MESSAGE_OUT_OF_MEMORY);
+			return 0;
+		}
+	}
+	DentryCache* cache = &fs->dentries;
+	printf("%u of %u entries used (%llu bytes), %u hits, %u misses.\n", cache->used, cache->slot_count,
+		(unsigned long long) cache->slot_count * sizeof(Dentry), cache->hits, cache->misses);
+	return 0;
+}
+
+// queue [depth]: shows or sets how many io_uring requests may be in flight at once
+Result action_queue(FileSystem* fs, uint8_t* after_command) {
+#ifdef FS_URING
+	if(fs->backend == BACKEND_URING) {
+		uint64_t depth;
+		if(*after_command) {
+			if(parse_size(after_command, &depth) || set_queue_depth(fs, depth > IO_QUEUE_MAX ? 0 : depth)) {
+				report(MESSAGE_BAD_QUEUE);
 				return 0;
 			}
-			break;
-		case OPTIONAL_STRUCTURE_ERROR:
-			init_meta(&file, 0, file_name);
-			create_file(fs, current_dir, &file);
-			break;
-		case OPTIONAL_IO_ERROR:
-			printf(MESSAGE_IO_ERROR);
-			return 1;
+		}
+		printf("Queue depth %u.\n", fs->uring.depth);
+		return 0;
 	}
-	FILE *external_file = fopen(external, "rb");
-	if (external_file == NULL || ferror(external_file)) {
-		printf(MESSAGE_IO_ERROR);
-		return 1;
+#endif
+	report(MESSAGE_NO_URING);
+	return 0;
+}
+
+// dedup [on|off]: links imports to clusters already on the volume, or without
+// arguments merges the identical tails of the files already stored
+Result action_dedup(FileSystem* fs, uint8_t* after_command) {
+	if(fs->refs_offset == 0) {
+		report(MESSAGE_NO_SHARING);
+		return 0;
 	}
-	open_file(fs, &file, &internal_file);
-	while(!feof(external_file)) {
-		uint8_t buffer[IO_BUFFER];
-		size_t read = fread(buffer, 1, IO_BUFFER, external_file);
-		if(ferror(external_file)) {
-			printf(MESSAGE_IO_ERROR);
-			goto bad_exit;
+	if(*after_command) {
+		uint8_t on = strcmp(after_command, "on") == 0;
+		if(!on && strcmp(after_command, "off") != 0) {
+			report(MESSAGE_BAD_DEDUP);
+			return 0;
 		}
-		switch (write_to_file(fs, &internal_file, buffer, read)) {
-			case OPTIONAL_OK:
-				break;
-			case OPTIONAL_STRUCTURE_ERROR:
-				printf(MESSAGE_OUT_OF_SPACE);
-				goto bad_exit;
-			case OPTIONAL_IO_ERROR:
-				printf(MESSAGE_IO_ERROR);
-				goto bad_exit;
+		fs_lock_exclusive(fs);
+		Result failed = on ? dedup_enable(fs) : (dedup_free(fs), 0);
+		fs_unlock(fs);
+		if(failed) {
+			report(MESSAGE_OUT_OF_MEMORY);
 		}
+		return 0;
 	}
-
-	if (close_file(fs, &internal_file)) {
-		printf(MESSAGE_IO_ERROR);
-		goto bad_exit;
+	uint32_t released;
+	if(dedup_volume(fs, &released)) {
+		if(fs_error(fs)) {
+			report(MESSAGE_IO_ERROR);
+			return 1;
+		}
+		report(MESSAGE_OUT_OF_MEMORY);
 	}
+	printf("%u clusters released, %u join points.\n", released, fs->join_points);
+	return 0;
+}
 
-	fclose(external_file);
+// In tenths of a percent
+uint32_t fragmentation_score(uint64_t jumps, uint64_t links) {
+	return links == 0 ? 0 : jumps * 1000 / links;
+}
+
+// defrag [milliseconds]: one time-bounded pass, the most fragmented files first
+Result action_defrag(FileSystem* fs, uint8_t* after_command) {
+	uint64_t pass = DEFRAG_PASS;
+	if(*after_command && (parse_size(after_command, &pass) || pass > UINT32_MAX)) {
+		report(MESSAGE_BAD_DEFRAG);
+		return 0;
+	}
+	DefragReport result;
+	if(defrag_volume(fs, pass * 1000, &result)) {
+		report(MESSAGE_IO_ERROR);
+		return 1;
+	}
+	if(result.out_of_memory) {
+		report(MESSAGE_OUT_OF_MEMORY);
+		return 0;
+	}
+	uint32_t before = fragmentation_score(result.jumps_before, result.links);
+	uint32_t after = fragmentation_score(result.jumps_after, result.links);
+	printf("Fragmentation %u.%u%% -> %u.%u%%, fragmented files %u -> %u, %u moved (%llu clusters), %u without a free run, %u left for the next pass.\n",
+		before / 10, before % 10, after / 10, after % 10, result.fragmented, result.fragmented - result.moved,
+		result.moved, (unsigned long long) result.moved_clusters, result.no_room, result.left);
 	return 0;
+}
 
-	bad_exit:
-	fclose(external_file);
-	return 1;
+// saod fsck <path> [repair] [threads]: checks an image without the shell
+int fsck_tool(int argc, char** argv) {
+	FileSystem fs;
+	uint8_t arguments[INPUT_BUFFER] = "";
+	for (int i = 3; i < argc; i++) {
+		if (strlen(arguments) + strlen(argv[i]) + 2 > INPUT_BUFFER) {
+			return 1;
+		}
+		strcat(arguments, argv[i]);
+		strcat(arguments, i + 1 < argc ? " " : "");
+	}
+	if (open_fs_file(&fs, argv[2], BACKEND_STDIO)) {
+		report(MESSAGE_FS_CANT_MOUNT);
+		return 1;
+	}
+	action_fsck(&fs, arguments);
+	if (close_fs_file(&fs)) {
+		report(MESSAGE_IO_ERROR);
+	}
+	if (command_status == STATUS_IO_ERROR) {
+		return 1;
+	}
+	return command_status == STATUS_OK ? 0 : 2;
 }
 
-int main() {
+// Without arguments the shell is interactive. Batch mode is
+//   saod [-f script] init|mount <path> [arguments]
+// where the arguments are those of the interactive init and mount, and the
+// commands come from the script or stdin. There are no prompts, output is
+// fully buffered and the output of the n-th command is followed by a
+// "= <n> <status>" line with one of the STATUS_ codes. Empty lines and lines
+// starting with # are skipped. The exit code is 0 if all commands
+// succeeded, 2 if some failed and 1 after an I/O error. `saod fsck` uses the
+// same codes, 2 meaning that errors were left on the volume.
+int main(int argc, char** argv) {
 	init_table();
 
+	if (argc > 2 && strcmp(argv[1], "fsck") == 0) {
+		return fsck_tool(argc, argv);
+	}
+
 	uint8_t input_buffer[INPUT_BUFFER];
 	FileSystem fs;
+	FILE* input = stdin;
+	uint8_t batch = argc > 1;
+	uint8_t dump_stats = 0;
+	CommandStats latencies[MAX_COMMANDS];
+	memset(latencies, 0, sizeof(latencies));
 
-	if (init_or_mount(input_buffer, &fs)) {
+	if (batch) {
+		int first = 1;
+		if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+			input = fopen(argv[2], "r");
+			if (input == NULL) {
+				fprintf(stderr, "Can't open %s.\n", argv[2]);
+				return 1;
+			}
+			first = 3;
+		}
+		input_buffer[0] = '\0';
+		for (int i = first; i < argc; i++) {
+			if (strlen(input_buffer) + strlen(argv[i]) + 2 > INPUT_BUFFER) {
+				return 1;
+			}
+			strcat(input_buffer, argv[i]);
+			strcat(input_buffer, i + 1 < argc ? " " : "");
+		}
+		setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+		if (open_volume(input_buffer, &fs, &dump_stats) != OPTIONAL_OK) {
+			return 1;
+		}
+	} else if (init_or_mount(input_buffer, &fs, &dump_stats)) {
 		return 1;
 	}
 
 	DirCursor directory_stack[MAX_DEPTH];
 	size_t directory_stack_ptr = 0;
 	uint8_t current_path[DIR_STRING_BUFFER] = "/";
+	uint32_t commands = 0;
+	uint8_t failed = 0;
 
 	get_root(&fs, &directory_stack[0]);
 	while (1) {
-		printf("%s> ", current_path);
-		fgets(input_buffer, INPUT_BUFFER, stdin);
+		if (!batch) {
+			printf("%s> ", current_path);
+		}
+		if (fgets(input_buffer, INPUT_BUFFER, input) == NULL) {
+			break;
+		}
 		trim_untill_newline(input_buffer);
+		if (input_buffer[0] == '\0' || input_buffer[0] == '#') {
+			continue;
+		}
+		commands++;
+		command_status = STATUS_OK;
 
 		uint8_t *after_command;
 		uint8_t *root_command = input_buffer;
 		split(root_command, &after_command, ' ');
 		string_to_lower(root_command);
+		uint8_t command[COMMAND_NAME];
+		snprintf(command, COMMAND_NAME, "%.*s", COMMAND_NAME - 1, root_command);
+		uint64_t started = now_us();
 
 		// Записать строку в файл
 		if (strcmp(root_command, "exit") == 0) {
@@ -908,7 +7692,7 @@ int main() {
 				break;
 			}
 		} else if (strcmp(root_command, "write") == 0) {
-			if(action_write(input_buffer, &fs, &directory_stack[directory_stack_ptr], after_command)) {
+			if(action_write(input_buffer, input, &fs, &directory_stack[directory_stack_ptr], after_command)) {
 				break;
 			}
 		} else if (strcmp(root_command, "mkdir") == 0) {
@@ -927,18 +7711,68 @@ int main() {
 			if(action_export(&fs, &directory_stack[directory_stack_ptr], after_command)) {
 				break;
 			}
+		} else if (strcmp(root_command, "frag") == 0) {
+			if(action_frag(&fs, &directory_stack[directory_stack_ptr], after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "compress") == 0 || strcmp(root_command, "decompress") == 0) {
+			if(action_compress(&fs, &directory_stack[directory_stack_ptr], after_command, root_command[0] == 'c')) {
+				break;
+			}
+		} else if (strcmp(root_command, "truncate") == 0) {
+			if(action_truncate(&fs, &directory_stack[directory_stack_ptr], after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "clone") == 0) {
+			if(action_clone(&fs, &directory_stack[directory_stack_ptr], after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "stress") == 0) {
+			if(action_stress(&fs, &directory_stack[directory_stack_ptr], after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "defrag") == 0) {
+			if(action_defrag(&fs, after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "dedup") == 0) {
+			if(action_dedup(&fs, after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "fsck") == 0) {
+			if(action_fsck(&fs, after_command)) {
+				break;
+			}
+		} else if (strcmp(root_command, "sync") == 0) {
+			if(sync_fs_file(&fs)) {
+				report(MESSAGE_IO_ERROR);
+				break;
+			}
+		} else if (strcmp(root_command, "stats") == 0) {
+			if (strcmp(after_command, "reset") == 0) {
+				reset_stats(&fs, latencies);
+			} else {
+				print_stats(&fs, latencies);
+			}
+		} else if (strcmp(root_command, "cache") == 0) {
+			printf("%u hits, %u misses, %u write-backs.\n", fs.cache.hits, fs.cache.misses, fs.cache.writebacks);
+		} else if (strcmp(root_command, "dcache") == 0) {
+			action_dcache(&fs, after_command);
+		} else if (strcmp(root_command, "queue") == 0) {
+			action_queue(&fs, after_command);
+		} else if (strcmp(root_command, "free") == 0) {
+			printf("%u of %u clusters free (%llu bytes).\n", available_clusters(&fs), fs.clusters_count, (unsigned long long) available_clusters(&fs) * fs.cluster_size);
 		} else if (strcmp(root_command, "cd") == 0) {
 			uint8_t* path = after_command;
 			if (strcmp(path, "..") == 0) {
-				if (directory_stack_ptr == 0) {
-					continue;
-				}
-				directory_stack_ptr--;
-				size_t i = strlen(current_path) - 1;
-				while(current_path[i-1] != '/') {
-					i--;
+				if (directory_stack_ptr != 0) {
+					directory_stack_ptr--;
+					size_t i = strlen(current_path) - 1;
+					while(current_path[i-1] != '/') {
+						i--;
+					}
+					current_path[i] = '\0';
 				}
-				current_path[i] = '\0';
 			} else {
 				if (*path == '/') {
 					strcpy(current_path, "/");
@@ -958,7 +7792,7 @@ int main() {
 					switch (resolve(&fs, &directory_stack[directory_stack_ptr], &next_dir, folder_name)) {
 						case OPTIONAL_OK:
 							if(!is_folder(&next_dir)) {
-								printf(MESSAGE_IS_NOT_DIR);
+								report(MESSAGE_IS_NOT_DIR);
 								goto exit_loop;
 							}
 							directory_stack_ptr++;
@@ -968,19 +7802,40 @@ int main() {
 							strcat(current_path, "/");
 							break;
 						case OPTIONAL_STRUCTURE_ERROR:
-							printf(MESSAGE_NOT_FOUND);
+							report(MESSAGE_NOT_FOUND);
 							goto exit_loop;
 						case OPTIONAL_IO_ERROR:
-							printf(MESSAGE_IO_ERROR);
+							report(MESSAGE_IO_ERROR);
 							return 1;
 					}
 				}
 				exit_loop:;
 			}
+		} else {
+			report(MESSAGE_UNKNOWN_COMMAND);
 		}
+		if (command_status != STATUS_UNKNOWN_COMMAND) {
+			record_command(latencies, command, now_us() - started);
+		}
+		if (batch) {
+			printf("= %u %u\n", commands, command_status);
+		}
+		failed |= command_status != STATUS_OK;
+	}
+	if (batch && command_status == STATUS_IO_ERROR) {
+		printf("= %u %u\n", commands, command_status);
+	}
+	if (dump_stats) {
+		print_stats(&fs, latencies);
 	}
 	if(close_fs_file(&fs)) {
-		printf(MESSAGE_IO_ERROR);
+		report(MESSAGE_IO_ERROR);
 	}
-	return 0;
+	if (input != stdin) {
+		fclose(input);
+	}
+	if (command_status == STATUS_IO_ERROR) {
+		return 1;
+	}
+	return batch && failed ? 2 : 0;
 }